@@ -0,0 +1,65 @@
+// Copyright 2016-2021 Lawrence Livermore National Security, LLC and other
+// IREP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+// Benchmark name lookup in ir_read, using the wide table from gen_wide.lua.
+//
+// Reports the cost of ir_read per key.  The GNUmakefile runs it against
+// the usual libIR, which finds each key in the generated hash tables, and
+// against one built with IREP_LINEAR_FIND, which scans the ir_element
+// table with strcmp (how ir_read used to find each key); LABEL says which.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "lua.h"
+#include "lualib.h"
+#include "lauxlib.h"
+#include "ir_extern.h"
+#include "ir_index.h"
+#include "wkt_wide.h"
+
+static double usec_clock(void) {
+  struct timespec ts;
+  (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+  return 1.0e6*ts.tv_sec + ts.tv_nsec/1000.0;
+}
+
+int main(int argc, char *argv[]) {
+  lua_State *L = luaL_newstate();
+  int i, r, nkeys, ti = -1, nrep = 200;
+  const char *label = (argc > 3) ? argv[3] : "hashed";
+  double t0, t_read;
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s wide.lua [NREP [LABEL]]\n", argv[0]);
+    return 1;
+  }
+  if (argc > 2) nrep = atoi(argv[2]);
+  luaL_openlibs(L);
+  if (luaL_loadfile(L, argv[1]) || lua_pcall(L, 0, 0, 0)) {
+    fprintf(stderr, "cannot run %s: %s\n", argv[1], lua_tostring(L,-1));
+    return 1;
+  }
+
+  for (i=0; i < (int)ir_wktt_size; i++)
+    if (strcmp(ir_wktt[i].e.name, "wide") == 0) ti = ir_wktt[i].e.ti;
+  if (ti < 0) {
+    fprintf(stderr, "no wide table in the index\n");
+    return 1;
+  }
+  for (nkeys=0; ir_ta[ti][nkeys].name; nkeys++) {}
+
+  if (ir_read(L, "wide")) return 1;
+  t0 = usec_clock();
+  for (r=0; r < nrep; r++) (void)ir_read(L, "wide");
+  t_read = usec_clock() - t0;
+
+  printf("fields: %d, repetitions: %d, lookup: %s\n", nkeys, nrep, label);
+  printf("ir_read: %10.3f us/read %8.1f ns/key\n",
+    t_read/nrep, 1000.0*t_read/(nrep*(double)nkeys));
+  printf("wide.zone_var0001 = %g\n", wide.zone_var0001);
+  return 0;
+}
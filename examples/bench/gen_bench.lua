@@ -0,0 +1,91 @@
+-- Copyright 2016-2021 Lawrence Livermore National Security, LLC and other
+-- IREP Project Developers. See the top-level LICENSE file for details.
+--
+-- SPDX-License-Identifier: MIT
+
+-- Generate the synthetic well-known tables for irep-bench, and a Lua
+-- input deck for each benchmark size.
+--
+-- Usage: lua gen_bench.lua NWIDE DEPTH NVEC NELEM NCB SIZE...
+--
+-- Writes wkt_bench.h, with these well-known tables:
+--   bench_wide   a struct with NWIDE double fields
+--   bench_deep   structs nested DEPTH deep
+--   bench_vec    a Vir_dbl of NVEC values
+--   bench_elems  a Vstructure of NELEM structs
+--   bench_cb     NCB callbacks; the odd ones compile, the even ones
+--                run in Lua (see ir_cb_compiled)
+-- and bench_SIZE.lua for each SIZE, which fills SIZE values of the
+-- vector, SIZE/10 of the structs, and all of the other tables.
+
+local nwide, depth, nvec, nelem, ncb =
+   tonumber(arg[1]), tonumber(arg[2]), tonumber(arg[3]), tonumber(arg[4]),
+   tonumber(arg[5])
+assert(ncb and #arg > 5, "usage: lua gen_bench.lua NWIDE DEPTH NVEC NELEM NCB SIZE...")
+
+local h = assert(io.open("wkt_bench.h", "w"))
+local function w(...) h:write(string.format(...)) end
+w("// Generated by gen_bench.lua. Do not modify.\n\n")
+w("#ifndef wkt_bench_h\n#define wkt_bench_h\n")
+w('#include "ir_start.h"\n\n')
+
+w("Beg_struct(irt_bench_wide)\n")
+for i = 1, nwide do w("  ir_dbl(w%04d,0.0)\n", i) end
+w("End_struct(irt_bench_wide)\n\n")
+
+for d = depth, 1, -1 do
+   w("Beg_struct(irt_bench_d%d)\n", d)
+   w("  ir_int(i,0)\n  ir_dbl(x,0.0)\n")
+   if d < depth then w(" Structure(irt_bench_d%d,d)\n", d+1) end
+   w("End_struct(irt_bench_d%d)\n\n", d)
+end
+
+w("Beg_struct(irt_bench_vec)\n  ir_int(n,0)\n  Vir_dbl(v,%d,0.0)\nEnd_struct(irt_bench_vec)\n\n", nvec)
+
+w("Beg_struct(irt_bench_elem)\n  ir_int(id,0)\n  ir_dbl(x,0.0)\n")
+w("  Vir_dbl(v,4,0.0)\n  ir_str(name,16,\"\")\nEnd_struct(irt_bench_elem)\n\n")
+w("Beg_struct(irt_bench_elems)\n Vstructure(irt_bench_elem,e,1:%d,%d)\n", nelem, nelem)
+w("End_struct(irt_bench_elems)\n\n")
+
+w("Beg_struct(irt_bench_cb)\n")
+for i = 1, ncb do w(" Callback(c%03d,1,1)\n", i) end
+w("End_struct(irt_bench_cb)\n\n")
+
+w("ir_wkt(irt_bench_wide, bench_wide)\n")
+w("ir_wkt(irt_bench_d1, bench_deep)\n")
+w("ir_wkt(irt_bench_vec, bench_vec)\n")
+w("ir_wkt(irt_bench_elems, bench_elems)\n")
+w("ir_wkt(irt_bench_cb, bench_cb)\n\n")
+w('#include "ir_end.h"\n#endif\n')
+h:close()
+
+-- The decks build their tables with loops, as real decks often do, so
+-- they stay small and quick to run at any size.
+for k = 6, #arg do
+   local n = tonumber(arg[k])
+   local d = assert(io.open(string.format("bench_%d.lua", n), "w"))
+   local function dw(...) d:write(string.format(...)) end
+   dw("-- Generated by gen_bench.lua. Do not modify.\n\n")
+   dw("bench_wide = {}\n")
+   dw("for i = 1, %d do bench_wide[string.format('w%%04d', i)] = i + 0.5 end\n\n", nwide)
+   dw("bench_deep = {}\n")
+   dw("local t = bench_deep\n")
+   dw("for d = 1, %d do\n  t.i = d\n  t.x = d + 0.5\n", depth)
+   dw("  if d < %d then t.d = {} t = t.d end\nend\n\n", depth)
+   dw("bench_vec = { n = %d, v = {} }\n", math.min(n, nvec))
+   dw("for i = 1, %d do bench_vec.v[i] = i * 0.5 end\n\n", math.min(n, nvec))
+   dw("bench_elems = { e = {} }\n")
+   dw("for i = 1, %d do\n", math.max(1, math.min(math.floor(n/10), nelem)))
+   dw("  bench_elems.e[i] = { id = i, x = i + 0.5, v = { i, i+1, i+2, i+3 },\n")
+   dw("    name = 'elem' .. i }\nend\n\n")
+   dw("bench_cb = {\n")
+   for i = 1, ncb do
+      if i % 2 == 1 then
+         dw("  c%03d = function(x) return 2*x + %d end,\n", i, i)
+      else
+         dw("  c%03d = function(x) local t = { x } return t[1] + %d end,\n", i, i)
+      end
+   end
+   dw("}\n")
+   d:close()
+end
@@ -0,0 +1,36 @@
+-- Copyright 2016-2021 Lawrence Livermore National Security, LLC and other
+-- IREP Project Developers. See the top-level LICENSE file for details.
+--
+-- SPDX-License-Identifier: MIT
+
+-- Generate a wide well-known table for benchmarking, and a Lua input deck
+-- that sets every one of its fields.
+--
+-- Usage: lua gen_wide.lua [NFIELDS]
+--
+-- Writes wkt_wide.h (a struct with NFIELDS double fields, default 500)
+-- and wide.lua.
+
+local nfields = tonumber(arg[1] or 500)
+
+local h = assert(io.open("wkt_wide.h", "w"))
+h:write("// Generated by gen_wide.lua. Do not modify.\n\n")
+h:write("#ifndef wkt_wide_h\n#define wkt_wide_h\n")
+h:write('#include "ir_start.h"\n\n')
+h:write("Beg_struct(irt_wide)\n")
+for i = 1, nfields do
+   h:write(string.format("  ir_dbl(zone_var%04d,0.0)\n", i))
+end
+h:write("End_struct(irt_wide)\n\n")
+h:write("ir_wkt(irt_wide, wide)\n\n")
+h:write('#include "ir_end.h"\n#endif\n')
+h:close()
+
+local d = assert(io.open("wide.lua", "w"))
+d:write("-- Generated by gen_wide.lua. Do not modify.\n\n")
+d:write("wide = {\n")
+for i = 1, nfields do
+   d:write(string.format("  zone_var%04d = %d.5,\n", i, i))
+end
+d:write("}\n")
+d:close()
@@ -0,0 +1,184 @@
+// Copyright 2016-2021 Lawrence Livermore National Security, LLC and other
+// IREP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+// irep-bench: time libIR on the synthetic tables from gen_bench.lua.
+//
+// Usage: irep-bench [-t SECONDS] bench_SIZE.lua ...
+//
+// For each deck, times ir_read and ir_unread of each table, ir_exists
+// on a few kinds of path, and callback evaluation, compiled and in Lua,
+// one point at a time and in batches.  Each case is repeated, doubling
+// the count, until it takes at least SECONDS (default 0.05).  The results
+// go to stdout as one JSON document, for tracking across releases:
+//
+//   {"irep_bench": {"version": 1, "lua": "Lua 5.1", "results": [
+//     {"deck": "bench_1000.lua", "size": 1000, "op": "ir_read",
+//      "target": "bench_vec", "reps": 4096, "us": 12.5}, ...]}}
+//
+// "us" is microseconds per operation: per read, per query, or per
+// callback call (a batch call counts as one call).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "lua.h"
+#include "lualib.h"
+#include "lauxlib.h"
+#include "ir_extern.h"
+#include "wkt_bench.h"
+
+#define NBATCH 1000     // Points per ir_cb_eval_batch call.
+
+static const char *tables[] = {
+  "bench_wide", "bench_deep", "bench_vec", "bench_elems", "bench_cb", 0
+};
+
+static double sec_clock(void) {
+  struct timespec ts;
+  (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1.0e-9*ts.tv_nsec;
+}
+
+// What one benchmark case runs, reps times.
+typedef struct {
+  lua_State *L;
+  const char *s;          // Table or path, or NULL.
+  lua_cb_data *cb;
+  double x[NBATCH], v[NBATCH];
+} bench_arg;
+
+static int run_read(bench_arg *a, long reps) {
+  int errcnt = 0;
+  while (reps-- > 0) errcnt += ir_read(a->L, a->s);
+  return errcnt;
+}
+
+static int run_unread(bench_arg *a, long reps) {
+  int errcnt = 0;
+  while (reps-- > 0) errcnt += ir_unread(a->L, a->s);
+  return errcnt;
+}
+
+static int run_exists(bench_arg *a, long reps) {
+  int n = 0;
+  while (reps-- > 0) n += ir_exists(a->L, a->s);
+  return n < 0;
+}
+
+static int run_eval(bench_arg *a, long reps) {
+  int errcnt = 0;
+  while (reps-- > 0) errcnt += ir_cb_eval(a->L, a->cb, a->x, a->v);
+  return errcnt;
+}
+
+static int run_batch(bench_arg *a, long reps) {
+  int errcnt = 0;
+  while (reps-- > 0)
+    errcnt += ir_cb_eval_batch(a->L, a->cb, NBATCH, a->x, 1, 1, a->v, 1, 1);
+  return errcnt;
+}
+
+static double min_sec = 0.05;
+static int nresult = 0;
+
+// Time run, and print one result.  Returns the error count.
+static int bench(const char *deck, int size, const char *op, const char *target,
+                 int (*run)(bench_arg *, long), bench_arg *a) {
+  long reps = 1;
+  double t;
+  if (run(a, 1)) return fprintf(stderr, "irep-bench: %s %s failed\n", op, target), 1;
+  for (;;) {
+    double t0 = sec_clock();
+    if (run(a, reps)) return fprintf(stderr, "irep-bench: %s %s failed\n", op, target), 1;
+    t = sec_clock() - t0;
+    if (t >= min_sec || reps > (1L << 40)) break;
+    reps *= 2;
+  }
+  printf("%s\n    {\"deck\": \"%s\", \"size\": %d, \"op\": \"%s\", "
+    "\"target\": \"%s\", \"reps\": %ld, \"us\": %.6g}", nresult++ ? "," : "",
+    deck, size, op, target, reps, 1.0e6*t/reps);
+  fflush(stdout);
+  return 0;
+}
+
+// Run the benchmarks on one deck.  Returns the error count.
+static int bench_deck(const char *deck) {
+  static bench_arg a;
+  const char *p = strrchr(deck, '_');
+  int i, errcnt = 0, size = p ? atoi(p+1) : 0;
+  char deep[1024] = "bench_deep", elem[64], name[64];
+  lua_State *L = luaL_newstate();
+
+  luaL_openlibs(L);
+  if (luaL_loadfile(L, deck) || lua_pcall(L, 0, 0, 0)) {
+    fprintf(stderr, "irep-bench: cannot run %s: %s\n", deck, lua_tostring(L,-1));
+    lua_close(L);
+    return 1;
+  }
+
+  // Paths for ir_exists: the deepest one, an element of the last struct
+  // in the deck, and a miss.  (ir_unread, below, fills in every struct.)
+  lua_getglobal(L, "bench_deep");
+  for (;;) {
+    lua_getfield(L, -1, "d");
+    if (!lua_istable(L,-1) || strlen(deep) + 3 >= sizeof deep - 2) break;
+    strcat(deep, ".d");
+    lua_remove(L,-2);
+  }
+  lua_settop(L,0);
+  strcat(deep, ".x");
+  lua_getglobal(L, "bench_elems");
+  lua_getfield(L, -1, "e");
+  (void)snprintf(elem, sizeof elem, "bench_elems.e[%d].x", (int)lua_objlen(L,-1));
+  lua_settop(L,0);
+
+  a.L = L;
+  a.cb = NULL;
+  for (i=0; tables[i]; i++) {
+    a.s = tables[i];
+    errcnt += bench(deck, size, "ir_read", a.s, run_read, &a);
+  }
+  for (i=0; tables[i]; i++) {
+    a.s = tables[i];
+    errcnt += bench(deck, size, "ir_unread", a.s, run_unread, &a);
+  }
+
+  const char *paths[] = { "bench_wide.w0001", deep, elem, "bench_wide.nosuch", 0 };
+  for (i=0; paths[i]; i++) {
+    a.s = paths[i];
+    errcnt += bench(deck, size, "ir_exists", a.s, run_exists, &a);
+  }
+
+  // Callbacks: the first one compiles, and the second runs in Lua.
+  for (i=0; i < NBATCH; i++) a.x[i] = i * 0.001;
+  for (i=0; i < 2; i++) {
+    a.cb = i ? &bench_cb.c002 : &bench_cb.c001;
+    (void)snprintf(name, sizeof name, "bench_cb.c00%d (%s)", i+1,
+      ir_cb_compiled(a.cb) ? "compiled" : "Lua");
+    errcnt += bench(deck, size, "ir_cb_eval", name, run_eval, &a);
+    errcnt += bench(deck, size, "ir_cb_eval_batch", name, run_batch, &a);
+  }
+  lua_close(L);
+  return errcnt;
+}
+
+int main(int argc, char *argv[]) {
+  int i = 1, errcnt = 0;
+
+  if (argc > 2 && strcmp(argv[1], "-t") == 0) {
+    min_sec = atof(argv[2]);
+    i = 3;
+  }
+  if (i >= argc) {
+    fprintf(stderr, "Usage: %s [-t SECONDS] bench_SIZE.lua ...\n", argv[0]);
+    return 1;
+  }
+  printf("{\"irep_bench\": {\"version\": 1, \"lua\": \"%s\", \"results\": [",
+    LUA_VERSION);
+  for (; i < argc; i++) errcnt += bench_deck(argv[i]);
+  printf("\n]}}\n");
+  return errcnt != 0;
+}
@@ -16,6 +16,7 @@
 #include "ir_extern.h"
 #include "wkt_table1.h"
 #include "wkt_table4.h"
+#include "wkt_table5.h"
 #include <time.h>
 #include <sys/time.h>
 
@@ -24,39 +25,10 @@ extern "C" {
 using namespace irep;
 #endif
 
-int eval(lua_State *L, lua_cb_data *d, double *x, double *v) {
-  int i, nprm, nret;
-
-  if (d->fref == LUA_REFNIL) return 1;
-
-  nprm = ir_nprm(d->npnr);
-  nret = ir_nret(d->npnr);
-  if (d->fref == LUA_NOREF) {
-    double *data = (double *)d->data;
-    for (i=0; i < nret; ++i) v[i] = data[i];
-    return 0;
-  }
-
-  // Push the function onto the stack.
-  lua_rawgeti(L, LUA_REGISTRYINDEX, d->fref);
-  for (i=0; i < nprm; i++) lua_pushnumber(L, x[i]); // Push args.
-
-  if (lua_pcall(L, nprm, nret, 0) != 0)
-    return luaL_error(L, "error: %s", lua_tostring(L,-1));
-
-  for (i=0; i < nret; i++) {
-    if (lua_type(L, i-nret) != LUA_TNUMBER)
-      return luaL_error(L, "error: expected number for return value: %d", i+1);
-    v[i] = lua_tonumber(L, i - nret);
-  }
-  lua_pop(L, nret); // Pop return values.
-  return 0;
-}
-
 int main(int argc, char *argv[]) {
   lua_State *L = luaL_newstate();
   int ios, i, n, j, ii;
-  double x[3] = { 2.0, 3.0, 4.0 }, v=0.0, v2[2];
+  double x[3] = { 2.0, 3.0, 4.0 }, v=0.0, v2[2], xb[3][4], vb[3][4];
 
   if (argc < 2) {
     fprintf(stderr, "Usage: %s *.lua\n", argv[0]);
@@ -76,23 +48,37 @@ int main(int argc, char *argv[]) {
   char *ss = strdup(IR_STR(table1.s));
   printf("table1.s = \"%s\"\n", ss);
 
-  i = eval(L, &table1.f1, x, &v);
+  i = ir_cb_eval(L, &table1.f1, x, &v);
   if (!i) printf("table1.f1(%g,%g,%g) = %g\n", x[0],x[1],x[2], v);
   else printf("f1 undefined\n");
 
-  i = eval(L, &table1.table2[1].f2, x, &v);
+  i = ir_cb_eval(L, &table1.table2[1].f2, x, &v);
   if (!i) printf("table1.table2[1].f2(%g,%g,%g) = %g\n", x[0],x[1],x[2], v);
   else printf("f2 undefined\n");
 
-  i = eval(L, &table1.table3.f3, x, v2);
+  i = ir_cb_eval(L, &table1.table3.f3, x, v2);
   if (!i) printf("table1.table3.f3(%g,%g,%g) = %g %g\n", x[0],x[1],x[2], v2[0],v2[1]);
   else printf("f3 undefined\n");
 
+  // Evaluate f1 and f4 at four points at once.  Here the points are stored
+  // by component (SoA): parameter j of point i is xb[j][i].
+  for (i=0; i<4; i++) { xb[0][i] = i; xb[1][i] = 2.0; xb[2][i] = 0.5; }
+  ios = ir_cb_eval_batch(L, &table1.f1, 4, &xb[0][0], 1, 4, &vb[0][0], 1, 4);
+  printf("batch f1: ios=%d, %g %g %g %g\n", ios, vb[0][0],vb[0][1],vb[0][2],vb[0][3]);
+  ios = ir_cb_eval_batch(L, &table1.f4, 4, &xb[0][0], 1, 4, &vb[0][0], 1, 4);
+  printf("batch f4: ios=%d, %g %g %g (x4)\n", ios, vb[0][3],vb[1][3],vb[2][3]);
+
   n = sizeof(table1.e)/sizeof(*table1.e);
   printf("\ntable1.e: %d elements, %d given\n", n, ir_rtlen(L, "table1.e"));
   for (i=0;i<n;i++)
     printf("table1.e[%d] = %g\n", i, table1.e[i]);
 
+  // A precompiled path can be re-read and queried without re-parsing it.
+  ir_path *pe = ir_path_compile("table1.e");
+  ios = ir_read_path(L, pe);
+  printf("re-read table1.e: ios=%d, %d given\n", ios, ir_path_rtlen(L, pe));
+  ir_path_free(pe);
+
   ios = ir_read(L, "table4");
   printf("\nREAD TABLE4: ios=%d\n",ios);
   for (i=1; i<=3; i++) {
@@ -111,6 +97,90 @@ int main(int argc, char *argv[]) {
     lua_pop(L,1);
   }
 
+  // Runtime-sized vectors are allocated to the length of the Lua arrays.
+  ios = ir_read(L, "table5");
+  printf("\nREAD TABLE5: ios=%d\n",ios);
+  printf("table5.rho: %d elements:", table5.rho.n);
+  for (i=0; i<table5.rho.n; i++) printf(" %g", ((double *)table5.rho.p)[i]);
+  printf("\ntable5.zones: %d elements:", table5.zones.n);
+  for (i=0; i<table5.zones.n; i++) printf(" %d", ((int *)table5.zones.p)[i]);
+  printf("\ntable5.active: %d elements:", table5.active.n);
+  for (i=0; i<table5.active.n; i++) printf(" %d", (int)((BOOLEAN *)table5.active.p)[i]);
+  printf("\n");
+
+  // Two- and three-dimensional arrays are in Fortran order: Fortran
+  // stress(i,j) is C stress[j-1][i-1].
+  for (i=1; i<=2; i++) {
+    printf("table5.stress(%d,:) =", i);
+    for (j=1; j<=3; j++) printf(" %g", table5.stress[j-1][i-1]);
+    printf("\n");
+  }
+  printf("table5.cells in memory order:");
+  for (i=0; i<8; i++) printf(" %d", (&table5.cells[0][0][0])[i]);
+  printf("\n");
+
+  // A sparse vector allocates only the elements the input gives, each a
+  // copy of table5.mats_proto; the others are NULL.
+  printf("table5.mats: %d elements\n", table5.mats.n);
+  for (i=0; i<table5.mats.n; i++) {
+    irt_mat *m = (irt_mat *)((void **)table5.mats.elem)[i];
+    ios = ir_cb_eval(L, &m->eos, x, &v);
+    printf("table5.mats[%d]: id=%d rho=%g eos(%g)=%g (ios=%d)\n",
+           ((int *)table5.mats.key)[i], m->id, m->rho, x[0], v, ios);
+  }
+  printf("table5.mats[8] %s\n", ir_sparse_get(&table5.mats, 8) ? "given" : "not given");
+
+  // Pack the table (e.g., to broadcast it), change it, and unpack it
+  // again.  Then compact the arena, which holds the callback names.
+  size_t len;
+  void *buf = ir_pack(L, "table5", &len);
+  luaL_dostring(L, "table5.mats[7].rho = 0  table5.mats[8] = {}");
+  ios = ir_read(L, "table5");
+  printf("re-read table5: ios=%d, %d elements\n", ios, table5.mats.n);
+  ios = ir_unpack(L, buf, len);
+  ir_pack_free(buf);
+  irt_mat *m7 = (irt_mat *)ir_sparse_get(&table5.mats, 7);
+  printf("table5 unpacked: ios=%d, %d elements, mats[7].rho=%g\n", ios, table5.mats.n, m7->rho);
+  ios = ir_reset_arena();
+  printf("table5 arena reset: ios=%d, %s\n", ios, ir_get_function_name(L, &m7->eos));
+
+  // Save table1 for a restart, spoil it, and load it back.  The Lua
+  // functions are saved in the sidecar, table1.snap.lv, so the load does
+  // not look them up in L.
+  ios = ir_save(L, "table1", "table1.snap");
+  table1.i = 0;
+  table1.e[0] = 0.0;
+  luaL_dostring(L, "f1, table1.f1 = table1.f1, nil");
+  j = ir_load(L, "table1", "table1.snap");
+  printf("\ntable1 saved and loaded: ios=%d,%d, i=%d, e[0]=%g\n", ios, j, table1.i, table1.e[0]);
+  i = ir_cb_eval(L, &table1.f1, x, &v);
+  printf("table1.f1(%g,%g,%g) = %g (ios=%d)\n", x[0], x[1], x[2], v, i);
+  luaL_dostring(L, "table1.f1, f1 = f1, nil");
+  (void)remove("table1.snap");
+  (void)remove("table1.snap.lv");
+
+  // Track the changes to table1 as the input is edited, e.g., to steer.
+  ir_track *k = ir_track_create(L, "table1");
+  luaL_dostring(L, "table1.d = 1.5  table1.table3.i = 3");
+  ios = ir_track_read(L, k);
+  printf("table1 tracked: ios=%d, %d changed:", ios, ir_track_nchanged(k));
+  for (i=0; i<ir_track_nchanged(k); i++) printf(" %s", ir_track_changed(k, i));
+  printf("\n");
+  ir_track_free(k);
+
+  // Release f4, as if the input had not given it, and reclaim its space.
+  ios = ir_release(L, "table1.f4");
+  printf("table1.f4 released: ios=%d, f4 %s\n", ios,
+         table1.f4.fref == LUA_REFNIL ? "undefined" : "defined");
+  printf("arena reset: ios=%d\n", ir_reset_arena());
+
+  // Freeze the tables, so that L can be closed; the callbacks still work.
+  ios = ir_freeze(L);
+  lua_close(L);
+  i = ir_cb_eval(NULL, &table1.table2[1].f2, x, &v);
+  printf("table1 frozen: ios=%d, table1.table2[1].f2(%g,%g,%g) = %g (ios=%d)\n",
+         ios, x[0],x[1],x[2], v, i);
+
   return 0;
 }
 
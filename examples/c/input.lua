@@ -38,3 +38,17 @@ table4 = {
   },
   -- [3]: Use the IREP default.
 }
+
+table5 = {
+  rho = { 1.5, 2.5, [5] = 4.5 }, -- rho[3] and rho[4] are 0.
+  zones = { 10, 20, 30 },
+  active = { true, false, true, true },
+  -- Nested arrays: stress[i][j] is Fortran stress(i,j).
+  stress = { { 11, 12, 13 }, { 21, 22, 23 } },
+  -- A flat array, in Fortran order, of just cells(1:2,1:2,1).
+  cells = { shape = { 2, 2, 1 }, 111, 211, 121, 221 },
+  mats = { -- Only these two of mats[1:100000] are allocated.
+    [7] = { id = 7, rho = 2.7, eos = function(t) return 2*t end },
+    [90210] = { id = 90210, eos = 1.5 },
+  },
+}
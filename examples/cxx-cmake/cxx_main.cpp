@@ -6,12 +6,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <vector>
+#include <array>
 #include "lua.hpp"
 #include "ir_std.h" // lua_cb_data
 #include "ir_extern.h"
 #include "wkt_table1.h"
 #include "wkt_table4.h"
+#include "table_reflect.h" // irep-generate --mode cxx
 
 #if 0
 static void itemdump(lua_State *L, int i, char c) {
@@ -44,97 +45,24 @@ static void stackdump(lua_State *L) {
 }
 #endif
 
-class LuaCallback {
-public:
-  LuaCallback(lua_State *L, lua_cb_data &d);
-  ~LuaCallback(){}
-  virtual int Evaluate(std::vector<double> &v, const std::vector<double> &x);
-  virtual double Evaluate(const std::vector<double> &x);
-
-private:
-  lua_State *L;
-  lua_cb_data &d;
-  int nprm;
-  int nret;
-};
-
-// Constructor.
-LuaCallback::LuaCallback(lua_State *L, lua_cb_data &d) : L(L), d(d) {
-  nprm = ir_nprm(d.npnr);
-  nret = ir_nret(d.npnr);
-}
-
-// Evaluator for scalar returns.
-double LuaCallback::Evaluate(const std::vector<double> &x) {
-  std::vector<double> v(1);
-  (void)LuaCallback::Evaluate(v, x);
-  return v[0];
-}
-
-// Evaluator for vector returns.
-int LuaCallback::Evaluate(std::vector<double> &v, const std::vector<double> &x)
-{
-  int actual_nret = nret;
-
-  if (d.fref == LUA_NOREF) {
-    // In the LUA_NOREF case, nret always has the actual length of d.data.
-    // (Even if nret was originally specified as -1 in the wkt file.)
-    if (nret > (int)v.size()) {
-      fprintf(stderr,"ERROR: v is too small\n"); exit(1);
-    }
-    double *data = (double *)d.data;
-    for (int i=0; i<nret; ++i) v[i] = data[i];
-
-  } else {
-    if (nprm > (int)x.size()) {
-      fprintf(stderr,"ERROR: not enough parameters given\n"); exit(1);
-    }
-    lua_rawgeti(L, LUA_REGISTRYINDEX, d.fref);
-    for (int i=0; i<nprm; i++) { lua_pushnumber(L, x[i]); }
-    if (nret == -1) actual_nret = 1; // One return value, a table.
-    if (lua_pcall(L, nprm, actual_nret, 0) != 0) {
-      fprintf(stderr,"ERROR: calling function\n"); exit(1);
-    }
-
-    if (nret == -1) { // Arbitrary length table expected.
-      if (lua_type(L,-1) != LUA_TTABLE) {
-        fprintf(stderr,"ERROR: Expected function to return table\n"); exit(1);
-      }
-      actual_nret = lua_objlen(L,-1);
-      if (actual_nret > (int)v.size()) {
-        fprintf(stderr,"ERROR: v is too small for table returned\n"); exit(1);
-      }
-      for (int i=1; i<=actual_nret; i++) {
-        lua_rawgeti(L,-1,i);
-        if (lua_type(L,-1) != LUA_TNUMBER) {
-          fprintf(stderr,"ERROR: table item is not number: %d\n", i); exit(1);
-        }
-        v[i-1] = lua_tonumber(L,-1);
-        lua_pop(L,1);
-      }
-      lua_pop(L,1);
-
-    } else { // Standard return on the stack.
-      for (int i=0; i<nret; i++) {
-        if (lua_type(L,i-nret) != LUA_TNUMBER) {
-          fprintf(stderr,"ERROR: not number: %d\n", i); exit(1);
-        }
-        v[i] = lua_tonumber(L, i - nret);
-      }
-      lua_pop(L, nret);
-    }
+// Add up the doubles in a WKT struct, field by field.  The fields are
+// visited at compile time (see ir_reflect.h), so this inlines to a few adds.
+struct SumDoubles {
+  int n = 0;
+  double sum = 0.0;
+  template <typename F> void operator()(F, const double &d) { n++; sum += d; }
+  template <typename F, std::size_t N> void operator()(F, const double (&d)[N]) {
+    for (std::size_t i = 0; i < N; i++) n++, sum += d[i];
   }
-  return actual_nret;
-}
+  template <typename F, typename M> void operator()(F, const M &) {}
+};
 
 // ----------------------------------------------------------------------
 int main(int argc, char *argv[]) {
   lua_State *L = luaL_newstate();
   int i, ios;
-  double dd;
-  static const double arr[] = { 1.,2.,3. };
-  std::vector<double> x (arr, arr+sizeof(arr)/sizeof(arr[0]));
-  std::vector<double> v(3);
+  double dd, v[3];
+  std::array<double,3> x = {{ 1., 2., 3. }};
 
   if (argc < 2) {
     fprintf(stderr, "Usage: %s *.lua\n", argv[0]);
@@ -151,16 +79,22 @@ int main(int argc, char *argv[]) {
   printf("table1.d = %g\n", irep::table1.d);
   printf("table1.b = %d\n", irep::table1.b);
 
-  LuaCallback *f1 = new LuaCallback(L, irep::table1.f1);
-  dd = f1->Evaluate(x);
+  SumDoubles s;
+  irep::for_each_field(irep::table1, s);
+  printf("Reflected %s: %d fields, %d doubles, sum %g\n",
+    irep::Reflect<irep::irt_table1>::name(),
+    (int)irep::Reflect<irep::irt_table1>::size, s.n, s.sum);
+
+  // Each Callback(ID,NP,NR) is an irep::Callback<NP,NR>, so these calls
+  // are checked against NP and NR at compile time.
+  dd = irep::table1.f1(L, x[0], x[1], x[2]);
   printf("return from f1: %g\n", dd);
 
-  LuaCallback *f4 = new LuaCallback(L, irep::table1.f4);
-  i = f4->Evaluate(v, x);
-  printf("return from f4: %d, %g\n", i,v[0]);
+  irep::Callback<3,3>::values v4;
+  ios = irep::table1.f4.eval(L, x, v4);
+  printf("return from f4: %d, %g\n", ios ? -1 : (int)v4.size(), v4[0]);
 
-  LuaCallback *f5 = new LuaCallback(L, irep::table1.f5);
-  i = f5->Evaluate(v, x);
+  i = irep::table1.f5.eval(L, x.data(), (int)x.size(), v, 3);
   printf("return from f5: %d, %g %g %g\n", i,v[0],v[1],v[2]);
   printf("Full name for f5: %s\n", ir_get_function_name(L,&irep::table1.f5));
 
@@ -251,13 +251,17 @@ program main
   use ir_extern
   use wkt_table1
   use wkt_table4
+  use wkt_table5
   use mainmod
   implicit none
 
   integer :: ios, i, n, ng
   real(c_double) :: v(3), x(3) = [ 2.0, 3.0, 4.0 ]
-  type(c_ptr) :: L
+  type(c_ptr) :: L, pe
   character(len=64) :: arg, name
+  real(c_double), pointer :: rho(:)
+  integer(c_int), pointer :: zones(:)
+  logical(c_bool), pointer :: active(:)
 
   L = luaL_newstate()
   call luaL_openlibs(L)
@@ -304,7 +308,30 @@ program main
     write(*,"(a,i1,a,f6.2)") "table1.e(",i,") = ", table1%e(i)
   enddo
 
+  pe = ir_path_compile(cstr("table1.e"))
+  ios = ir_read_path(L, pe)
+  ng = ir_path_rtlen(L, pe)
+  write(*, "(a,i2,a,i2,a)") "re-read table1.e: ios=",ios, ", ",ng, " given"
+  call ir_path_free(pe)
+
   name = fstr(ir_get_function_name(L,c_loc(table1%f5)))
   print *, "f5:", name
 
+  ! Runtime-sized vectors are allocated to the length of the Lua arrays.
+  if (ir_read(L, cstr("table5")) .ne. 0) stop
+  print *, ""
+  print *,"READ TABLE5"
+  rho => ir_dir_dbl(table5%rho)
+  zones => ir_dir_int(table5%zones)
+  active => ir_dir_log(table5%active)
+  write(*,"(a,i2,a,*(f6.2))") "table5.rho: ", size(rho), " elements:", rho
+  write(*,"(a,i2,a,*(i4))") "table5.zones: ", size(zones), " elements:", zones
+  write(*,"(a,i2,a,*(l2))") "table5.active: ", size(active), " elements:", active
+
+  ! Two- and three-dimensional arrays are in Fortran order, as in C.
+  do i=1,2
+    write(*,"(a,i1,a,*(f6.2))") "table5.stress(", i, ",:) =", table5%stress(i,:)
+  enddo
+  write(*,"(a,*(i4))") "table5.cells in memory order:", table5%cells
+
 end
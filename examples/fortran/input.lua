@@ -30,3 +30,13 @@ table1 = {
     -- xx = { 1,2,3, "ignore me" },
   },
 }
+
+table5 = {
+  rho = { 1.5, 2.5, [5] = 4.5 }, -- rho[3] and rho[4] are 0.
+  zones = { 10, 20, 30 },
+  active = { true, false, true, true },
+  -- Nested arrays: stress[i][j] is Fortran stress(i,j).
+  stress = { { 11, 12, 13 }, { 21, 22, 23 } },
+  -- A flat array, in Fortran order, of just cells(1:2,1:2,1).
+  cells = { shape = { 2, 2, 1 }, 111, 211, 121, 221 },
+}
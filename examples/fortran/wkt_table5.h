@@ -0,0 +1,21 @@
+// Copyright 2016-2021 Lawrence Livermore National Security, LLC and other
+// IREP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#ifndef wkt_table5_h
+#define wkt_table5_h
+#include "ir_start.h"
+
+Beg_struct(irt_table5)
+  Dir_dbl(rho)
+  Dir_int(zones)
+  Dir_log(active)
+  Vir2_dbl(stress,2,3,0.0)
+  Vir3_int(cells,2,2,2,-1)
+End_struct(irt_table5)
+
+ir_wkt(irt_table5, table5)
+
+#include "ir_end.h"
+#endif
@@ -0,0 +1,76 @@
+// Copyright 2016-2021 Lawrence Livermore National Security, LLC and other
+// IREP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#ifndef ir_callback_h
+#define ir_callback_h
+
+// In C++, Callback(ID,NP,NR) declares ID as an irep::Callback<NP,NR>.
+// That is a lua_cb_data with the same layout (it adds no data), so it can
+// still be passed to the ir_cb_eval functions, or shared with C and
+// Fortran.  Its own calls check the number of parameters and return
+// values at compile time, and none of them allocates memory.
+// This header needs C++11.
+
+#if defined(__cplusplus)
+#include <array>
+#include <limits>
+#include "ir_std.h"
+struct lua_State;
+#include "ir_extern.h"
+
+namespace irep {
+
+template <int NP, int NR>
+struct Callback : lua_cb_data {
+  static_assert(NP >= -1 && NR >= -1, "Callback: NPRM and NRET must be >= -1");
+  static const int nprm = NP;
+  static const int nret = NR;
+  typedef std::array<double, (NP > 0 ? NP : 0)> params;
+  typedef std::array<double, (NR > 0 ? NR : 0)> values;
+
+  // Was the callback given in the Lua input?
+  bool defined() const { return fref != -1; } // -1 == LUA_REFNIL
+
+  // Can it be evaluated without Lua?  See ir_cb_compiled.
+  bool compiled() const { return ir_cb_compiled(self()) != 0; }
+
+  // v = f(x), when NPRM and NRET are fixed.  Returns as ir_cb_eval.
+  int eval(lua_State *L, const params &x, values &v) const {
+    static_assert(NP >= 0 && NR >= 0,
+      "Callback: use eval(L, x, nx, v, nv) if NPRM or NRET is -1");
+    return ir_cb_eval(L, self(), x.data(), v.data());
+  }
+
+  // f(x...), when NRET is 1.  Returns NaN if the callback is not defined,
+  // or fails (after printing an error).
+  template <typename... X>
+  double operator()(lua_State *L, X... x) const {
+    static_assert(NR == 1, "Callback: operator() needs NRET == 1");
+    static_assert(NP < 0 || sizeof...(X) == NP,
+      "Callback: wrong number of parameters");
+    const double xa[sizeof...(X) + 1] = { static_cast<double>(x)..., 0.0 };
+    double v;
+    int nv = 1;
+    if (ir_cb_eval_n(L, self(), sizeof...(X), xa, &nv, &v) != 0)
+      return std::numeric_limits<double>::quiet_NaN();
+    return v;
+  }
+
+  // For any NPRM and NRET: pass the nx parameters x, and store at most nv
+  // values in v.  An NRET of -1 means the function returns an array, and
+  // nv is the room for it.  Returns the number of values stored, or -1 if
+  // the callback is not defined or fails (after printing an error).
+  int eval(lua_State *L, const double *x, int nx, double *v, int nv) const {
+    return ir_cb_eval_n(L, self(), nx, x, &nv, v) == 0 ? nv : -1;
+  }
+
+ private:
+  lua_cb_data *self() const { return const_cast<Callback *>(this); }
+};
+
+} // namespace irep
+#endif
+
+#endif
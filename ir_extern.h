@@ -14,7 +14,32 @@ module ir_extern
   private
   public :: ir_read, ir_exists, ir_rtlen, ir_nprm, ir_nret, ir_unread
   public :: ir_get_function_name
-  public :: lua_cb_data
+  public :: ir_path_compile, ir_read_path, ir_path_exists, ir_path_rtlen
+  public :: ir_path_free, ir_unread_path
+  public :: ir_cb_eval, ir_cb_eval_batch, ir_cb_eval_array, ir_cb_compiled
+  public :: ir_cb_eval_n, ir_cb_prof_enable, ir_cb_prof_report, ir_cb_prof_reset
+  public :: ir_pool_create, ir_pool_state, ir_pool_sync, ir_pool_free
+  public :: ir_freeze, ir_frozen_state
+  public :: ir_release, ir_reset_arena, ir_arena_bytes
+  public :: ir_cb_tabulate, ir_cb_table_eval, ir_cb_table_error
+  public :: ir_cb_table_bytes, ir_cb_table_free
+  public :: IR_TAB_CLAMP, IR_TAB_ERROR, IR_TAB_LUA
+  public :: ir_save, ir_load, ir_pack, ir_unpack, ir_pack_free
+  public :: ir_track_create, ir_track_read, ir_track_hook, ir_track_test
+  public :: ir_track_nchanged, ir_track_changed, ir_track_free
+  public :: ir_stats_enable, ir_stats, ir_stats_reset, ir_stats_json, ir_stat
+  public :: lua_cb_data, ir_dir, ir_dir_dbl, ir_dir_int, ir_dir_log
+  public :: ir_sparse, ir_sparse_get
+
+  ! Policies for points outside the domain of an ir_cb_tabulate table.
+  integer(c_int), parameter :: IR_TAB_CLAMP = 0, IR_TAB_ERROR = 1, IR_TAB_LUA = 2
+
+  ! One ir_read profiling entry; see ir_stats.
+  type, bind(c) :: ir_stat
+    type(c_ptr) :: name
+    integer(c_long) :: reads, elements, bytes, strings, callbacks, refs
+    real(c_double) :: seconds
+  end type
 
 interface ! Let Fortran call C functions ir_read, ir_exists, ir_rtlen.
   integer(c_int) function ir_read(L, t) bind(c, name="ir_read")
@@ -58,11 +83,263 @@ interface ! Let Fortran call C functions ir_read, ir_exists, ir_rtlen.
     type(c_ptr), value :: p
     type(c_ptr) :: ir_get_function_name
   end function
+  type(c_ptr) function ir_path_compile(t) bind(c, name="ir_path_compile")
+    use iso_c_binding
+    character(kind=c_char), dimension(*) :: t
+  end function
+  integer(c_int) function ir_read_path(L, p) bind(c, name="ir_read_path")
+    use iso_c_binding
+    type(c_ptr), value :: L
+    type(c_ptr), value :: p
+  end function
+  integer(c_int) function ir_path_exists(L, p) bind(c, name="ir_path_exists")
+    use iso_c_binding
+    type(c_ptr), value :: L
+    type(c_ptr), value :: p
+  end function
+  integer(c_int) function ir_path_rtlen(L, p) bind(c, name="ir_path_rtlen")
+    use iso_c_binding
+    type(c_ptr), value :: L
+    type(c_ptr), value :: p
+  end function
+  integer(c_int) function ir_unread_path(L, p) bind(c, name="ir_unread_path")
+    use iso_c_binding
+    type(c_ptr), value :: L
+    type(c_ptr), value :: p
+  end function
+  subroutine ir_path_free(p) bind(c, name="ir_path_free")
+    use iso_c_binding
+    type(c_ptr), value :: p
+  end subroutine
+  integer(c_int) function ir_cb_eval(L, cb, x, v) bind(c, name="ir_cb_eval")
+    use iso_c_binding
+    import :: lua_cb_data
+    type(c_ptr), value :: L
+    type(lua_cb_data) :: cb
+    real(c_double), dimension(*) :: x, v
+  end function
+  integer(c_int) function ir_cb_eval_batch(L, cb, n, x, xs, xc, v, vs, vc) &
+      bind(c, name="ir_cb_eval_batch")
+    use iso_c_binding
+    import :: lua_cb_data
+    type(c_ptr), value :: L
+    type(lua_cb_data) :: cb
+    integer(c_int), value :: n, xs, xc, vs, vc
+    real(c_double), dimension(*) :: x, v
+  end function
+  integer(c_int) function ir_cb_eval_array(L, cb, n, x, xs, xc, v, vs, vc) &
+      bind(c, name="ir_cb_eval_array")
+    use iso_c_binding
+    import :: lua_cb_data
+    type(c_ptr), value :: L
+    type(lua_cb_data) :: cb
+    integer(c_int), value :: n, xs, xc, vs, vc
+    real(c_double), dimension(*) :: x, v
+  end function
+  integer(c_int) function ir_cb_eval_n(L, cb, nx, x, nv, v) &
+      bind(c, name="ir_cb_eval_n")
+    use iso_c_binding
+    import :: lua_cb_data
+    type(c_ptr), value :: L
+    type(lua_cb_data) :: cb
+    integer(c_int), value :: nx
+    integer(c_int) :: nv
+    real(c_double), dimension(*) :: x, v
+  end function
+  integer(c_int) function ir_cb_prof_enable(on) bind(c, name="ir_cb_prof_enable")
+    use iso_c_binding
+    integer(c_int), value :: on
+  end function
+  integer(c_int) function ir_cb_prof_report(L, n) bind(c, name="ir_cb_prof_report")
+    use iso_c_binding
+    type(c_ptr), value :: L
+    integer(c_int), value :: n
+  end function
+  subroutine ir_cb_prof_reset() bind(c, name="ir_cb_prof_reset")
+  end subroutine
+  integer(c_int) function ir_cb_compiled(cb) bind(c, name="ir_cb_compiled")
+    use iso_c_binding
+    import :: lua_cb_data
+    type(lua_cb_data) :: cb
+  end function
+  type(c_ptr) function ir_pool_create(n, file) bind(c, name="ir_pool_create")
+    use iso_c_binding
+    integer(c_int), value :: n
+    character(kind=c_char), dimension(*) :: file
+  end function
+  type(c_ptr) function ir_pool_state(p, i) bind(c, name="ir_pool_state")
+    use iso_c_binding
+    type(c_ptr), value :: p
+    integer(c_int), value :: i
+  end function
+  integer(c_int) function ir_pool_sync(p) bind(c, name="ir_pool_sync")
+    use iso_c_binding
+    type(c_ptr), value :: p
+  end function
+  subroutine ir_pool_free(p) bind(c, name="ir_pool_free")
+    use iso_c_binding
+    type(c_ptr), value :: p
+  end subroutine
+  integer(c_int) function ir_freeze(L) bind(c, name="ir_freeze")
+    use iso_c_binding
+    type(c_ptr), value :: L
+  end function
+  type(c_ptr) function ir_frozen_state() bind(c, name="ir_frozen_state")
+    use iso_c_binding
+  end function
+  integer(c_int) function ir_release(L, t) bind(c, name="ir_release")
+    use iso_c_binding
+    type(c_ptr), value :: L
+    character(kind=c_char), dimension(*) :: t
+  end function
+  integer(c_int) function ir_reset_arena() bind(c, name="ir_reset_arena")
+    use iso_c_binding
+  end function
+  integer(c_size_t) function ir_arena_bytes(high) bind(c, name="ir_arena_bytes")
+    use iso_c_binding
+    integer(c_size_t) :: high
+  end function
+  type(c_ptr) function ir_cb_tabulate(L, cb, ndim, lo, hi, tol, policy) &
+      bind(c, name="ir_cb_tabulate")
+    use iso_c_binding
+    import :: lua_cb_data
+    type(c_ptr), value :: L
+    type(lua_cb_data) :: cb
+    integer(c_int), value :: ndim, policy
+    real(c_double), dimension(*) :: lo, hi
+    real(c_double), value :: tol
+  end function
+  integer(c_int) function ir_cb_table_eval(L, t, n, x, xs, xc, v, vs) &
+      bind(c, name="ir_cb_table_eval")
+    use iso_c_binding
+    type(c_ptr), value :: L, t
+    integer(c_int), value :: n, xs, xc, vs
+    real(c_double), dimension(*) :: x, v
+  end function
+  real(c_double) function ir_cb_table_error(t) bind(c, name="ir_cb_table_error")
+    use iso_c_binding
+    type(c_ptr), value :: t
+  end function
+  integer(c_size_t) function ir_cb_table_bytes(t) bind(c, name="ir_cb_table_bytes")
+    use iso_c_binding
+    type(c_ptr), value :: t
+  end function
+  subroutine ir_cb_table_free(t) bind(c, name="ir_cb_table_free")
+    use iso_c_binding
+    type(c_ptr), value :: t
+  end subroutine
+  integer(c_int) function ir_save(L, t, file) bind(c, name="ir_save")
+    use iso_c_binding
+    type(c_ptr), value :: L
+    character(kind=c_char), dimension(*) :: t, file
+  end function
+  integer(c_int) function ir_load(L, t, file) bind(c, name="ir_load")
+    use iso_c_binding
+    type(c_ptr), value :: L
+    character(kind=c_char), dimension(*) :: t, file
+  end function
+  type(c_ptr) function ir_pack(L, t, len) bind(c, name="ir_pack")
+    use iso_c_binding
+    type(c_ptr), value :: L
+    character(kind=c_char), dimension(*) :: t
+    integer(c_size_t) :: len
+  end function
+  integer(c_int) function ir_unpack(L, buf, len) bind(c, name="ir_unpack")
+    use iso_c_binding
+    type(c_ptr), value :: L, buf
+    integer(c_size_t), value :: len
+  end function
+  subroutine ir_pack_free(buf) bind(c, name="ir_pack_free")
+    use iso_c_binding
+    type(c_ptr), value :: buf
+  end subroutine
+  type(c_ptr) function ir_track_create(L, t) bind(c, name="ir_track_create")
+    use iso_c_binding
+    type(c_ptr), value :: L
+    character(kind=c_char), dimension(*) :: t
+  end function
+  integer(c_int) function ir_track_read(L, k) bind(c, name="ir_track_read")
+    use iso_c_binding
+    type(c_ptr), value :: L, k
+  end function
+  integer(c_int) function ir_track_hook(k, path, f, arg) bind(c, name="ir_track_hook")
+    use iso_c_binding
+    type(c_ptr), value :: k, arg
+    character(kind=c_char), dimension(*) :: path
+    type(c_funptr), value :: f
+  end function
+  integer(c_int) function ir_track_test(k, path) bind(c, name="ir_track_test")
+    use iso_c_binding
+    type(c_ptr), value :: k
+    character(kind=c_char), dimension(*) :: path
+  end function
+  integer(c_int) function ir_track_nchanged(k) bind(c, name="ir_track_nchanged")
+    use iso_c_binding
+    type(c_ptr), value :: k
+  end function
+  type(c_ptr) function ir_track_changed(k, i) bind(c, name="ir_track_changed")
+    use iso_c_binding
+    type(c_ptr), value :: k
+    integer(c_int), value :: i
+  end function
+  subroutine ir_track_free(k) bind(c, name="ir_track_free")
+    use iso_c_binding
+    type(c_ptr), value :: k
+  end subroutine
+  integer(c_int) function ir_stats_enable(on) bind(c, name="ir_stats_enable")
+    use iso_c_binding
+    integer(c_int), value :: on
+  end function
+  type(c_ptr) function ir_sparse_get(s, i) bind(c, name="ir_sparse_get")
+    use iso_c_binding
+    import :: ir_sparse
+    type(ir_sparse) :: s
+    integer(c_int), value :: i
+  end function
+  integer(c_int) function ir_stats(i, s) bind(c, name="ir_stats")
+    use iso_c_binding
+    import :: ir_stat
+    integer(c_int), value :: i
+    type(ir_stat) :: s
+  end function
+  subroutine ir_stats_reset() bind(c, name="ir_stats_reset")
+  end subroutine
+  integer(c_int) function ir_stats_json(file) bind(c, name="ir_stats_json")
+    use iso_c_binding
+    character(kind=c_char), dimension(*) :: file
+  end function
 end interface
 
+contains
+
+  ! The elements of a Dir_dbl, Dir_int, or Dir_log, as an array with
+  ! bounds 1:n; zero-sized if it has not been read.
+  function ir_dir_dbl(d) result(a)
+    type(ir_dir), intent(in) :: d
+    real(c_double), dimension(:), pointer :: a
+    real(c_double), dimension(0), target, save :: none
+    a => none
+    if (d%n > 0) call c_f_pointer(d%p, a, [d%n])
+  end function
+  function ir_dir_int(d) result(a)
+    type(ir_dir), intent(in) :: d
+    integer(c_int), dimension(:), pointer :: a
+    integer(c_int), dimension(0), target, save :: none
+    a => none
+    if (d%n > 0) call c_f_pointer(d%p, a, [d%n])
+  end function
+  function ir_dir_log(d) result(a)
+    type(ir_dir), intent(in) :: d
+    logical(c_bool), dimension(:), pointer :: a
+    logical(c_bool), dimension(0), target, save :: none
+    a => none
+    if (d%n > 0) call c_f_pointer(d%p, a, [d%n])
+  end function
+
 end module
 
 #else
+#include <stddef.h>
 #include "ir_std.h"
 
 #if defined(__cplusplus)
@@ -76,8 +353,94 @@ extern int ir_exists(lua_State *L, const char *t);
 extern int ir_rtlen(lua_State *L, const char *s);
 extern int ir_nprm(int npnr);
 extern int ir_nret(int npnr);
-extern char *ir_get_function_name(lua_State *L,void *p);
-extern char *ir_get_stringref(lua_State *L,int n, int *len);
+extern const char *ir_get_function_name(lua_State *L,void *p);
+extern const char *ir_get_stringref(lua_State *L,int n, int *len);
+
+// The element with index i of a sparse vector (Sstructure), or NULL.
+extern void *ir_sparse_get(const ir_sparse *s, int i);
+
+// Precompiled paths, for elements that are read or queried repeatedly.
+typedef struct ir_path ir_path;
+extern ir_path *ir_path_compile(const char *t);
+extern int ir_read_path(lua_State *L, ir_path *p);
+extern int ir_path_exists(lua_State *L, ir_path *p);
+extern int ir_path_rtlen(lua_State *L, ir_path *p);
+extern int ir_unread_path(lua_State *L, ir_path *p);
+extern void ir_path_free(ir_path *p);
+
+// Callback evaluation, at one point or at a batch of n points.
+extern int ir_cb_eval(lua_State *L, lua_cb_data *cb, const double *x, double *v);
+extern int ir_cb_eval_batch(lua_State *L, lua_cb_data *cb, int n,
+  const double *x, int xs, int xc, double *v, int vs, int vc);
+extern int ir_cb_eval_array(lua_State *L, lua_cb_data *cb, int n,
+  const double *x, int xs, int xc, double *v, int vs, int vc);
+extern int ir_cb_eval_n(lua_State *L, lua_cb_data *cb, int nx,
+  const double *x, int *nv, double *v);
+extern int ir_cb_compiled(lua_cb_data *cb);
+
+// Callback profiling: calls, time, and Lua memory, per callback.
+extern int ir_cb_prof_enable(int on);
+extern int ir_cb_prof_report(lua_State *L, int n);
+extern void ir_cb_prof_reset(void);
+
+// A pool of lua_States, one per thread, for evaluating callbacks.
+typedef struct ir_pool ir_pool;
+extern ir_pool *ir_pool_create(int n, const char *file);
+extern lua_State *ir_pool_state(ir_pool *p, int i);
+extern int ir_pool_sync(ir_pool *p);
+extern void ir_pool_free(ir_pool *p);
+
+// Detach the well-known tables from the input's lua_State, so it can be
+// closed; callbacks and references are then used with a NULL lua_State.
+extern int ir_freeze(lua_State *L);
+extern lua_State *ir_frozen_state(void);
+
+// The arena that holds callback data, compiled callbacks, and names.
+extern int ir_release(lua_State *L, const char *t);
+extern int ir_reset_arena(void);
+extern size_t ir_arena_bytes(size_t *high);
+
+// Callbacks of one or two parameters, tabulated for fast interpolation.
+typedef struct ir_cb_table ir_cb_table;
+enum { IR_TAB_CLAMP, IR_TAB_ERROR, IR_TAB_LUA }; // Out-of-domain policies.
+extern ir_cb_table *ir_cb_tabulate(lua_State *L, lua_cb_data *cb, int ndim,
+  const double *lo, const double *hi, double tol, int policy);
+extern int ir_cb_table_eval(lua_State *L, const ir_cb_table *t, int n,
+  const double *x, int xs, int xc, double *v, int vs);
+extern double ir_cb_table_error(const ir_cb_table *t);
+extern size_t ir_cb_table_bytes(const ir_cb_table *t);
+extern void ir_cb_table_free(ir_cb_table *t);
+
+// Snapshots of well-known tables, for restarts without ir_read.
+extern int ir_save(lua_State *L, const char *t, const char *file);
+extern int ir_load(lua_State *L, const char *t, const char *file);
+
+// Tables packed into a buffer, e.g., to be broadcast to other processes.
+extern void *ir_pack(lua_State *L, const char *t, size_t *len);
+extern int ir_unpack(lua_State *L, const void *buf, size_t len);
+extern void ir_pack_free(void *buf);
+
+// Change tracking, for re-reading tables in steering loops.
+typedef struct ir_track ir_track;
+typedef void ir_track_fn(const char *path, void *arg);
+extern ir_track *ir_track_create(lua_State *L, const char *t);
+extern int ir_track_read(lua_State *L, ir_track *k);
+extern int ir_track_hook(ir_track *k, const char *path, ir_track_fn *f, void *arg);
+extern int ir_track_test(const ir_track *k, const char *path);
+extern int ir_track_nchanged(const ir_track *k);
+extern const char *ir_track_changed(const ir_track *k, int i);
+extern void ir_track_free(ir_track *k);
+
+// Profiling of ir_read: one entry per table read.  See ir_stats.
+typedef struct {
+  const char *name;   // Path, without indexes, e.g., "table1.table2".
+  long reads, elements, bytes, strings, callbacks, refs;
+  double seconds;     // Wall time.
+} ir_stat;
+extern int ir_stats_enable(int on);
+extern int ir_stats(int i, ir_stat *s);
+extern void ir_stats_reset(void);
+extern int ir_stats_json(const char *file);
 
 #if defined(__cplusplus)
 }
@@ -36,6 +36,11 @@ typedef struct {
   int flb;          // Fortran lower bound, if array.
   int fub;          // Fortran upper bound, if array.  Zero for scalar.
   int typ;          // Type code for the variable.  See Typ above.
+  int n1, n2;       // For a Vir2_/Vir3_ array, the extents of its first
+                    // dimensions (n2 is 0 for Vir2_); fub is the number
+                    // of elements.  Zero otherwise.
+  size_t proto;     // For a Sstructure, the offset of its prototype
+                    // (ID_proto) from the variable.  Zero otherwise.
 } ir_element;
 
 
@@ -46,6 +51,21 @@ typedef struct {
 } ir_wkt_desc;
 
 
+// One slot of a generated, open-addressed hash table of names.
+typedef struct {
+  unsigned int h;   // Hash of the name (see ir_hash in irep.c), or 0.
+  int i;            // Index of the named entry, or -1 for an empty slot.
+} ir_hslot;
+
+
+// Hash table for the names in one ir_element table.  irep-generate sizes
+// each table so that at least one slot is always empty.
+typedef struct {
+  size_t n;         // Number of slots.
+  ir_hslot *s;      // The slots.
+} ir_htable;
+
+
 // These lookup tables need to be generated by irep-generate for the entire
 // program, and must include *all* wkt's. See irep-generate for details;
 // linking irep into a program that does not define ir_wktt and ir_ta will
@@ -54,6 +74,9 @@ typedef struct {
 // list of all well known tables and sub-tables
 extern ir_element *ir_ta[];
 
+// hashed name lookup for each table in ir_ta (same indexing as ir_ta)
+extern ir_htable ir_ha[];
+
 // the index of top-level wkt's (this is where ir_read looks to figure out
 // where to write things)
 extern ir_wkt_desc ir_wktt[];
@@ -61,5 +84,8 @@ extern ir_wkt_desc ir_wktt[];
 // total number of wkt's in the index
 extern size_t ir_wktt_size;
 
+// hashed directory of the names in ir_wktt
+extern ir_htable ir_wkth;
+
 
 #endif // ir_index_h
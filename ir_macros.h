@@ -47,6 +47,23 @@
 #define Vir_log(ID,NELEM,DV) logical(c_bool),dimension(NELEM) :: ID = .DV.
 #define Vir_str(ID,LEN,NELEM) character(c_char),dimension(LEN,NELEM) :: ID
 
+// Vir2_{dbl,int,log}, Vir3_{dbl,int,log}: Two- and three-dimensional
+// arrays of double, integer, logical, with extents N1, N2 (and N3).
+// Storage is contiguous, in Fortran (column-major) order.
+#define Vir2_dbl(ID,N1,N2,DV) real(c_double),dimension(N1,N2) :: ID = DV##_c_double
+#define Vir2_int(ID,N1,N2,DV) integer(c_int),dimension(N1,N2) :: ID = DV
+#define Vir2_log(ID,N1,N2,DV) logical(c_bool),dimension(N1,N2) :: ID = .DV.
+#define Vir3_dbl(ID,N1,N2,N3,DV) real(c_double),dimension(N1,N2,N3) :: ID = DV##_c_double
+#define Vir3_int(ID,N1,N2,N3,DV) integer(c_int),dimension(N1,N2,N3) :: ID = DV
+#define Vir3_log(ID,N1,N2,N3,DV) logical(c_bool),dimension(N1,N2,N3) :: ID = .DV.
+
+// Dir_{dbl,int,log}: Runtime-sized vector double, integer, logical.
+// ir_read allocates it to the length of the Lua array; an entry missing
+// from the array is 0 (or false).  See ir_dir_dbl in ir_extern.h.
+#define Dir_dbl(ID) type(ir_dir) :: ID
+#define Dir_int(ID) type(ir_dir) :: ID
+#define Dir_log(ID) type(ir_dir) :: ID
+
 // Structure: Declare a variable ID of type T.
 #define Structure(T,ID) type(T) :: ID
 #define Callback(ID,NP,NR) Structure(lua_cb_data, ID)
@@ -55,6 +72,11 @@
 // FB: Fortran bounds; CB: C bounds
 #define Vstructure(T,ID,FB,CB) type(T) :: ID(FB)
 
+// Sstructure: Declare a sparse vector of structures, with Fortran bounds
+// FB.  Only the elements in the input are allocated; ID_proto holds the
+// defaults.  See ir_sparse_get in ir_extern.h.
+#define Sstructure(T,ID,FB) type(ir_sparse) :: ID; type(T) :: ID##_proto
+
 // ==================================================================
 // ===========================  LUA SECTION  ========================
 // ==================================================================
@@ -81,9 +103,23 @@
 #define Vir_log(ID,NELEM,DV)  ID @@@ vb %%% DV       %%% 0   %%% NELEM
 #define Vir_str(ID,LEN,NELEM) ID @@@ vs %%% "(none)" %%% LEN %%% NELEM
 
+// Two- and three-dimensional arrays of double, integer, logical.
+#define Vir2_dbl(ID,N1,N2,DV)    ID @@@ ad %%% DV %%% 0 %%% N1,N2
+#define Vir2_int(ID,N1,N2,DV)    ID @@@ ai %%% DV %%% 0 %%% N1,N2
+#define Vir2_log(ID,N1,N2,DV)    ID @@@ ab %%% DV %%% 0 %%% N1,N2
+#define Vir3_dbl(ID,N1,N2,N3,DV) ID @@@ ad %%% DV %%% 0 %%% N1,N2,N3
+#define Vir3_int(ID,N1,N2,N3,DV) ID @@@ ai %%% DV %%% 0 %%% N1,N2,N3
+#define Vir3_log(ID,N1,N2,N3,DV) ID @@@ ab %%% DV %%% 0 %%% N1,N2,N3
+
+// Runtime-sized vector double, integer, logical.
+#define Dir_dbl(ID)           ID @@@ dd %%% {}       %%% 0   %%% 0
+#define Dir_int(ID)           ID @@@ di %%% {}       %%% 0   %%% 0
+#define Dir_log(ID)           ID @@@ db %%% {}       %%% 0   %%% 0
+
 #define Structure(T,ID) ID = T, --
 #define Callback(ID,NP,NR)    ID @@@ lf %%% function %%% NP   %%% NR
 #define Vstructure(T,ID,FB,CB) ID = { [1] = T }, --
+#define Sstructure(T,ID,FB) ID = { [1] = T }, --
 
 // ==================================================================
 // ===========================  GENERATOR SECTION  ==================
@@ -112,8 +148,22 @@
 #define Vir_log(ID,NELEM,DV)  T_log ID 0 NELEM
 #define Vir_str(ID,LEN,NELEM) T_str ID LEN NELEM
 
+// Two- and three-dimensional arrays of double, integer, logical.
+#define Vir2_dbl(ID,N1,N2,DV)    T_dbl ID 0 N1,N2
+#define Vir2_int(ID,N1,N2,DV)    T_int ID 0 N1,N2
+#define Vir2_log(ID,N1,N2,DV)    T_log ID 0 N1,N2
+#define Vir3_dbl(ID,N1,N2,N3,DV) T_dbl ID 0 N1,N2,N3
+#define Vir3_int(ID,N1,N2,N3,DV) T_int ID 0 N1,N2,N3
+#define Vir3_log(ID,N1,N2,N3,DV) T_log ID 0 N1,N2,N3
+
+// Runtime-sized vector double, integer, logical: fub is -1.
+#define Dir_dbl(ID)           T_dbl ID 0 -1
+#define Dir_int(ID)           T_int ID 0 -1
+#define Dir_log(ID)           T_log ID 0 -1
+
 #define Structure(T,ID) T_tbl ID T 0:0
 #define Vstructure(T,ID,FB,CB) T_tbl ID T FB
+#define Sstructure(T,ID,FB) T_sparse ID T FB
 
 // ==================================================================
 // ===========================  C SECTION  ==========================
@@ -153,9 +203,30 @@
 #define Vir_log(ID,NELEM,DV) BOOLEAN ID[NELEM];
 #define Vir_str(ID,LEN,NELEM) char ID[NELEM][LEN];
 
+// Two- and three-dimensional arrays of double, integer, logical, in
+// Fortran order: Fortran ID(i,j,k) is ID[k-1][j-1][i-1] in C.
+#define Vir2_dbl(ID,N1,N2,DV) double ID[N2][N1];
+#define Vir2_int(ID,N1,N2,DV) int ID[N2][N1];
+#define Vir2_log(ID,N1,N2,DV) BOOLEAN ID[N2][N1];
+#define Vir3_dbl(ID,N1,N2,N3,DV) double ID[N3][N2][N1];
+#define Vir3_int(ID,N1,N2,N3,DV) int ID[N3][N2][N1];
+#define Vir3_log(ID,N1,N2,N3,DV) BOOLEAN ID[N3][N2][N1];
+
+// Runtime-sized vector double, integer, logical: ID.p points to ID.n
+// elements.
+#define Dir_dbl(ID) ir_dir ID;
+#define Dir_int(ID) ir_dir ID;
+#define Dir_log(ID) ir_dir ID;
+
 #define Structure(T,ID) T ID;
+#if defined(__cplusplus) && __cplusplus >= 201103L
+#define Callback(ID,NP,NR) ::irep::Callback<NP,NR> ID; // See ir_callback.h.
+#else // C, or C++ before C++11.
 #define Callback(ID,NP,NR) Structure(lua_cb_data, ID)
+#endif
 #define Vstructure(T,ID,FB,CB) T ID[CB];
+// The index records where ID_proto is (see SPARSE_PROTO in irep.c).
+#define Sstructure(T,ID,FB) ir_sparse ID; T ID##_proto;
 
 #endif  // defined IREP_LANG_*
 #endif  // ir_macros_h
@@ -0,0 +1,149 @@
+// Copyright 2016-2021 Lawrence Livermore National Security, LLC and other
+// IREP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#ifndef ir_reflect_h
+#define ir_reflect_h
+
+// Compile-time descriptions of WKT structs, for C++.
+//
+// `irep-generate --mode cxx wkt_*.h` writes a header that specializes
+// irep::Reflect<T> for each Beg_struct type T in those headers.  Code can
+// then visit the fields of a struct with for_each_field, and templates
+// can pick apart each field by its descriptor (name, type, bounds, and
+// member pointer).  All of it is resolved at compile time, so field-wise
+// operations (checksums, copies, MPI datatypes) inline completely, with
+// no lookups in the ir_element tables.
+//
+//   struct Sum {
+//     double s = 0;
+//     template <typename F> void operator()(F, const double &v) { s += v; }
+//     template <typename F, typename M> void operator()(F, const M &) {}
+//   };
+//   Sum sum;
+//   irep::for_each_field(irep::table1, sum);
+//
+// This header needs C++11.
+
+#if defined(__cplusplus)
+#include <cstddef>
+#include <tuple>
+#include <type_traits>
+
+namespace irep {
+
+// What a field holds.  Same order as ir_type in ir_index.h.
+enum class Type { Int, Dbl, Log, Str, Cbk, Tbl, Ref, Ptr };
+
+// Descriptor of member P, of type M, in WKT struct S.  M is an array type
+// for Vir_*, Vstructure, and strings; a Vir_str is char[NELEM][LEN], and
+// a Vir2_ or Vir3_ array is T[N2][N1] or T[N3][N2][N1], with fub N1*N2
+// (*N3).  As in ir_element, len is the length of a string (including its
+// trailing null), flb:fub are the Fortran bounds of an array, and fub is
+// 0 for a scalar.  A Dir_* vector is an ir_dir member, with fub -1 and
+// the type of its elements; an Sstructure is an ir_sparse member, of
+// Type::Tbl.  Generated descriptors derive from Field, and add name() and
+// offset().
+template <typename S, typename M, M S::*P, Type TYP, int LEN, int FLB, int FUB>
+struct Field {
+  typedef S struct_type;
+  typedef M member_type;
+  static constexpr Type type = TYP;
+  static constexpr int len = LEN;
+  static constexpr int flb = FLB;
+  static constexpr int fub = FUB;
+  // Is it an array (Vir_*, Vir2_, Vir3_, Vstructure), rather than a scalar
+  // or a string?
+  static constexpr bool is_array = std::rank<M>::value >= (TYP == Type::Str ? 2 : 1);
+  // Number of elements, over all dimensions: 1 for a scalar.
+  static constexpr std::size_t count = !is_array ? 1 : TYP == Type::Str ?
+    std::extent<M>::value : sizeof(M) / sizeof(typename std::remove_all_extents<M>::type);
+  // One element: M for a scalar.
+  typedef typename std::conditional<!is_array, M,
+    typename std::conditional<TYP == Type::Str, typename std::remove_extent<M>::type,
+      typename std::remove_all_extents<M>::type>::type>::type value_type;
+
+  static constexpr M S::*pointer() { return P; }
+  static M &get(S &s) { return s.*P; }
+  static const M &get(const S &s) { return s.*P; }
+};
+
+template <typename S, typename M, M S::*P, Type TYP, int LEN, int FLB, int FUB>
+constexpr Type Field<S,M,P,TYP,LEN,FLB,FUB>::type;
+template <typename S, typename M, M S::*P, Type TYP, int LEN, int FLB, int FUB>
+constexpr int Field<S,M,P,TYP,LEN,FLB,FUB>::len;
+template <typename S, typename M, M S::*P, Type TYP, int LEN, int FLB, int FUB>
+constexpr int Field<S,M,P,TYP,LEN,FLB,FUB>::flb;
+template <typename S, typename M, M S::*P, Type TYP, int LEN, int FLB, int FUB>
+constexpr int Field<S,M,P,TYP,LEN,FLB,FUB>::fub;
+template <typename S, typename M, M S::*P, Type TYP, int LEN, int FLB, int FUB>
+constexpr bool Field<S,M,P,TYP,LEN,FLB,FUB>::is_array;
+template <typename S, typename M, M S::*P, Type TYP, int LEN, int FLB, int FUB>
+constexpr std::size_t Field<S,M,P,TYP,LEN,FLB,FUB>::count;
+
+// Reflect<T> describes WKT struct T.  The generated header defines it for
+// each Beg_struct type, with:
+//   name()   the struct name, e.g., "irt_table1"
+//   fields   a std::tuple of the field descriptors, in declaration order
+//   size     the number of fields
+template <typename T> struct Reflect;
+
+namespace detail {
+template <typename T> struct voider { typedef void type; };
+}
+
+// Is Reflect<T> defined, i.e., is T a WKT struct?  For recursing into
+// Structure and Vstructure members.
+template <typename T, typename = void>
+struct is_reflected : std::false_type {};
+template <typename T>
+struct is_reflected<T, typename detail::voider<typename Reflect<T>::fields>::type>
+  : std::true_type {};
+
+namespace detail {
+template <std::size_t I, std::size_t N>
+struct each_field {
+  template <typename S, typename V>
+  static void apply(S &s, V &v) {
+    typedef typename Reflect<typename std::remove_const<S>::type>::fields fields;
+    typedef typename std::tuple_element<I, fields>::type F;
+    v(F(), F::get(s));
+    each_field<I+1, N>::apply(s, v);
+  }
+  template <typename S, typename V>
+  static void apply(V &v) {
+    typedef typename std::tuple_element<I, typename Reflect<S>::fields>::type F;
+    v(F());
+    each_field<I+1, N>::template apply<S>(v);
+  }
+};
+template <std::size_t N>
+struct each_field<N, N> {
+  template <typename S, typename V> static void apply(S &, V &) {}
+  template <typename S, typename V> static void apply(V &) {}
+};
+}
+
+// Call v(F(), m) for each member m of s, in declaration order, where F is
+// the member's descriptor.  m is const if s is.  Returns v.
+template <typename S, typename V>
+V &for_each_field(S &s, V &v) {
+  typedef Reflect<typename std::remove_const<S>::type> R;
+  detail::each_field<0, std::tuple_size<typename R::fields>::value>::apply(s, v);
+  return v;
+}
+
+// Call v(F()) for each field descriptor F of S, in declaration order,
+// e.g., to build an MPI datatype for S.  Returns v.
+template <typename S, typename V>
+V &for_each_field(V &v) {
+  detail::each_field<0, std::tuple_size<typename Reflect<S>::fields>::value>
+    ::template apply<S>(v);
+  return v;
+}
+
+} // namespace irep
+#endif
+
+#endif
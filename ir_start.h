@@ -15,6 +15,9 @@ use :: ir_std
 #else
 #include "ir_std.h"
 #if defined(__cplusplus)
+#if __cplusplus >= 201103L
+#include "ir_callback.h"
+#endif
 namespace irep {
 extern "C" {
 #endif
@@ -26,6 +26,24 @@ Beg_struct(lua_cb_data)
   ir_ptr(data)
 End_struct(lua_cb_data)
 
+// Runtime-sized vector (Dir_dbl, Dir_int, Dir_log), allocated by ir_read
+// to the length of the Lua array.
+Beg_struct(ir_dir)
+  ir_ptr(p)   // n elements (double, int, or BOOLEAN), or NULL
+  ir_int(n, 0)
+End_struct(ir_dir)
+
+// Sparse vector of structures (Sstructure).  Only the elements that the
+// input touches are allocated, each as a copy of the prototype ID_proto,
+// declared with it in the enclosing struct.  See ir_sparse_get.
+Beg_struct(ir_sparse)
+  ir_ptr(elem)    // n pointers to the elements, in the order first read
+  ir_ptr(key)     // n ints: the index of each element
+  ir_ptr(hash)    // index map: 2*cap ints, each 0 or 1 + a position
+  ir_int(n, 0)
+  ir_int(cap, 0)
+End_struct(ir_sparse)
+
 #if defined(__cplusplus)
 }
 #endif
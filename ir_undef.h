@@ -15,7 +15,17 @@
 #undef Vir_dbl
 #undef Vir_int
 #undef Vir_str
+#undef Vir2_log
+#undef Vir2_dbl
+#undef Vir2_int
+#undef Vir3_log
+#undef Vir3_dbl
+#undef Vir3_int
+#undef Dir_log
+#undef Dir_dbl
+#undef Dir_int
 #undef Structure
+#undef Sstructure
 #undef Begin_cb_pattern_list
 #undef cb_pat
 #undef End_cb_pattern_list
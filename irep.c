@@ -10,6 +10,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
+#include <math.h>
+#include <setjmp.h>
 #include <time.h>
 #include <sys/time.h>
 
@@ -23,29 +26,73 @@ extern "C" {
 
 #include "ir_index.h"
 #include "ir_std.h"
+#include "ir_extern.h"
 
-// BSZ is the internal buffer size for strings typically containing the
-// name of Lua table elements such as "table1.table2[123].foo.bar".
+// BSZ is the size of the buffer ir_elem uses to build its "return <expr>"
+// chunk, for names that are not simple paths, such as "t.v[#t.v]".
 #define BSZ 2048
 
 // Set irep_debug=1 in the environment, to see elements visited during ir_read.
+// Arguments to Dbg_print are not evaluated unless irep_debug is set, so
+// callers can build element names in them for free.
 static int irep_debug = -1;
-static void Dbg_print(const char *fmt, ...)
+static void dbg_print(const char *fmt, ...)
 {
   va_list argp;
-  if (irep_debug > 0) {
-    char buf[BSZ];
-    const int i = sprintf(buf, "IR_DBG: ");
-    va_start(argp, fmt);
-    (void)vsnprintf(buf+i,sizeof(buf)-10,fmt,argp);
-    va_end(argp);
-    (void)fprintf(stderr,"%s\n",buf);
+  (void)fprintf(stderr,"IR_DBG: ");
+  va_start(argp, fmt);
+  (void)vfprintf(stderr,fmt,argp);
+  va_end(argp);
+  (void)fprintf(stderr,"\n");
+}
+#define Dbg_print(...) do { if (irep_debug > 0) dbg_print(__VA_ARGS__); } while (0)
+
+// Breadcrumbs record the path from the table being read (or unread) down
+// to the current element.  Each level of the recursion keeps its crumb on
+// the C stack, linked to its parent's.  A crumb holds either a name (the
+// starting path at the root, or an element name below it), or an array
+// index.  The full name, e.g., "table1.table2[3].f2", is built only when
+// it is needed for an error message, a debug listing, or a callback name.
+typedef struct ir_crumb {
+  const struct ir_crumb *up;  // Enclosing element, or NULL at the root.
+  const char *name;           // Element name, or NULL for an array index.
+  int i;                      // Array index, if name is NULL.
+} ir_crumb;
+
+// Build the full name for crumb c.  The result is kept in a buffer that
+// is reused by the next call, so there is no limit on its length.
+static const char *crumb_str(const ir_crumb *c) {
+  static char *buf = 0;
+  static size_t bufsz = 0;
+  const ir_crumb *p;
+  char ibuf[16];
+  size_t k, n = 0;
+
+  for (p=c; p; p=p->up)
+    n += p->name ? strlen(p->name) + (p->up != 0) : (size_t)sprintf(ibuf,"[%d]",p->i);
+  if (n+1 > bufsz) {
+    char *nbuf = realloc(buf, n+1);
+    if (!nbuf) return "(name unavailable)";
+    buf = nbuf;
+    bufsz = n+1;
   }
+  buf[n] = '\0';
+  for (p=c; p; p=p->up) { // Fill in from the right.
+    if (p->name) {
+      k = strlen(p->name);
+      memcpy(buf + (n -= k), p->name, k);
+      if (p->up) buf[--n] = '.';
+    } else {
+      k = sprintf(ibuf,"[%d]",p->i);
+      memcpy(buf + (n -= k), ibuf, k);
+    }
+  }
+  return buf;
 }
 
 // Note comma operator below, specifying the return value.
 #define Ir_error(fmt,...) \
-  fprintf(stderr,"ERROR (Lua/IR): " fmt "\n",__VA_ARGS__),1
+  (fprintf(stderr,"ERROR (Lua/IR): " fmt "\n",__VA_ARGS__),1)
 
 // TYP_ERR is common enough to get its own macro.
 #define TYP_ERR(lrep, ltyp, ityp) \
@@ -56,34 +103,66 @@ Ir_error("Type mismatch: %s (%s): Expected: %s",lrep,s_typ[ltyp],s_typ[ityp])
 static const char *s_typ[] = { "integer", "double", "logical", "string",
   "callback", "table", "reference", "pointer", "new_callback" };
 
-// Find index of "name" in element table tp.
-static int find_element(const char *name, ir_element *tp) {
-  int i;
-  for (i=0; tp[i].name; i++)
-    if (strcmp(name, tp[i].name) == 0) return i;
+// Is ep a runtime-sized vector (Dir_*)?  Its fub is -1, its sz is the
+// size of one element, and its storage is an ir_dir.
+#define IR_DYN(ep) ((ep)->fub < 0 && (ep)->typ != T_tbl)
+
+// Is ep a sparse vector of structures (Sstructure)?  Its len is -1, and
+// its storage is an ir_sparse.
+#define IR_SPARSE(ep) ((ep)->typ == T_tbl && (ep)->len < 0)
+
+// Hash of an IREP name.  This must match ir_hash() in irep-generate,
+// which precomputes the hash tables in ir_ha and ir_wkth.
+static uint32_t ir_hash(const char *s) {
+  uint32_t h = 2166136261u;
+  while (*s) h = (h + (unsigned char)*s++) * 16777619u;
+  return h;
+}
+
+// Probe the hash table ht for "name".  The names of the hashed entries
+// are the "const char *" found at base + i*stride, for entry i.
+static int find_hashed(const char *name, const ir_htable *ht,
+                       const void *base, size_t stride) {
+  uint32_t h = ir_hash(name);
+  size_t k = h % ht->n;
+  for (; ht->s[k].i >= 0; k = (k+1 == ht->n) ? 0 : k+1) {
+    const char *s = *(const char **)((const char *)base + ht->s[k].i*stride);
+    if (ht->s[k].h == h && strcmp(name, s) == 0) return ht->s[k].i;
+  }
+  return -1;
+}
+
+// Find index of "name" in element table ir_ta[ti].  An element that is
+// not a struct (ti == -1) has no named elements.  Building with
+// IREP_LINEAR_FIND restores the strcmp scan that the hash tables
+// replaced, for examples/bench to time ir_read against.
+static int find_element(const char *name, int ti) {
+  if (ti < 0) return -1;
+#ifdef IREP_LINEAR_FIND
+  for (int i=0; ir_ta[ti][i].name; i++)
+    if (strcmp(name, ir_ta[ti][i].name) == 0) return i;
   return -1;
+#else
+  return find_hashed(name, &ir_ha[ti], ir_ta[ti], sizeof(ir_element));
+#endif
 }
 
 // Find the entry for the well-known table "name".
 static int find_wkt(const char *name) {
-  int i;
-  for (i=0; i < ir_wktt_size; i++) {
-    if (strcmp(name, ir_wktt[i].e.name) == 0) return i;
-  }
-  return -1;
+  return find_hashed(name, &ir_wkth, &ir_wktt[0].e.name, sizeof(ir_wkt_desc));
 }
 
 #if 0
 // Print out an IREP structure.  Unused, except for debugging.
-static int iir_print(char *lrep,char *lp,void *bp,ir_element *ep, int treat_as_scalar) {
+static int iir_print(const ir_crumb *c,void *bp,ir_element *ep, int treat_as_scalar) {
   int i, j, errcnt = 0;
 
   if (ep->typ == T_tbl) { // Current IREP element is a struct.
     printf("T: %4ld %10s %2d %3ld %3ld %3d %d:%d %d %s\n",
     (long int)bp, ep->name,
-    ep->ti, ep->sz, ep->off, ep->len, ep->flb, ep->fub, ep->typ, lrep);
+    ep->ti, ep->sz, ep->off, ep->len, ep->flb, ep->fub, ep->typ, crumb_str(c));
 
-    char *nlp;
+    ir_crumb nc = { c, 0, 0 };
     void *nbp;
     ir_element *nep = ep;
 
@@ -91,16 +170,16 @@ static int iir_print(char *lrep,char *lp,void *bp,ir_element *ep, int treat_as_s
     if (ep->fub == 0 || treat_as_scalar) {
       for (i=0; ir_ta[ep->ti][i].name; i++) {
         nep = &ir_ta[ep->ti][i];
-        nlp = lp + snprintf(lp, BSZ+(lrep-lp), ".%s", nep->name);
+        nc.name = nep->name;
         nbp = bp + nep->off;
-        errcnt += iir_print(lrep, nlp, nbp, nep, 0);
+        errcnt += iir_print(&nc, nbp, nep, 0);
       }
 
     } else { // Array of structs.
       for (j=ep->flb; j<=ep->fub; j++) {
-        nlp = lp + snprintf(lp, BSZ+(lrep-lp), "[%d]", j);
+        nc.i = j;
         nbp = bp + (j - ep->flb)*ep->sz;
-        errcnt += iir_print(lrep, nlp, nbp, nep, 1);
+        errcnt += iir_print(&nc, nbp, nep, 1);
       }
     }
 
@@ -112,39 +191,195 @@ static int iir_print(char *lrep,char *lp,void *bp,ir_element *ep, int treat_as_s
     do {
       printf("%d: %4ld %10s %2d %3ld %3ld %3d %d:%d %d %s\n", i,
       (long int)(bp + (i - ep->flb)*ep->sz), ep->name,
-      ep->ti, ep->sz, ep->off, ep->len, ep->flb, ep->fub, ep->typ, lrep);
+      ep->ti, ep->sz, ep->off, ep->len, ep->flb, ep->fub, ep->typ, crumb_str(c));
     } while (++i <= ep->fub);
   }
-  *lp = '\0';
   return errcnt;
 }
 #endif
 
+// The libIR arena.  Callback data, compiled callbacks, and the names
+// returned by ir_get_function_name are allocated from it, in blocks, so
+// the callbacks of a table sit together in memory for batched
+// evaluation, and nothing is freed one allocation at a time.  Data that
+// a new read replaces is left behind in its block, until ir_reset_arena
+// copies the live data (in index order) to new blocks and frees the old.
+#define ARENA_BLOCK 65536   // Default block size, in bytes.
+#define ARENA_ALIGN 16
+
+typedef struct ir_block ir_block;
+struct ir_block {
+  ir_block *next;
+  size_t used, size;        // The memory follows, at ARENA_HDR.
+};
+#define ARENA_HDR ((sizeof(ir_block) + ARENA_ALIGN-1) & ~(size_t)(ARENA_ALIGN-1))
+
+// Names and compiled callbacks by callback address, in an open-addressing
+// hash table.  The compiled callback is kept here, not in lua_cb_data, so
+// that the layout of lua_cb_data (shared with Fortran) does not change.
+typedef struct {
+  const void *cb;           // Key, or NULL for an empty slot.
+  char *name;               // In the arena, or NULL.
+  const void *code;         // Compiled callback (ir_cprog), in the arena, or NULL.
+} ir_aname;
+
+static struct {
+  ir_block *head;           // The block being filled, then older ones.
+  size_t used;              // Bytes handed out since the last reset.
+  size_t high;              // Most bytes ever handed out at once.
+  ir_aname *name;
+  size_t nname, namecap;
+} arena;
+
+// Allocate n bytes from the arena, or return NULL.
+static void *arena_alloc(size_t n) {
+  ir_block *b = arena.head;
+  char *p;
+  n = (n + ARENA_ALIGN-1) & ~(size_t)(ARENA_ALIGN-1);
+  if (!b || b->used + n > b->size) {
+    size_t size = (n > ARENA_BLOCK) ? n : ARENA_BLOCK;
+    if (!(b = (ir_block *)malloc(ARENA_HDR + size))) return NULL;
+    b->used = 0;
+    b->size = size;
+    b->next = arena.head;
+    arena.head = b;
+  }
+  p = (char *)b + ARENA_HDR + b->used;
+  b->used += n;
+  arena.used += n;
+  if (arena.used > arena.high) arena.high = arena.used;
+  return p;
+}
+
+// Copy n bytes to the arena.
+static void *arena_dup(const void *d, size_t n) {
+  void *p = arena_alloc(n);
+  if (p) memcpy(p, d, n);
+  return p;
+}
+
+static size_t arena_slot(const ir_aname *tab, size_t cap, const void *cb) {
+  size_t i = (size_t)(((uintptr_t)cb >> 3) * 11400714819323198485ULL) & (cap-1);
+  while (tab[i].cb && tab[i].cb != cb) i = (i+1) & (cap-1);
+  return i;
+}
+
+// The entry for callback cb, added if add is set and there is none, or
+// NULL.
+static ir_aname *arena_entry(const void *cb, int add) {
+  ir_aname *e;
+  size_t i;
+  if (!add) {
+    if (!arena.namecap) return NULL;
+    e = &arena.name[arena_slot(arena.name, arena.namecap, cb)];
+    return e->cb ? e : NULL;
+  }
+  if (2*(arena.nname + 1) > arena.namecap) { // Keep the table at most half full.
+    size_t cap = arena.namecap ? 2*arena.namecap : 64;
+    ir_aname *nt = (ir_aname *)calloc(cap, sizeof *nt);
+    if (!nt) return NULL;
+    for (i=0; i < arena.namecap; i++)
+      if (arena.name[i].cb) nt[arena_slot(nt, cap, arena.name[i].cb)] = arena.name[i];
+    free(arena.name);
+    arena.name = nt;
+    arena.namecap = cap;
+  }
+  e = &arena.name[arena_slot(arena.name, arena.namecap, cb)];
+  if (!e->cb) {
+    e->cb = cb;
+    e->name = NULL;
+    e->code = NULL;
+    arena.nname++;
+  }
+  return e;
+}
+
+// The arena's copy of the name of callback cb, made from name if there
+// is none yet, or NULL.
+static char *arena_name(const void *cb, const char *name) {
+  ir_aname *e = arena_entry(cb, name != NULL);
+  if (e && !e->name && name) e->name = (char *)arena_dup(name, strlen(name) + 1);
+  return e ? e->name : NULL;
+}
+
+// The compiled callback cb, or NULL.
+static const void *arena_code(const void *cb) {
+  ir_aname *e = arena_entry(cb, 0);
+  return e ? e->code : NULL;
+}
+
+// Set (or, if code is NULL, clear) the compiled callback cb.  Returns 1
+// if it could not be set.
+static int arena_set_code(const void *cb, const void *code) {
+  ir_aname *e = arena_entry(cb, code != NULL);
+  if (e) e->code = code;
+  return code && !e;
+}
+
+// Forget the arena name and compiled code of callback cb (they stay in
+// the arena until ir_reset_arena).
+static void arena_forget(const void *cb) {
+  size_t i, m = arena.namecap - 1;
+  ir_aname e;
+
+  if (!arena.namecap) return;
+  i = arena_slot(arena.name, arena.namecap, cb);
+  if (!arena.name[i].cb) return;
+  arena.name[i].cb = NULL;
+  arena.nname--;
+  for (i = (i+1) & m; arena.name[i].cb; i = (i+1) & m) { // Rehash the rest of the run.
+    e = arena.name[i];
+    arena.name[i].cb = NULL;
+    arena.name[arena_slot(arena.name, arena.namecap, e.cb)] = e;
+  }
+}
+
+// Free the Lua reference from an earlier read of a callback or
+// ir_reference, if it holds one.  The reference is in L's registry, so
+// the variable must be read again with the lua_State that read it.
+static void ref_drop(lua_State *L, int ref) {
+  if (ref >= 0) luaL_unref(L, LUA_REGISTRYINDEX, ref);
+}
+
 // Handle variables of "type" ir_reference.  These variables become
 // Lua references, to be handled later by the compiled code as needed.
-static int read_ref(lua_State *L,char *lrep,void *bp) {
-  *((int *)bp) = luaL_ref(L, LUA_REGISTRYINDEX);
+static int read_ref(lua_State *L,const ir_crumb *c,void *bp) {
+  int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  ref_drop(L, *((int *)bp));
+  *((int *)bp) = ref;
   lua_pushnil(L);
-  Dbg_print("%s = %d", lrep, *((int *)bp));
+  Dbg_print("%s = %d", crumb_str(c), *((int *)bp));
   return 0;
 }
 
 // Store a name (lrep) using an address (its associated lua_cb_data) as
 // the key.  Internal, used by read_cbk.
-static void ir_set_function_name(lua_State *L,char *lrep,void *p) {
+static void ir_set_function_name(lua_State *L,const char *lrep,void *p) {
   lua_pushlightuserdata(L,p);
   lua_pushstring(L,lrep);
   lua_settable(L,LUA_REGISTRYINDEX);
 }
 
-// Retrieve a name by address.  Strdup is a memory leak.  This routine
-// should normally only ever get used in error reporting, however, so
-// the memory leak is probably not very important.
-char *ir_get_function_name(lua_State *L,void *p) {
-  lua_pushlightuserdata(L,p);
-  lua_gettable(L,LUA_REGISTRYINDEX);
-  char *s = strdup(lua_tostring(L,-1));
-  lua_pop(L,1);
+// After ir_freeze, names and Lua values come from the frozen store.
+static const char *frz_name(const void *p);
+static lua_State *frz_state(lua_cb_data *cb);
+
+// Retrieve a name by address.  The name is kept in the arena, so the
+// first call for each callback copies it, and later calls return the same
+// copy, which is valid until ir_reset_arena.  L may be NULL after
+// ir_freeze.
+const char *ir_get_function_name(lua_State *L,void *p) {
+  const char *name = NULL;
+  char *s = arena_name(p, NULL);
+  if (s) return s;
+  if (L) {
+    lua_pushlightuserdata(L,p);
+    lua_gettable(L,LUA_REGISTRYINDEX);
+    name = lua_tostring(L,-1);
+  }
+  if (!name) name = frz_name(p);
+  s = name ? arena_name(p, name) : NULL;
+  if (L) lua_pop(L,1);
   return s;
 }
 
@@ -152,351 +387,4826 @@ char *ir_get_function_name(lua_State *L,void *p) {
 int ir_nprm(int npnr) { return npnr%1024 - 9; }
 int ir_nret(int npnr) { return npnr/1024 - 9; }
 
-// Read a Lua callback function.
-static int read_cbk(lua_State *L,char *lrep,void *bp,ir_element *ep) {
-  int i, ii, fref = LUA_NOREF, tv = lua_type(L,-1), npnr = ep->len, base_npnr = ep->len;
-  lua_cb_data *cb = (lua_cb_data *)bp;
+// Native compilation of simple callbacks.
+//
+// read_cbk hands each Lua callback function to cb_compile, which looks up
+// the function's source text (see lua_getinfo) and tries to translate it
+// into a small stack bytecode, run by cprog_run without any lua_State.
+// The text is only trusted if it loads to the same Lua bytecode as the
+// function (see cp_same), and no Lua code is run to check the result.
+// The subset is: parameters and locals, numbers, true and false,
+// arithmetic, comparisons, and/or/not, math.* functions and constants,
+// and if/elseif/else.  For example:
+//
+//   f = function(x,y,z) return 2*x + math.sin(y) end
+//   g = function(x) if x < 0 then return 0 end local a = x*x return a, -a end
+//
+// Anything outside the subset is not compiled (arena_code gives NULL),
+// and the callback is evaluated by Lua as before.  Set irep_compile=0 in the environment to
+// turn compilation off.
 
-  if (tv!=LUA_TNUMBER && tv!=LUA_TTABLE && tv!=LUA_TFUNCTION)
-    return Ir_error("Expected function, array, or number: %s", lrep);
+#define CP_MAXSLOT 64   // Limit on parameters plus locals.
+#define CP_MAXSTACK 64  // Limit on the evaluation stack depth.
 
-  if (tv == LUA_TFUNCTION) {
-    fref = luaL_ref(L, LUA_REGISTRYINDEX);
-    lua_pushnil(L);
+static int irep_compile = 1;
 
-  } else {
-    // Unpack nprm, nret.  Ir_generate enforces nprm>=-1, nret>=-1.
-    // The packing algorithm will allow a lower limit of -9.
-    int nprm = ir_nprm(npnr);
-    int nret = ir_nret(npnr);
+// Operations.  Booleans are kept on the stack as 0.0 or 1.0.
+enum { CP_K, CP_LD, CP_ST, CP_ADD, CP_SUB, CP_MUL, CP_DIV, CP_MOD, CP_POW,
+  CP_UNM, CP_LT, CP_LE, CP_GT, CP_GE, CP_EQ, CP_NE, CP_NOT, CP_AND, CP_OR,
+  CP_SEL, CP_F1, CP_F2, CP_MIN, CP_MAX, CP_JMPF, CP_JMP, CP_RET };
 
-    if (nret == 0)
-      return Ir_error("``%s'': Function declares zero return values."
-      "  Returning a Lua scalar or constant array is not allowed.", lrep);
+typedef struct {
+  int op;           // Operation (CP_*).
+  int a;            // Slot, math function, jump target, or count.
+  double k;         // Constant, for CP_K.
+} ir_insn;
 
-    ii = (tv==LUA_TTABLE) ? lua_objlen(L,-1) : (nret>0) ? nret : 1;
-    if (nret != -1 && ii != nret)
-      return Ir_error("``%s'': need %d return val(s), got %d", lrep, nret, ii);
+typedef struct {
+  int nprm;         // Number of parameters loaded from x.
+  int nret;         // Number of values stored to v.
+  int ninsn;        // Length of insn.
+  ir_insn *insn;    // The code (allocated with this struct).
+} ir_cprog;
 
-    // Recalculate npnr if nret was originally -1.  This is done so that
-    // the callback evaluator will receive the actual length of the data
-    // buffer in the nret value.
-    if (nret == -1) npnr = (ii+9)*1024 + nprm+9;
+// Copy compiled callback p to the arena.
+static ir_cprog *arena_cprog(const ir_cprog *p) {
+  ir_cprog *np = (ir_cprog *)arena_alloc(sizeof *p + p->ninsn * sizeof *p->insn);
+  if (!np) return NULL;
+  *np = *p;
+  np->insn = (ir_insn *)(np+1);
+  memcpy(np->insn, p->insn, p->ninsn * sizeof *p->insn);
+  return np;
+}
 
-    cb->data = realloc(cb->data, ii*sizeof(double));
-    if (!cb->data) return Ir_error("``%s'': realloc failed", lrep);
-    double *dp = (double *)cb->data;
+// The math library, as in Lua 5.1's lmathlib.c.
+static double cp_deg(double x) { return x/(3.14159265358979323846/180.0); }
+static double cp_rad(double x) { return x*(3.14159265358979323846/180.0); }
+static const struct {
+  const char *name;
+  int nargs;                    // -1 for min and max.
+  double (*f1)(double);
+  double (*f2)(double,double);
+} cp_math[] = {
+  {"abs",1,fabs,0}, {"acos",1,acos,0}, {"asin",1,asin,0},
+  {"atan",1,atan,0}, {"atan2",2,0,atan2}, {"ceil",1,ceil,0},
+  {"cos",1,cos,0}, {"cosh",1,cosh,0}, {"deg",1,cp_deg,0},
+  {"exp",1,exp,0}, {"floor",1,floor,0}, {"fmod",2,0,fmod},
+  {"log",1,log,0}, {"log10",1,log10,0}, {"max",-1,0,0},
+  {"min",-1,0,0}, {"pow",2,0,pow}, {"rad",1,cp_rad,0},
+  {"sin",1,sin,0}, {"sinh",1,sinh,0}, {"sqrt",1,sqrt,0},
+  {"tan",1,tan,0}, {"tanh",1,tanh,0}, {0,0,0,0}
+};
 
-    if (tv == LUA_TNUMBER) { // Input is a scalar Lua number.
-      // Broadcast the scalar to all return values.  We treat nret==-1
-      // as if it were nret==1.  (The scalar is treated as a table of
-      // length 1.)
-      i = 0;
-      do {
-        dp[i] = lua_tonumber(L,-1);
-        Dbg_print("%s.data[%d] = %25.17e", lrep, i, dp[i]);
-      } while (++i < nret);
+// Evaluate compiled callback p at one point (see ir_cb_eval_batch for
+// the strides).
+static void cprog_run(const ir_cprog *p, const double *x, int xc,
+                      double *v, int vc) {
+  double r[CP_MAXSLOT], s[CP_MAXSTACK], d;
+  const ir_insn *ip;
+  int j, sp = 0;
 
-    } else { // Input is a Lua table.
-      for (i=1; i<=ii; i++) {
-        lua_rawgeti(L,-1,i);
-        if (lua_type(L,-1) != LUA_TNUMBER)
-          return Ir_error("Bad entry: %s[%d]: %s",lrep,i,lua_tostring(L,-1));
-        dp[i-1] = lua_tonumber(L,-1);
-        Dbg_print("%s.data[%d] = %25.17e",lrep,i-1,dp[i-1]);
-        lua_pop(L,1);
-      }
+  for (j=0; j < p->nprm; j++) r[j] = x[(ptrdiff_t)j*xc];
+  for (ip = p->insn; ; ip++) {
+    switch (ip->op) {
+    case CP_K:   s[sp++] = ip->k; break;
+    case CP_LD:  s[sp++] = r[ip->a]; break;
+    case CP_ST:  r[ip->a] = s[--sp]; break;
+    case CP_ADD: sp--; s[sp-1] = s[sp-1] + s[sp]; break;
+    case CP_SUB: sp--; s[sp-1] = s[sp-1] - s[sp]; break;
+    case CP_MUL: sp--; s[sp-1] = s[sp-1] * s[sp]; break;
+    case CP_DIV: sp--; s[sp-1] = s[sp-1] / s[sp]; break;
+    case CP_MOD: sp--; s[sp-1] = s[sp-1] - floor(s[sp-1]/s[sp])*s[sp]; break;
+    case CP_POW: sp--; s[sp-1] = pow(s[sp-1], s[sp]); break;
+    case CP_UNM: s[sp-1] = -s[sp-1]; break;
+    case CP_LT:  sp--; s[sp-1] = s[sp-1] <  s[sp]; break;
+    case CP_LE:  sp--; s[sp-1] = s[sp-1] <= s[sp]; break;
+    case CP_GT:  sp--; s[sp-1] = s[sp-1] >  s[sp]; break;
+    case CP_GE:  sp--; s[sp-1] = s[sp-1] >= s[sp]; break;
+    case CP_EQ:  sp--; s[sp-1] = s[sp-1] == s[sp]; break;
+    case CP_NE:  sp--; s[sp-1] = s[sp-1] != s[sp]; break;
+    case CP_NOT: s[sp-1] = s[sp-1] == 0.0; break;
+    case CP_AND: sp--; s[sp-1] = s[sp-1] != 0.0 && s[sp] != 0.0; break;
+    case CP_OR:  sp--; s[sp-1] = s[sp-1] != 0.0 || s[sp] != 0.0; break;
+    case CP_SEL: sp -= 2; s[sp-1] = (s[sp-1] != 0.0) ? s[sp] : s[sp+1]; break;
+    case CP_F1:  s[sp-1] = cp_math[ip->a].f1(s[sp-1]); break;
+    case CP_F2:  sp--; s[sp-1] = cp_math[ip->a].f2(s[sp-1], s[sp]); break;
+    case CP_MIN:
+      sp -= ip->a - 1;
+      for (d = s[sp-1], j=1; j < ip->a; j++) if (s[sp-1+j] < d) d = s[sp-1+j];
+      s[sp-1] = d;
+      break;
+    case CP_MAX:
+      sp -= ip->a - 1;
+      for (d = s[sp-1], j=1; j < ip->a; j++) if (s[sp-1+j] > d) d = s[sp-1+j];
+      s[sp-1] = d;
+      break;
+    case CP_JMPF: if (s[--sp] == 0.0) ip = p->insn + ip->a - 1; break;
+    case CP_JMP:  ip = p->insn + ip->a - 1; break;
+    case CP_RET:
+      for (j=0; j < p->nret; j++) v[(ptrdiff_t)j*vc] = s[sp - ip->a + j];
+      return;
     }
   }
-  cb->npnr = npnr;
-  cb->base_npnr = base_npnr;
-  Dbg_print("%s.npnr = %d (%d,%d)", lrep, npnr, ir_nprm(npnr),ir_nret(npnr));
-  cb->fref = fref;
-  Dbg_print("%s.fref = %d", lrep, fref);
-  ir_set_function_name(L,lrep,bp);
-  return 0;
 }
 
-// The internal table reader.
-// L:    Lua top-of-stack, contains the equivalent of lrep.
-// lrep: Current full name, e.g., "table.subtable.element[3].key"
-// lp:   Pointer to the right end of lrep.
-// bp:   IREP base address for the current element.
-// ep:   Descriptor for the current element.
-static int iir_read(lua_State *L,char *lrep,char *lp,void *bp,ir_element *ep) {
-  int i, errcnt = 0, tv = lua_type(L,-1);
+// Tokens, as in Lua's llex.h.  Single character tokens are themselves.
+enum { TK_AND = 257, TK_BREAK, TK_DO, TK_ELSE, TK_ELSEIF, TK_END, TK_FALSE,
+  TK_FOR, TK_FUNCTION, TK_IF, TK_IN, TK_LOCAL, TK_NIL, TK_NOT, TK_OR,
+  TK_REPEAT, TK_RETURN, TK_THEN, TK_TRUE, TK_UNTIL, TK_WHILE,
+  TK_CONCAT, TK_DOTS, TK_EQ, TK_GE, TK_LE, TK_NE, TK_NUMBER, TK_NAME,
+  TK_STRING, TK_EOS };
+static const char *cp_kw[] = { "and", "break", "do", "else", "elseif",
+  "end", "false", "for", "function", "if", "in", "local", "nil", "not",
+  "or", "repeat", "return", "then", "true", "until", "while", 0 };
 
-  // A self-referential table will overflow.
-  if (!lua_checkstack(L,6)) return Ir_error("stack overflow: %s",lrep);
+// Expression types.  CT_FN is the value of "c and x" (false, or a number);
+// it is only allowed as the left operand of "or", as in "c and x or y".
+enum { CT_NUM, CT_BOOL, CT_FN };
 
-  // Callback functions and references are handled separately.
-  if (ep->typ == T_cbk) return read_cbk(L, lrep, bp, ep);
-  if (ep->typ == T_ref) return read_ref(L, lrep, bp);
+typedef struct {
+  const char *p, *end;  // Scan position, and end of the source text.
+  int line;             // Line number at p.
+  int tok;              // Current token...
+  const char *ts;       // ...its text...
+  int tl;               // ...and length...
+  double nv;            // ...and value, for TK_NUMBER.
+  jmp_buf fail;         // Where cp_fail goes.
+  const char *why;      // Reason for failure.
+  ir_insn *code;        // Code generated so far.
+  int ncode, cap;
+  int label;            // Last jump target: no constant folding across it.
+  int sp, maxsp;        // Stack depth at this point, and its maximum.
+  int nvar;             // Active parameters and locals (one slot each).
+  struct { const char *s; int l; int typ; } var[CP_MAXSLOT];
+  int nret;             // NRET of the callback.
+  const char *parms;    // The function's text from its "(" (on line pline)
+  const char *fend;     // to the end of its "end".
+  int pline;
+  unsigned long mused;  // The math fields used: bit i for cp_math[i], CP_PI, CP_HUGE.
+} cp_state;
 
-  if (tv != LUA_TTABLE) { // if top of stack is a scalar value, read it now.
-    if (tv == LUA_TSTRING) {
-      char *pchar = (char *)bp;
-      size_t vlen;
-      const char *vp=lua_tolstring(L,-1,&vlen);
-      if (ep->typ != T_str) return TYP_ERR(lrep, T_str, ep->typ);
-      if (vlen > ep->len - 1)
-        return Ir_error("String too long (max %d): %s (%s)",ep->len,lrep,vp);
-      (void)strcpy(pchar, vp);
-      Dbg_print("%s = %s", lrep, pchar);
+#define CP_PI   (1UL << 30)
+#define CP_HUGE (1UL << 31)
 
-    } else if (tv == LUA_TBOOLEAN) {
-      BOOLEAN *pbool = (BOOLEAN *)bp;
-      if (ep->typ != T_log) return TYP_ERR(lrep, T_log, ep->typ);
-      *pbool = (BOOLEAN)lua_toboolean(L,-1);
-      Dbg_print("%s = %c",lrep, ((*pbool) ? 'T' : 'F'));
+static void cp_fail(cp_state *cs, const char *why) {
+  cs->why = why;
+  longjmp(cs->fail, 1);
+}
 
-    } else if (tv == LUA_TNUMBER) {
-      if (ep->typ!=T_dbl && ep->typ!=T_int) return TYP_ERR(lrep,T_dbl,ep->typ);
-      double d = lua_tonumber(L,-1);
-      int isint = ((d - (double)(int)d) == 0.0);
-      if (ep->typ == T_dbl) {
-        double *pdbl = (double *)bp;
-        *pdbl = d;
-        if (isint) Dbg_print("%s = %d", lrep, (int)(*pdbl));
-        else       Dbg_print("%s = %25.17e", lrep, *pdbl);
-      } else if (ep->typ == T_int) {
-        int *pint = (int *)bp;
-        if (isint) {
-          *pint = (int)d;
-          Dbg_print("%s = %d", lrep, *pint);
-        } else return Ir_error("Integer value expected: %s: %25.17e", lrep,d);
-      }
+// Scan the next token.
+static void cp_next(cp_state *cs) {
+  const char *p = cs->p, *end = cs->end;
+  char buf[64], *ep;
+  int i;
 
-    } else {
-      return Ir_error("Wrong type: %s (%s): Expected: %s",
-        lrep, lua_typename(L,tv), s_typ[ep->typ]);
-    }
-    return 0;
+  for (;;) { // Skip space and comments.
+    while (p < end && isspace((unsigned char)*p)) if (*p++ == '\n') cs->line++;
+    if (end-p >= 2 && p[0] == '-' && p[1] == '-') {
+      if (end-p >= 3 && p[2] == '[') cp_fail(cs, "long comment");
+      while (p < end && *p != '\n') p++;
+    } else break;
   }
+  cs->ts = p;
+  if (p == end) {
+    cs->tok = TK_EOS;
 
-  // If we get here, Lua TOS must be a table.  Verify that the corresponding
-  // IREP element is also a table, or an array.
-  if (ep->typ != T_tbl && ep->fub == 0) return TYP_ERR(lrep, T_tbl, ep->typ);
+  } else if (isalpha((unsigned char)*p) || *p == '_') {
+    while (p < end && (isalnum((unsigned char)*p) || *p == '_')) p++;
+    cs->tok = TK_NAME;
+    for (i=0; cp_kw[i]; i++)
+      if ((int)strlen(cp_kw[i]) == p-cs->ts && !strncmp(cp_kw[i], cs->ts, p-cs->ts))
+        cs->tok = TK_AND + i;
 
-  // Process the subtable recursively.
-  for (lua_pushnil(L); lua_next(L,-2); lua_pop(L,1)) {
-    char *nlp = lp;
-    void *nbp = bp;
-    ir_element *nep = ep;
+  } else if (isdigit((unsigned char)*p) ||
+             (*p == '.' && end-p >= 2 && isdigit((unsigned char)p[1]))) {
+    while (p < end && (isdigit((unsigned char)*p) || *p == '.')) p++;
+    if (p < end && (*p == 'e' || *p == 'E')) {
+      p++;
+      if (p < end && (*p == '+' || *p == '-')) p++;
+    }
+    while (p < end && (isalnum((unsigned char)*p) || *p == '_')) p++;
+    if (p-cs->ts >= (int)sizeof buf) cp_fail(cs, "malformed number");
+    memcpy(buf, cs->ts, p-cs->ts);
+    buf[p-cs->ts] = '\0';
+    cs->nv = strtod(buf, &ep);
+    if (*ep) cp_fail(cs, "malformed number");
+    cs->tok = TK_NUMBER;
 
-    if (lua_type(L,-2) == LUA_TSTRING) { // Table has string keys.
-      const char *s = lua_tostring(L,-2);
-      nlp += snprintf(lp, BSZ+(lrep-lp),  ".%s", s);
-      i = find_element(s, ir_ta[ep->ti]);
-      if (i == -1) {
-        lua_pop(L, 2);
-        return Ir_error("No such IREP variable: %s (%s)", s, lrep);
-      }
-      nep = &ir_ta[ep->ti][i];
-      nbp += nep->off;
+  } else if (*p == '"' || *p == '\'') {
+    char q = *p++;
+    while (p < end && *p != q && *p != '\n') p += (*p == '\\') ? 2 : 1;
+    if (p >= end || *p != q) cp_fail(cs, "unfinished string");
+    p++;
+    cs->tok = TK_STRING;
 
-    } else if (lua_type(L,-2) == LUA_TNUMBER) { // Table has numeric keys.
-      i = (int)lua_tonumber(L,-2);
-      nlp += snprintf(lp, BSZ+(lrep-lp), "[%d]", i);
-      if (i<ep->flb || i>ep->fub) {
-        lua_pop(L, 2);
-        return Ir_error("Array bounds exceeded: %s[%d] (%d:%d)",
-          lrep,i,ep->flb,ep->fub);
-      }
-      nbp += (i - ep->flb)*ep->sz;
+  } else if (*p == '[' && end-p >= 2 && (p[1] == '[' || p[1] == '=')) {
+    cp_fail(cs, "long string");
 
-    } else {
-      lua_pop(L, 2);
-      return Ir_error("Expected string or integer key: %s", lrep);
-    }
-    errcnt += iir_read(L, lrep, nlp, nbp, nep);
-    *lp = '\0'; // Restore previous trailing null in lrep.
+  } else if (end-p >= 3 && !strncmp(p, "...", 3)) {
+    p += 3; cs->tok = TK_DOTS;
+  } else if (end-p >= 2 && !strncmp(p, "..", 2)) {
+    p += 2; cs->tok = TK_CONCAT;
+  } else if (end-p >= 2 && p[1] == '=' && strchr("=~<>", *p)) {
+    cs->tok = (*p == '=') ? TK_EQ : (*p == '~') ? TK_NE : (*p == '<') ? TK_LE : TK_GE;
+    p += 2;
+  } else {
+    cs->tok = (unsigned char)*p++;
   }
-  return errcnt;
+  cs->tl = p - cs->ts;
+  cs->p = p;
 }
 
-static void newtable_byname(lua_State *L, const char *name) {
-                            // TOS  (Lua stack initially has table T.)
-                            //  T
-  lua_newtable(L);          //  {}  T
-  lua_pushvalue(L,-1);      //  {}  {}  T
-  lua_setfield(L,-3,name);  //  {}  T         (Set T[name] = {}, pop 1 value.)
+static void cp_check(cp_state *cs, int tok) {
+  if (cs->tok != tok) cp_fail(cs, "syntax outside the compiled subset");
+  cp_next(cs);
 }
 
-#define lua_swap(L) lua_insert(L,-2)
-static void newtable_byindex(lua_State *L, int k) {
-                         // TOS  (Lua stack initially has table T.)
-                         //  T
-  lua_newtable(L);       //  {}  T
-  lua_pushvalue(L,-1);   //  {}  {}  T
-  lua_pushinteger(L,k);  //  k   {}  {}  T
-  lua_swap(L);           //  {}  k   {}  T  (x<>y, for HP RPN programmers.)
-  lua_settable(L,-4);    //  {}  T          (Set T[k] = {}, pop 2 values.)
+// Append an instruction.  dsp is its effect on the stack depth.
+// Arithmetic on constants is folded, as Lua does.
+static int cp_emit(cp_state *cs, int op, int a, double k, int dsp) {
+  int nk = (op == CP_UNM || op == CP_F1) ? 1 :
+    ((op >= CP_ADD && op <= CP_POW) || op == CP_F2) ? 2 : 0;
+  if (nk && cs->ncode - nk >= cs->label &&
+      cs->code[cs->ncode-1].op == CP_K && cs->code[cs->ncode-nk].op == CP_K) {
+    ir_insn t[4];
+    ir_cprog p = { 0, 1, nk+2, t };
+    memcpy(t, cs->code + cs->ncode - nk, nk * sizeof *t);
+    t[nk].op = op;
+    t[nk].a = a;
+    t[nk+1].op = CP_RET;
+    t[nk+1].a = 1;
+    cprog_run(&p, NULL, 0, &k, 0);
+    cs->ncode -= nk;
+    cs->sp -= nk;
+    op = CP_K;
+    a = 0;
+    dsp = 1;
+  }
+  if (cs->ncode == cs->cap) {
+    cs->cap = cs->cap ? 2*cs->cap : 32;
+    ir_insn *c = (ir_insn *)realloc(cs->code, cs->cap * sizeof *c);
+    if (!c) cp_fail(cs, "realloc failed");
+    cs->code = c;
+  }
+  cs->code[cs->ncode].op = op;
+  cs->code[cs->ncode].a = a;
+  cs->code[cs->ncode].k = k;
+  cs->sp += dsp;
+  if (cs->sp > cs->maxsp) cs->maxsp = cs->sp;
+  if (cs->maxsp > CP_MAXSTACK) cp_fail(cs, "expression too deep");
+  return cs->ncode++;
 }
 
-// Push an IREP table back to the lua_State.
-static int iir_unread(lua_State *L,char *lrep,char *lp,void *bp,ir_element *ep, int treat_as_scalar) {
-  int i, j, errcnt = 0;
+// Find an active parameter or local, or return -1.
+static int cp_var(cp_state *cs, const char *s, int l) {
+  int i;
+  for (i = cs->nvar-1; i >= 0; i--)
+    if (cs->var[i].l == l && !strncmp(cs->var[i].s, s, l)) return i;
+  return -1;
+}
 
-  if (ep->typ == T_tbl) { // Current IREP element is a struct.
-    char *nlp;
-    void *nbp;
-    ir_element *nep = ep;
+static int cp_subexpr(cp_state *cs, int limit);
 
-    // Scalar struct, or 1 element of an array.
-    if (ep->fub == 0 || treat_as_scalar) {
-      for (i=0; ir_ta[ep->ti][i].name; i++) {
-        nep = &ir_ta[ep->ti][i];
-        nlp = lp + snprintf(lp, BSZ+(lrep-lp), ".%s", nep->name);
-        nbp = bp + nep->off;
-        if (nep->typ == T_tbl) newtable_byname(L,nep->name);
-        errcnt += iir_unread(L, lrep, nlp, nbp, nep, 0);
-        if (nep->typ == T_tbl) lua_pop(L,1);
-      }
+// Parse an expression that must have type typ.
+static void cp_expr(cp_state *cs, int typ) {
+  if (cp_subexpr(cs, 0) != typ) cp_fail(cs, "type mismatch");
+}
 
-    } else { // Array of structs.
-      for (j=ep->flb; j<=ep->fub; j++) {
-        nlp = lp + snprintf(lp, BSZ+(lrep-lp), "[%d]", j);
-        nbp = bp + (j - ep->flb)*ep->sz;
-        newtable_byindex(L,j);
-        errcnt += iir_unread(L, lrep, nlp, nbp, nep, 1);
-        lua_pop(L,1);
-      }
+// Parse an expression that may be a number or a boolean.
+static int cp_value(cp_state *cs) {
+  int t = cp_subexpr(cs, 0);
+  if (t == CT_FN) cp_fail(cs, "and without or");
+  return t;
+}
+
+// math.NAME or math.NAME(args); TOS is NAME.
+static int cp_math_call(cp_state *cs) {
+  int i, n = 0;
+  if (cs->tok != TK_NAME) cp_fail(cs, "bad math field");
+  if (cs->tl == 2 && !strncmp(cs->ts, "pi", 2)) {
+    cs->mused |= CP_PI;
+    cp_next(cs);
+    cp_emit(cs, CP_K, 0, 3.14159265358979323846, 1);
+    return CT_NUM;
+  }
+  if (cs->tl == 4 && !strncmp(cs->ts, "huge", 4)) {
+    cs->mused |= CP_HUGE;
+    cp_next(cs);
+    cp_emit(cs, CP_K, 0, HUGE_VAL, 1);
+    return CT_NUM;
+  }
+  for (i=0; cp_math[i].name; i++)
+    if ((int)strlen(cp_math[i].name) == cs->tl &&
+        !strncmp(cp_math[i].name, cs->ts, cs->tl)) break;
+  if (!cp_math[i].name) cp_fail(cs, "math function outside the compiled subset");
+  cs->mused |= 1UL << i;
+  cp_next(cs);
+  cp_check(cs, '(');
+  if (cs->tok != ')') {
+    do {
+      cp_expr(cs, CT_NUM);
+      n++;
+    } while (cs->tok == ',' && (cp_next(cs), 1));
+  }
+  cp_check(cs, ')');
+  if (cp_math[i].nargs == 1 && n == 1) cp_emit(cs, CP_F1, i, 0, 0);
+  else if (cp_math[i].nargs == 2 && n == 2) cp_emit(cs, CP_F2, i, 0, -1);
+  else if (cp_math[i].nargs == -1 && n >= 1)
+    cp_emit(cs, strcmp(cp_math[i].name, "max") ? CP_MIN : CP_MAX, n, 0, 1-n);
+  else cp_fail(cs, "wrong number of arguments to math function");
+  return CT_NUM;
+}
+
+static int cp_simpleexp(cp_state *cs) {
+  int i, t;
+  switch (cs->tok) {
+  case TK_NUMBER:
+    cp_emit(cs, CP_K, 0, cs->nv, 1);
+    cp_next(cs);
+    return CT_NUM;
+  case TK_TRUE:
+  case TK_FALSE:
+    cp_emit(cs, CP_K, 0, cs->tok == TK_TRUE, 1);
+    cp_next(cs);
+    return CT_BOOL;
+  case '(':
+    cp_next(cs);
+    t = cp_subexpr(cs, 0);
+    cp_check(cs, ')');
+    return t;
+  case TK_NAME:
+    if ((i = cp_var(cs, cs->ts, cs->tl)) >= 0) {
+      cp_emit(cs, CP_LD, i, 0, 1);
+      cp_next(cs);
+      t = cs->var[i].typ;
+    } else if (cs->tl == 4 && !strncmp(cs->ts, "math", 4)) {
+      cp_next(cs);
+      cp_check(cs, '.');
+      t = cp_math_call(cs);
+    } else {
+      cp_fail(cs, "global or upvalue");
     }
+    if (cs->tok == '.' || cs->tok == '[' || cs->tok == '(' || cs->tok == ':')
+      cp_fail(cs, "indexing or call outside the compiled subset");
+    return t;
+  default:
+    cp_fail(cs, "syntax outside the compiled subset");
+  }
+  return CT_NUM;
+}
 
-  // Current IREP element is NOT a struct.  (It is either scalar POD,
-  // or an array thereof.)
+// Binary operator priorities, as in Lua 5.1's lparser.c.
+static const struct { int tok, op, left, right; } cp_binop[] = {
+  {'+', CP_ADD, 6, 6}, {'-', CP_SUB, 6, 6}, {'*', CP_MUL, 7, 7},
+  {'/', CP_DIV, 7, 7}, {'%', CP_MOD, 7, 7}, {'^', CP_POW, 10, 9},
+  {TK_CONCAT, -1, 5, 4},
+  {TK_EQ, CP_EQ, 3, 3}, {TK_NE, CP_NE, 3, 3}, {'<', CP_LT, 3, 3},
+  {TK_LE, CP_LE, 3, 3}, {'>', CP_GT, 3, 3}, {TK_GE, CP_GE, 3, 3},
+  {TK_AND, CP_AND, 2, 2}, {TK_OR, CP_OR, 1, 1}, {0, 0, 0, 0}
+};
+#define CP_UNARY_PRIORITY 8
+
+// Parse an expression where binary operators have priority > limit.
+// Returns its type.
+static int cp_subexpr(cp_state *cs, int limit) {
+  int b, t, t2;
+
+  if (cs->tok == '-' || cs->tok == TK_NOT) {
+    int unm = (cs->tok == '-');
+    cp_next(cs);
+    t = cp_subexpr(cs, CP_UNARY_PRIORITY);
+    if (t != (unm ? CT_NUM : CT_BOOL)) cp_fail(cs, "type mismatch");
+    cp_emit(cs, unm ? CP_UNM : CP_NOT, 0, 0, 0);
   } else {
+    t = cp_simpleexp(cs);
+  }
 
-    if (ep->fub > 0) newtable_byname(L,ep->name);
+  for (;;) {
+    for (b=0; cp_binop[b].tok && cp_binop[b].tok != cs->tok; b++) {}
+    if (!cp_binop[b].tok || cp_binop[b].left <= limit) break;
+    if (cp_binop[b].op < 0) cp_fail(cs, "string operator");
+    cp_next(cs);
+    t2 = cp_subexpr(cs, cp_binop[b].right);
 
-    // Loop below executes at least once, for a scalar.  More for array.
-    i = ep->flb; // For a scalar, flb is always 1, and fub is always 0.
-    do {
-      if (ep->fub > 0) lua_pushinteger(L, i);       // An array index,
-      else             lua_pushstring(L, ep->name); // Or the element name.
-
-      // Push the element value onto the Lua stack.
-      if (ep->typ == T_str) {
-        lua_pushstring(L, (char *)bp);
-      } else if (ep->typ == T_dbl) {
-        lua_pushnumber(L, *((double *)bp));
-      } else if (ep->typ == T_int) {
-        lua_pushinteger(L, *((int *)bp));
-      } else if (ep->typ == T_log) {
-        lua_pushboolean(L, *((BOOLEAN *)bp));
-      } else {
-        return Ir_error("IR_UNREAD: bad type: %s (%s)", lrep, s_typ[ep->typ]);
-      }
-      lua_settable(L,-3); // Set the table key+value (and pop both.)
-    } while (++i <= ep->fub);
-    if (ep->fub > 0) lua_pop(L,1); // If it was an array, pop it: we're done.
+    switch (cp_binop[b].op) {
+    case CP_AND:
+      if (t != CT_BOOL || t2 == CT_FN) cp_fail(cs, "type mismatch");
+      if (t2 == CT_BOOL) cp_emit(cs, CP_AND, 0, 0, -1);
+      t = (t2 == CT_BOOL) ? CT_BOOL : CT_FN; // "c and x": keep c and x.
+      break;
+    case CP_OR:
+      if (t == CT_BOOL && t2 == CT_BOOL) cp_emit(cs, CP_OR, 0, 0, -1);
+      else if (t == CT_FN && t2 == CT_NUM) cp_emit(cs, CP_SEL, 0, 0, -2);
+      else cp_fail(cs, "type mismatch");
+      t = (t == CT_BOOL) ? CT_BOOL : CT_NUM;
+      break;
+    case CP_EQ:
+    case CP_NE:
+      if (t != t2 || t == CT_FN) cp_fail(cs, "type mismatch");
+      cp_emit(cs, cp_binop[b].op, 0, 0, -1);
+      t = CT_BOOL;
+      break;
+    default:
+      if (t != CT_NUM || t2 != CT_NUM) cp_fail(cs, "type mismatch");
+      cp_emit(cs, cp_binop[b].op, 0, 0, -1);
+      if (cp_binop[b].op >= CP_LT) t = CT_BOOL;
+      break;
+    }
   }
-  *lp = '\0';
-  return errcnt;
+  return t;
 }
 
-// Empty the Lua stack; load an arbitrary element name onto TOS.
-static int ir_elem(lua_State *L, const char *s) {
-  char buf[BSZ];
-  (void)snprintf(buf, sizeof buf, "return %s", s);
-  lua_settop(L,0);
-  return luaL_loadstring(L, buf) || lua_pcall(L,0,1,0);
+static int cp_block_end(int tok) {
+  return tok == TK_END || tok == TK_ELSE || tok == TK_ELSEIF ||
+         tok == TK_EOS || tok == TK_UNTIL;
 }
 
-// External entry point: ir_read(L, "table[.subtable...]").
-int ir_read(lua_State *L, const char *table_name) {
-  int n = strlen(table_name);
-  if (n > BSZ) return Ir_error("Table name too long: %s", table_name);
+// Parse a list of names into ns[], ls[].  Returns the count.
+static int cp_names(cp_state *cs, const char **ns, int *ls) {
+  int n = 0;
+  for (;;) {
+    if (cs->tok != TK_NAME) cp_fail(cs, "expected a name");
+    if (cs->nvar + n >= CP_MAXSLOT) cp_fail(cs, "too many locals");
+    ns[n] = cs->ts;
+    ls[n++] = cs->tl;
+    cp_next(cs);
+    if (cs->tok != ',') return n;
+    cp_next(cs);
+  }
+}
 
-  if (ir_elem(L,table_name))
-    return Ir_error("Bad Lua table: %s: %s", table_name, lua_tostring(L,-1));
+// "local a, b = e1, e2" or "a, b = e1, e2".
+static void cp_assign(cp_state *cs, int local) {
+  const char *ns[CP_MAXSLOT];
+  int ls[CP_MAXSLOT], slot[CP_MAXSLOT], typ[CP_MAXSLOT], i, n, ne = 0;
 
-  irep_debug = getenv("irep_debug") ? atoi(getenv("irep_debug")) : 0;
+  n = cp_names(cs, ns, ls);
+  for (i=0; i < n; i++) {
+    slot[i] = local ? cs->nvar + i : cp_var(cs, ns[i], ls[i]);
+    if (slot[i] < 0) cp_fail(cs, "assignment to a global or upvalue");
+  }
+  cp_check(cs, '=');
+  for (;;) {
+    if (ne == n) cp_fail(cs, "too many values in assignment");
+    typ[ne] = cp_value(cs);
+    if (!local && typ[ne] != cs->var[slot[ne]].typ) cp_fail(cs, "type mismatch");
+    ne++;
+    if (cs->tok != ',') break;
+    cp_next(cs);
+  }
+  if (ne != n) cp_fail(cs, "too few values in assignment");
+  for (i=n-1; i >= 0; i--) cp_emit(cs, CP_ST, slot[i], 0, -1);
+  if (local) {
+    for (i=0; i < n; i++) {
+      cs->var[cs->nvar].s = ns[i];
+      cs->var[cs->nvar].l = ls[i];
+      cs->var[cs->nvar].typ = typ[i];
+      cs->nvar++;
+    }
+  }
+}
 
-  // Find the well known table name first.
-  char *s, tcopy[BSZ], lrep[BSZ];
-  (void)strcpy(tcopy, table_name);
-  s = strtok(tcopy, ".[]");
-  int i = find_wkt(s);
-  if (i == -1) return Ir_error("No such IREP table: %s (%s)", s,table_name);
+static void cp_return(cp_state *cs) {
+  int n = 0;
+  cp_next(cs);
+  if (!cp_block_end(cs->tok) && cs->tok != ';') {
+    for (;;) {
+      cp_expr(cs, CT_NUM);
+      n++;
+      if (cs->tok != ',') break;
+      cp_next(cs);
+    }
+  }
+  if (cs->tok == ';') cp_next(cs);
+  if (n < cs->nret) cp_fail(cs, "too few return values");
+  if (!cp_block_end(cs->tok)) cp_fail(cs, "return is not the last statement");
+  cp_emit(cs, CP_RET, n, 0, -n);
+}
 
-  ir_wkt_desc *w = &ir_wktt[i];
-  void *bp = w->p;
-  ir_element *ep = &w->e;
+static int cp_block(cp_state *cs);
 
-  // Walk down any remaining elements after the wkt name.
-  while ((s = strtok(0, ".[]"))) {
-    if (isalpha((int)(*s)) || *s == '_') { // string key
-      int j = find_element(s, ir_ta[ep->ti]);
-      if (j == -1) return Ir_error("IREP key not found: %s (%s)", s,table_name);
-      ep = &ir_ta[ep->ti][j];
-      bp += ep->off;
+// "if c then ... {elseif c then ...} [else ...] end".  Returns 1 if every
+// branch returns.
+static int cp_if(cp_state *cs) {
+  int jf, jend = -1, ret = 1;
 
-    } else if (isdigit((int)(*s))) { // numeric key
-      int j = atoi(s);
-      if (j<ep->flb || j>ep->fub)
-        return Ir_error("Array bounds exceeded: %s[%d] (%d:%d)",
-        table_name, j, ep->flb, ep->fub);
-      bp += (j - ep->flb)*ep->sz;
+  do { // Each pass handles "if" or "elseif".
+    cp_next(cs);
+    cp_expr(cs, CT_BOOL);
+    cp_check(cs, TK_THEN);
+    jf = cp_emit(cs, CP_JMPF, 0, 0, -1);
+    ret &= cp_block(cs);
+    if (cs->tok == TK_ELSE || cs->tok == TK_ELSEIF)
+      jend = cp_emit(cs, CP_JMP, jend, 0, 0); // Chain of jumps to the end.
+    cs->code[jf].a = cs->label = cs->ncode;
+  } while (cs->tok == TK_ELSEIF);
 
-    } else {
-      return Ir_error("Bad table element: %s (%s)", s,table_name);
+  if (cs->tok == TK_ELSE) {
+    cp_next(cs);
+    ret &= cp_block(cs);
+  } else {
+    ret = 0;
+  }
+  cp_check(cs, TK_END);
+  while (jend >= 0) {
+    int next = cs->code[jend].a;
+    cs->code[jend].a = cs->label = cs->ncode;
+    jend = next;
+  }
+  return ret;
+}
+
+// Parse statements up to the end of a block.  Returns 1 if the block
+// always returns.
+static int cp_block(cp_state *cs) {
+  int nvar = cs->nvar, ret = 0;
+  while (!cp_block_end(cs->tok)) {
+    switch (cs->tok) {
+    case TK_RETURN: cp_return(cs); ret = 1; break;
+    case TK_IF:     ret |= cp_if(cs); break;
+    case TK_LOCAL:  cp_next(cs); cp_assign(cs, 1); break;
+    case TK_NAME:   cp_assign(cs, 0); break;
+    case ';':       cp_next(cs); break;
+    default:        cp_fail(cs, "statement outside the compiled subset");
     }
   }
-  (void)strcpy(lrep, table_name);
-  return iir_read(L, lrep, lrep+n, bp, ep);
+  cs->nvar = nvar;
+  return ret;
 }
 
-// Push an IREP table to the lua_State (reverse of ir_read.)
-// For now, can only handle the whole wkt.
-int ir_unread(lua_State *L, const char *ir_tbl) {
-  char lrep[BSZ];
-  int n = strlen(ir_tbl);
-  if (n > BSZ) return Ir_error("Table name too long: %s", ir_tbl);
+// Compile a function from its source text.  The text must contain exactly
+// one "function" keyword, on line line0, with its "end" on line line1.
+static ir_cprog *cp_function(cp_state *cs, int nprm, int line0, int line1) {
+  const char *start = cs->p;
+  int n = 0;
+  ir_cprog *p;
 
-  // Find the IREP table.
-  int i = find_wkt(ir_tbl);
-  if (i == -1) return Ir_error("No such IREP table: %s", ir_tbl);
-  ir_wkt_desc *w = &ir_wktt[i];
-  void *bp = w->p;
-  ir_element *ep = &w->e;
+  // Count "function" keywords, then rescan to the one we want.
+  for (cp_next(cs); cs->tok != TK_EOS; cp_next(cs)) n += (cs->tok == TK_FUNCTION);
+  if (n != 1) cp_fail(cs, "cannot identify the function in its source lines");
+  cs->p = start;
+  cs->line = line0;
+  do cp_next(cs); while (cs->tok != TK_FUNCTION);
+  if (cs->line != line0) cp_fail(cs, "source lines do not match");
 
-  // (Re-)create the corresponding Lua table.
-  lua_settop(L,0);
-  lua_newtable(L);
-  lua_pushvalue(L,-1);
-  lua_setglobal(L,ir_tbl);
-  (void)strcpy(lrep, ir_tbl);
-  return iir_unread(L, lrep, lrep+n, bp, ep, 0);
+  cp_next(cs);
+  if (cs->tok == TK_NAME) { // "function a.b(...)" statement form.
+    cp_next(cs);
+    while (cs->tok == '.') { cp_next(cs); cp_check(cs, TK_NAME); }
+  }
+  cs->parms = cs->ts;
+  cs->pline = cs->line;
+  cp_check(cs, '(');
+  if (cs->tok != ')') {
+    const char *ns[CP_MAXSLOT];
+    int ls[CP_MAXSLOT], i;
+    if (cs->tok == TK_DOTS) cp_fail(cs, "vararg function");
+    n = cp_names(cs, ns, ls);
+    if (n > nprm) cp_fail(cs, "more parameters than NPRM");
+    for (i=0; i < n; i++) {
+      cs->var[i].s = ns[i];
+      cs->var[i].l = ls[i];
+      cs->var[i].typ = CT_NUM;
+    }
+    cs->nvar = n;
+  }
+  cp_check(cs, ')');
+  if (!cp_block(cs)) cp_fail(cs, "function can end without returning");
+  if (cs->tok != TK_END || cs->line != line1) cp_fail(cs, "source lines do not match");
+  cs->fend = cs->ts + cs->tl;
+
+  p = (ir_cprog *)malloc(sizeof *p + cs->ncode * sizeof *p->insn);
+  if (!p) cp_fail(cs, "malloc failed");
+  p->nprm = cs->nvar;
+  p->nret = cs->nret;
+  p->ninsn = cs->ncode;
+  p->insn = (ir_insn *)(p+1);
+  memcpy(p->insn, cs->code, cs->ncode * sizeof *p->insn);
+  return p;
 }
 
-// Check existence of an element.  If found, leave it on TOS.
-int ir_exists(lua_State *L, const char *s) {
-  if (ir_elem(L,s)) return 0;
-  return !lua_isnil(L,-1);
+// Run cp_function, catching failures.  (Kept separate from cb_compile,
+// which has locals that change after setjmp.)
+static ir_cprog *cp_try(cp_state *cs, int nprm, int line0, int line1) {
+  if (setjmp(cs->fail)) return NULL;
+  return cp_function(cs, nprm, line0, line1);
 }
 
-// Return the run time length of a vector.
-int ir_rtlen(lua_State *L, const char *s) {
-  if (ir_elem(L,s)) return -1;
-  int n = lua_type(L,-1);
-  return (n==LUA_TNIL) ? -1 : ((n==LUA_TNUMBER) ? 0 : (int)lua_objlen(L,-1));
+// Source text of the last file read by cb_source.  Inputs usually define
+// all of their callbacks in one file.
+static char *cp_file_name, *cp_file_text;
+static size_t cp_file_len;
+
+static void cp_file_forget(void) {
+  free(cp_file_name);
+  free(cp_file_text);
+  cp_file_name = cp_file_text = NULL;
+  cp_file_len = 0;
 }
 
-// Read an (arbitrarily large) string, stored earlier as an ir_reference.
-// The third argument can be NULL if you're not interested in the length.
-// The returned string must be copied into the caller's scope, and you
-// should call lua_pop(L,-1) after that is done, to allow Lua to garbage
-// collect the item.  Typical calling sequence:
+// lua_dump writer for cp_dump.  The pieces are pushed, and joined every
+// so often.
+static int cp_writer(lua_State *L, const void *p, size_t sz, void *ud) {
+  int *n = (int *)ud;
+  lua_pushlstring(L, (const char *)p, sz);
+  if (++*n == 16) {
+    lua_concat(L, *n);
+    *n = 1;
+  }
+  return 0;
+}
+
+// Find the text of lines line0..line1 of a function's source.  Returns
+// NULL if the source is not available.
+static const char *cb_source(const char *source, int line0, int line1,
+                             const char **end) {
+  const char *s, *e, *p;
+  int line = 1;
+
+  if (*source == '=') return NULL; // No source text, e.g., "=stdin".
+  if (*source == '@') { // Read from a file.
+    if (!cp_file_name || strcmp(cp_file_name, source+1)) {
+      FILE *fp = fopen(source+1, "rb");
+      if (!fp) return NULL;
+      cp_file_forget();
+      cp_file_name = strdup(source+1);
+      for (;;) {
+        char *t = (char *)realloc(cp_file_text, cp_file_len + 4096);
+        if (!t) break;
+        cp_file_text = t;
+        size_t n = fread(cp_file_text + cp_file_len, 1, 4096, fp);
+        cp_file_len += n;
+        if (n < 4096) break;
+      }
+      fclose(fp);
+      if (!cp_file_text || !cp_file_name) {
+        free(cp_file_name);
+        cp_file_name = NULL;
+        return NULL;
+      }
+    }
+    s = cp_file_text;
+    e = s + cp_file_len;
+  } else { // Loaded from a string, which is its own source.
+    s = source;
+    e = s + strlen(s);
+  }
+
+  for (p = s; p < e && line < line0; p++) if (*p == '\n') line++;
+  if (line != line0) return NULL;
+  s = p;
+  for (; p < e && line <= line1; p++) if (*p == '\n') line++;
+  *end = p;
+  return s;
+}
+
+// Push lua_dump of the function at TOS, as a string.  (Needs 16 free
+// stack slots.)
+static void cp_dump(lua_State *L) {
+  int n = 0;
+  (void)lua_dump(L, cp_writer, &n);
+  lua_concat(L, n);
+}
+
+// Is the text that cs compiled the source of the Lua function at index
+// fi?  The text, as "return function(...) ... end", padded to the same
+// line, is loaded under the function's chunk name, and the bytecode of
+// the function that it returns must be the same as the bytecode of fi.
+// So a source file that changed since it was run, or a chunk name that
+// is not its text, is caught.  Running the chunk only makes the closure.
+static int cp_same(lua_State *L, int fi, const char *source, const cp_state *cs) {
+  size_t n = (cs->pline - 1) + 15 + (cs->fend - cs->parms);
+  char *t = (char *)malloc(n);
+  int same = 0, top = lua_gettop(L);
+
+  if (!t || !lua_checkstack(L, 20)) {
+    free(t);
+    return 0;
+  }
+  memset(t, '\n', cs->pline - 1);
+  memcpy(t + cs->pline - 1, "return function", 15);
+  memcpy(t + cs->pline - 1 + 15, cs->parms, cs->fend - cs->parms);
+  if (!luaL_loadbuffer(L, t, n, source) && !lua_pcall(L, 0, 1, 0) &&
+      lua_isfunction(L,-1)) {
+    cp_dump(L);
+    lua_pushvalue(L, fi);
+    cp_dump(L);
+    same = lua_rawequal(L, -1, -3);
+  }
+  lua_settop(L, top);
+  free(t);
+  return same;
+}
+
+// Are the math fields that cs used the standard ones in the environment
+// of the Lua function at index fi: C functions, and the constants?  Only
+// raw lookups are made, so no Lua code runs.
+static int cp_env(lua_State *L, int fi, const cp_state *cs) {
+  int i, ok, top = lua_gettop(L);
+
+  if (!cs->mused) return 1;
+  lua_getfenv(L, fi);
+  lua_pushliteral(L, "math");
+  lua_rawget(L, -2);
+  ok = lua_istable(L,-1);
+  for (i=0; ok && cp_math[i].name; i++) {
+    if (!(cs->mused & (1UL << i))) continue;
+    lua_pushstring(L, cp_math[i].name);
+    lua_rawget(L, -2);
+    ok = lua_iscfunction(L,-1);
+    lua_pop(L,1);
+  }
+  if (ok && (cs->mused & CP_PI)) {
+    lua_pushliteral(L, "pi");
+    lua_rawget(L, -2);
+    ok = lua_type(L,-1) == LUA_TNUMBER && lua_tonumber(L,-1) == 3.14159265358979323846;
+    lua_pop(L,1);
+  }
+  if (ok && (cs->mused & CP_HUGE)) {
+    lua_pushliteral(L, "huge");
+    lua_rawget(L, -2);
+    ok = lua_type(L,-1) == LUA_TNUMBER && lua_tonumber(L,-1) == HUGE_VAL;
+    lua_pop(L,1);
+  }
+  lua_settop(L, top);
+  return ok;
+}
+
+// Try to compile the Lua function at TOS, for a callback with npnr.
+// Returns NULL if the function is outside the compiled subset.
+static ir_cprog *cb_compile(lua_State *L, const ir_crumb *c, int npnr) {
+  int nprm = ir_nprm(npnr), nret = ir_nret(npnr);
+  const char *s, *e;
+  lua_Debug ar;
+  cp_state cs;
+  ir_cprog *p = NULL;
+
+  if (irep_compile <= 0 || nprm < 0 || nprm > CP_MAXSLOT ||
+      nret < 0 || nret > CP_MAXSTACK) return NULL;
+  lua_pushvalue(L,-1);
+  if (!lua_getinfo(L, ">Su", &ar) || strcmp(ar.what, "Lua") || ar.nups > 0) {
+    Dbg_print("%s: not compiled: not a Lua function, or has upvalues", crumb_str(c));
+    return NULL;
+  }
+  s = cb_source(ar.source, ar.linedefined, ar.lastlinedefined, &e);
+  if (!s) {
+    Dbg_print("%s: not compiled: no source text", crumb_str(c));
+    return NULL;
+  }
+
+  memset(&cs, 0, sizeof cs);
+  cs.p = s;
+  cs.end = e;
+  cs.nret = nret;
+  p = cp_try(&cs, nprm, ar.linedefined, ar.lastlinedefined);
+  if (p && !cp_same(L, lua_gettop(L), ar.source, &cs)) {
+    free(p);
+    p = NULL;
+    cs.why = "source text is not the function's";
+    cp_file_forget(); // It may have changed since it was read.
+  } else if (p && !cp_env(L, lua_gettop(L), &cs)) {
+    free(p);
+    p = NULL;
+    cs.why = "math is not the standard library";
+  }
+  free(cs.code);
+  if (p) Dbg_print("%s: compiled, %d instructions", crumb_str(c), p->ninsn);
+  else Dbg_print("%s: not compiled: %s", crumb_str(c), cs.why);
+  return p;
+}
+
+// Running counts for ir_stats, kept by ir_read, and the profiling switch
+// (set irep_stats=1 in the environment, or call ir_stats_enable).  See
+// stat_read.
+static int irep_stats = 0;
+typedef struct {
+  long elements, bytes, strings, callbacks, refs;
+} ir_counts;
+static ir_counts ir_count;
+
+// Read a Lua callback function.
+static int read_cbk(lua_State *L,const ir_crumb *c,void *bp,ir_element *ep) {
+  int i, ii = 0, fref = LUA_NOREF, tv = lua_type(L,-1), npnr = ep->len, base_npnr = ep->len;
+  lua_cb_data *cb = (lua_cb_data *)bp;
+
+  if (tv!=LUA_TNUMBER && tv!=LUA_TTABLE && tv!=LUA_TFUNCTION)
+    return Ir_error("Expected function, array, or number: %s", crumb_str(c));
+
+  (void)arena_set_code(cb, NULL); // From an earlier read; left in the arena.
+
+  if (tv == LUA_TFUNCTION) {
+    ir_cprog *p = cb_compile(L, c, npnr);
+    if (p) {
+      (void)arena_set_code(cb, arena_cprog(p));
+      free(p);
+    }
+    fref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pushnil(L);
+
+  } else {
+    // Unpack nprm, nret.  Ir_generate enforces nprm>=-1, nret>=-1.
+    // The packing algorithm will allow a lower limit of -9.
+    int nprm = ir_nprm(npnr);
+    int nret = ir_nret(npnr);
+
+    if (nret == 0)
+      return Ir_error("``%s'': Function declares zero return values."
+      "  Returning a Lua scalar or constant array is not allowed.", crumb_str(c));
+
+    ii = (tv==LUA_TTABLE) ? lua_objlen(L,-1) : (nret>0) ? nret : 1;
+    if (nret != -1 && ii != nret)
+      return Ir_error("``%s'': need %d return val(s), got %d", crumb_str(c), nret, ii);
+
+    // Recalculate npnr if nret was originally -1.  This is done so that
+    // the callback evaluator will receive the actual length of the data
+    // buffer in the nret value.
+    if (nret == -1) npnr = (ii+9)*1024 + nprm+9;
+
+    // Reuse the data from an earlier read, if it is big enough.
+    if (!(cb->fref == LUA_NOREF && cb->data && ir_nret(cb->npnr) >= ii))
+      cb->data = arena_alloc(ii*sizeof(double));
+    if (!cb->data) return Ir_error("``%s'': arena_alloc failed", crumb_str(c));
+    double *dp = (double *)cb->data;
+
+    if (tv == LUA_TNUMBER) { // Input is a scalar Lua number.
+      // Broadcast the scalar to all return values.  We treat nret==-1
+      // as if it were nret==1.  (The scalar is treated as a table of
+      // length 1.)
+      i = 0;
+      do {
+        dp[i] = lua_tonumber(L,-1);
+        Dbg_print("%s.data[%d] = %25.17e", crumb_str(c), i, dp[i]);
+      } while (++i < nret);
+
+    } else { // Input is a Lua table.
+      for (i=1; i<=ii; i++) {
+        lua_rawgeti(L,-1,i);
+        if (lua_type(L,-1) != LUA_TNUMBER)
+          return Ir_error("Bad entry: %s[%d]: %s",crumb_str(c),i,lua_tostring(L,-1));
+        dp[i-1] = lua_tonumber(L,-1);
+        Dbg_print("%s.data[%d] = %25.17e",crumb_str(c),i-1,dp[i-1]);
+        lua_pop(L,1);
+      }
+    }
+  }
+  cb->npnr = npnr;
+  cb->base_npnr = base_npnr;
+  Dbg_print("%s.npnr = %d (%d,%d)", crumb_str(c), npnr, ir_nprm(npnr),ir_nret(npnr));
+  ref_drop(L, cb->fref);
+  cb->fref = fref;
+  Dbg_print("%s.fref = %d", crumb_str(c), fref);
+  ir_set_function_name(L,crumb_str(c),bp);
+  ir_count.callbacks++;
+  ir_count.bytes += sizeof *cb + (fref == LUA_NOREF ? ii*sizeof(double) : 0);
+  return 0;
+}
+
+// The offset in vector ep of the key of the current lua_next entry (at
+// -2), if it is an in-bounds integer and its value (at -1) has Lua type
+// ltyp; else -1.
+static int vec_slot(lua_State *L, const ir_element *ep, int ltyp) {
+  double d;
+  if (lua_type(L,-2) != LUA_TNUMBER || lua_type(L,-1) != ltyp) return -1;
+  d = lua_tonumber(L,-2);
+  if (!(d >= ep->flb && d <= ep->fub) || d != (double)(int)d) return -1;
+  return (int)d - ep->flb;
+}
+
+// Fast path for reading a Lua table into a Vir_dbl, Vir_int, or Vir_log
+// vector.  It makes one lua_next pass over the table, storing values
+// directly: no element names, recursion, or per-element type dispatch.
+// Returns the number of entries, if the whole table was read.  Anything
+// unusual (a key that is not an in-bounds integer, or a value of the
+// wrong type) returns -1, and the caller re-reads the table with the
+// generic per-element reader, which reports the error.  Lua TOS is the
+// table, on entry and on exit.
+//
+// A lua_objlen and lua_rawgeti loop over flb..fub would not see string
+// keys, or integer keys past a hole, and the Lua 5.1 API cannot count a
+// table's keys without lua_next; so that loop would still need this
+// pass to find the keys that are errors.  One lua_next pass reads and
+// checks each entry once.
+static int read_vec(lua_State *L,void *bp,ir_element *ep) {
+  double d;
+  int k, n = 0;
+
+  if (ep->typ == T_dbl) {
+    double *pdbl = (double *)bp;
+    for (lua_pushnil(L); lua_next(L,-2); lua_pop(L,1)) {
+      if ((k = vec_slot(L, ep, LUA_TNUMBER)) < 0) {
+        lua_pop(L,2);
+        return -1;
+      }
+      pdbl[k] = lua_tonumber(L,-1);
+      n++;
+    }
+
+  } else if (ep->typ == T_int) {
+    int *pint = (int *)bp;
+    for (lua_pushnil(L); lua_next(L,-2); lua_pop(L,1)) {
+      d = lua_tonumber(L,-1);
+      if ((k = vec_slot(L, ep, LUA_TNUMBER)) < 0 ||
+          !(d >= INT_MIN && d <= INT_MAX) || d != (double)(int)d) {
+        lua_pop(L,2);
+        return -1;
+      }
+      pint[k] = (int)d;
+      n++;
+    }
+
+  } else if (ep->typ == T_log) {
+    BOOLEAN *pbool = (BOOLEAN *)bp;
+    for (lua_pushnil(L); lua_next(L,-2); lua_pop(L,1)) {
+      if ((k = vec_slot(L, ep, LUA_TBOOLEAN)) < 0) {
+        lua_pop(L,2);
+        return -1;
+      }
+      pbool[k] = (BOOLEAN)lua_toboolean(L,-1);
+      n++;
+    }
+
+  } else {
+    return -1;
+  }
+  return n;
+}
+
+static int stat_read(lua_State *L,const ir_crumb *c,void *bp,ir_element *ep);
+static int iir_read(lua_State *L,const ir_crumb *c,void *bp,ir_element *ep);
+
+// Sparse vectors of structures.  The elements are allocated one at a
+// time, so they never move (callbacks are known by their addresses), and
+// are found by index through an open-addressed hash of 2*cap slots.
+
+#define SPARSE_ELEM(s,k) (((char **)(s)->elem)[k])
+#define SPARSE_KEY(s,k) (((int *)(s)->key)[k])
+
+// The prototype (ID_proto) of the sparse vector ep at bp.  irep-generate
+// records its offset in the index.
+#define SPARSE_PROTO(bp,ep) ((char *)(bp) + (ep)->proto)
+
+// The hash slot for index i in s: the one that holds it, or an empty one.
+static size_t sparse_slot(const ir_sparse *s, int i) {
+  const int *h = (const int *)s->hash;
+  size_t m = 2*(size_t)s->cap - 1, j = ((uint32_t)i * 2654435761u) & m;
+  while (h[j] && SPARSE_KEY(s, h[j]-1) != i) j = (j+1) & m;
+  return j;
+}
+
+// The element with index i of sparse vector s, or NULL if the input has
+// not given it.
+void *ir_sparse_get(const ir_sparse *s, int i) {
+  int k;
+  if (!s || s->n == 0) return NULL;
+  k = ((const int *)s->hash)[sparse_slot(s, i)];
+  return k ? SPARSE_ELEM(s, k-1) : NULL;
+}
+
+// The element with index i of the sparse vector at bp, described by ep;
+// a new one is a copy of the prototype.  Returns NULL if out of memory.
+static void *sparse_add(char *bp, int i, ir_element *ep) {
+  ir_sparse *s = (ir_sparse *)bp;
+  void *p = ir_sparse_get(s, i);
+  int k;
+
+  if (p) return p;
+  if (s->n == s->cap) { // Grow, and rehash.
+    int cap = s->cap ? 2*s->cap : 8;
+    void *elem = realloc(s->elem, cap * sizeof(char *));
+    if (elem) s->elem = elem;
+    void *key = realloc(s->key, cap * sizeof(int));
+    if (key) s->key = key;
+    int *hash = (int *)calloc(2*(size_t)cap, sizeof(int));
+    if (!elem || !key || !hash) {
+      free(hash);
+      return NULL;
+    }
+    free(s->hash);
+    s->hash = hash;
+    s->cap = cap;
+    for (k=0; k < s->n; k++) hash[sparse_slot(s, SPARSE_KEY(s,k))] = k+1;
+  }
+  if (!(p = malloc(ep->sz))) return NULL;
+  memcpy(p, SPARSE_PROTO(bp, ep), ep->sz);
+  SPARSE_ELEM(s, s->n) = p;
+  SPARSE_KEY(s, s->n) = i;
+  ((int *)s->hash)[sparse_slot(s, i)] = ++s->n;
+  return p;
+}
+
+// The descriptor of one element of the sparse vector ep: a Structure.
+static ir_element sparse_elem(const ir_element *ep) {
+  ir_element e = *ep;
+  e.len = e.flb = e.fub = 0;
+  e.proto = 0;
+  return e;
+}
+
+static void cb_forget(const lua_cb_data *cb);
+
+// Free the runtime-sized and sparse vectors under element ep (at bp),
+// leaving them empty, and forget the callbacks under ep (see cb_forget),
+// since new sparse elements may reuse their addresses.  treat_as_scalar
+// is as in iir_unread.
+static void dyn_free(char *bp, ir_element *ep, int treat_as_scalar) {
+  int i;
+
+  if (ep->typ == T_cbk) {
+    cb_forget((const lua_cb_data *)bp);
+
+  } else if (IR_DYN(ep)) {
+    ir_dir *d = (ir_dir *)bp;
+    free(d->p);
+    d->p = NULL;
+    d->n = 0;
+
+  } else if (IR_SPARSE(ep)) {
+    ir_sparse *s = (ir_sparse *)bp;
+    ir_element e = sparse_elem(ep);
+    for (i=0; i < s->n; i++) {
+      dyn_free(SPARSE_ELEM(s,i), &e, 0);
+      free(SPARSE_ELEM(s,i));
+    }
+    free(s->elem);
+    free(s->key);
+    free(s->hash);
+    memset(s, 0, sizeof *s);
+
+  } else if (ep->typ == T_tbl && ep->fub > 0 && !treat_as_scalar) {
+    for (i=ep->flb; i<=ep->fub; i++) // Array of structs.
+      dyn_free(bp + (i - ep->flb)*ep->sz, ep, 1);
+
+  } else if (ep->typ == T_tbl) { // Scalar struct, or 1 element of an array.
+    ir_element *nep;
+    for (nep = ir_ta[ep->ti]; nep->name; nep++)
+      if (nep->typ == T_tbl || nep->typ == T_cbk || IR_DYN(nep))
+        dyn_free(bp + nep->off, nep, 0);
+  }
+}
+
+// Resize the runtime-sized vector d (of elements of size sz) to n
+// elements, all 0.  Returns nonzero if out of memory.
+static int dir_resize(ir_dir *d, int n, size_t sz) {
+  if (n != d->n) {
+    void *p = (n > 0) ? realloc(d->p, n * sz) : NULL;
+    if (n > 0 && !p) return 1;
+    if (n == 0) free(d->p);
+    d->p = p;
+    d->n = n;
+  }
+  if (n > 0) memset(d->p, 0, n * sz);
+  return 0;
+}
+
+// Read a Lua array into a runtime-sized vector: allocate it to the
+// largest integer key of the array (so holes are 0, and not the end of
+// the array), then read it as a vector of that length.
+static int read_dir(lua_State *L,const ir_crumb *c,void *bp,ir_element *ep) {
+  ir_element e = *ep;
+  ir_dir *d = (ir_dir *)bp;
+
+  if (!lua_istable(L,-1))
+    return Ir_error("Expected an array: %s (%s)", crumb_str(c), lua_typename(L,lua_type(L,-1)));
+  e.fub = 0;
+  for (lua_pushnil(L); lua_next(L,-2); lua_pop(L,1)) {
+    double k = lua_type(L,-2) == LUA_TNUMBER ? lua_tonumber(L,-2) : 0;
+    if (k > e.fub && k <= INT_MAX && k == (double)(int)k) e.fub = (int)k;
+  }
+  if (dir_resize(d, e.fub, ep->sz))
+    return Ir_error("%s: out of memory (%d elements)", crumb_str(c), e.fub);
+  if (e.fub == 0) return 0;
+  ir_count.elements--; // Counted again by iir_read.
+  return iir_read(L, c, d->p, &e);
+}
+
+// Read a Lua array into a sparse vector of structures, adding the
+// elements that are new.
+static int read_sparse(lua_State *L,const ir_crumb *c,void *bp,ir_element *ep) {
+  ir_element e = sparse_elem(ep);
+  int i, errcnt = 0;
+
+  if (!lua_istable(L,-1))
+    return Ir_error("Expected an array: %s (%s)", crumb_str(c), lua_typename(L,lua_type(L,-1)));
+  for (lua_pushnil(L); lua_next(L,-2); lua_pop(L,1)) {
+    ir_crumb nc = { c, 0, 0 };
+    double k = lua_type(L,-2) == LUA_TNUMBER ? lua_tonumber(L,-2) : 0.5;
+    void *p;
+
+    if (k < INT_MIN || k > INT_MAX || k != (double)(int)k) {
+      lua_pop(L, 2);
+      return Ir_error("Expected integer key: %s", crumb_str(c));
+    }
+    nc.i = i = (int)k;
+    if (i<ep->flb || i>ep->fub) {
+      lua_pop(L, 2);
+      return Ir_error("Array bounds exceeded: %s (%d:%d)", crumb_str(&nc),ep->flb,ep->fub);
+    }
+    if (!(p = sparse_add(bp, i, ep))) {
+      lua_pop(L, 2);
+      return Ir_error("%s: out of memory", crumb_str(&nc));
+    }
+    errcnt += iir_read(L, &nc, p, &e);
+  }
+  return errcnt;
+}
+
+// Vir2_ and Vir3_ arrays.  Set ext to the extents of array ep, and
+// stride to the distance (in elements) between neighbors along each
+// dimension.  Returns the rank.
+static int arr_shape(const ir_element *ep, int *ext, size_t *stride) {
+  int d, rank = (ep->n2 > 0) ? 3 : 2;
+  ext[0] = ep->n1;
+  ext[1] = (rank == 3) ? ep->n2 : ep->fub / ep->n1;
+  if (rank == 3) ext[2] = ep->fub / (ep->n1 * ep->n2);
+  for (stride[0] = 1, d = 1; d < rank; d++) stride[d] = stride[d-1] * ext[d-1];
+  return rank;
+}
+
+// Store the Lua value at TOS as element off of array ep, at bp.
+static int arr_put(lua_State *L,const ir_crumb *c,void *bp,ir_element *ep,size_t off) {
+  int tv = lua_type(L,-1);
+  double d;
+
+  if (ep->typ == T_log && tv == LUA_TBOOLEAN) {
+    ((BOOLEAN *)bp)[off] = (BOOLEAN)lua_toboolean(L,-1);
+  } else if (ep->typ == T_dbl && tv == LUA_TNUMBER) {
+    ((double *)bp)[off] = lua_tonumber(L,-1);
+  } else if (ep->typ == T_int && tv == LUA_TNUMBER) {
+    d = lua_tonumber(L,-1);
+    if (d != (double)(int)d)
+      return Ir_error("Integer value expected: %s: %25.17e", crumb_str(c), d);
+    ((int *)bp)[off] = (int)d;
+  } else {
+    return Ir_error("Wrong type: %s (%s): Expected: %s",
+      crumb_str(c), lua_typename(L,tv), s_typ[ep->typ]);
+  }
+  ir_count.bytes += ep->sz;
+  return 0;
+}
+
+// The integer key at -2, if it is in 1:n, or 0.
+static int arr_key(lua_State *L, int n) {
+  double k = (lua_type(L,-2) == LUA_TNUMBER) ? lua_tonumber(L,-2) : 0;
+  return (k >= 1 && k <= n && k == (double)(int)k) ? (int)k : 0;
+}
+
+// Read nested Lua tables (TOS) into dimensions d and up of array ep,
+// starting at element off: t[i][j][k] is Fortran ID(i,j,k).
+static int arr_nested(lua_State *L,const ir_crumb *c,void *bp,ir_element *ep,
+                      const int *ext, const size_t *stride, int d, int rank, size_t off) {
+  int i, errcnt = 0;
+
+  for (lua_pushnil(L); lua_next(L,-2); lua_pop(L,1)) {
+    ir_crumb nc = { c, 0, 0 };
+    if (!(i = arr_key(L, ext[d]))) {
+      nc.i = (lua_type(L,-2) == LUA_TNUMBER) ? (int)lua_tonumber(L,-2) : 0;
+      lua_pop(L, 2);
+      return (nc.i) ? Ir_error("Array bounds exceeded: %s (1:%d)", crumb_str(&nc), ext[d]) :
+                      Ir_error("Expected integer key: %s", crumb_str(c));
+    }
+    nc.i = i;
+    if (d+1 == rank) {
+      errcnt += arr_put(L, &nc, bp, ep, off + (i-1)*stride[d]);
+    } else if (lua_istable(L,-1)) {
+      errcnt += arr_nested(L, &nc, bp, ep, ext, stride, d+1, rank, off + (i-1)*stride[d]);
+    } else {
+      const char *tn = lua_typename(L,lua_type(L,-1));
+      lua_pop(L, 2);
+      return Ir_error("Expected an array: %s (%s)", crumb_str(&nc), tn);
+    }
+    ir_count.elements++;
+  }
+  return errcnt;
+}
+
+// Read a Lua table into a Vir2_ or Vir3_ array.  It is either nested
+// tables, t[i][j] (or t[i][j][k]), or a flat array of the values in
+// Fortran order, with an optional "shape", { m, n[, p] }, for input
+// smaller than the array: then value 1 + (i-1) + (j-1)*m is ID(i,j).
+// Which one it is depends on whether the values with numeric keys are
+// tables, so a table that gives some of each is an error.
+static int read_arr(lua_State *L,const ir_crumb *c,void *bp,ir_element *ep) {
+  int d, k, ext[3], shape[3], errcnt = 0, ntbl = 0, nval = 0;
+  size_t off, stride[3], n = 1;
+  int rank = arr_shape(ep, ext, stride);
+
+  for (lua_pushnil(L); lua_next(L,-2); lua_pop(L,1)) {
+    if (lua_type(L,-2) != LUA_TNUMBER) continue;
+    if (lua_istable(L,-1)) ntbl++;
+    else nval++;
+  }
+  if (ntbl && nval)
+    return Ir_error("Mixed nested/flat array: %s (%d arrays, %d values)",
+      crumb_str(c), ntbl, nval);
+  if (ntbl) return arr_nested(L, c, bp, ep, ext, stride, 0, rank, 0);
+
+  lua_getfield(L,-1,"shape");
+  for (d=0; d < rank; d++) shape[d] = ext[d];
+  if (!lua_isnil(L,-1)) {
+    for (d=0; lua_istable(L,-1) && d < rank; d++) {
+      lua_rawgeti(L,-1,d+1);
+      k = (lua_type(L,-1) == LUA_TNUMBER) ? (int)lua_tonumber(L,-1) : 0;
+      lua_pop(L,1);
+      if (k < 1 || k > ext[d]) break;
+      shape[d] = k;
+    }
+    if (d < rank || lua_objlen(L,-1) != (size_t)rank) {
+      lua_pop(L,1);
+      return Ir_error("Bad shape: %s.shape (rank %d, at most %d x %d%s)", crumb_str(c),
+        rank, ext[0], ext[1], rank == 3 ? " x ..." : "");
+    }
+  }
+  lua_pop(L,1);
+
+  for (d=0; d < rank; d++) n *= shape[d];
+  for (lua_pushnil(L); lua_next(L,-2); lua_pop(L,1)) {
+    ir_crumb nc = { c, 0, 0 };
+    if (lua_type(L,-2) == LUA_TSTRING && strcmp(lua_tostring(L,-2), "shape") == 0) continue;
+    if (!(k = arr_key(L, (int)n))) {
+      nc.i = (lua_type(L,-2) == LUA_TNUMBER) ? (int)lua_tonumber(L,-2) : 0;
+      lua_pop(L, 2);
+      return (nc.i) ? Ir_error("Array bounds exceeded: %s (1:%lu)", crumb_str(&nc), (unsigned long)n) :
+                      Ir_error("Expected integer key: %s", crumb_str(c));
+    }
+    nc.i = k;
+    for (off=0, k--, d=0; d < rank; k /= shape[d], d++) off += (k % shape[d]) * stride[d];
+    errcnt += arr_put(L, &nc, bp, ep, off);
+    ir_count.elements++;
+  }
+  return errcnt;
+}
+
+// The internal table reader.
+// L:    Lua top-of-stack, contains the element named by c.
+// c:    Breadcrumb for the current element; see crumb_str.
+// bp:   IREP base address for the current element.
+// ep:   Descriptor for the current element.
+static int iir_read(lua_State *L,const ir_crumb *c,void *bp,ir_element *ep) {
+  int i, errcnt = 0, tv = lua_type(L,-1);
+
+  // A self-referential table will overflow.
+  if (!lua_checkstack(L,6)) return Ir_error("stack overflow: %s",crumb_str(c));
+  ir_count.elements++;
+
+  // Callback functions and references are handled separately.
+  if (ep->typ == T_cbk) return read_cbk(L, c, bp, ep);
+  if (ep->typ == T_ref) {
+    ir_count.refs++;
+    ir_count.bytes += sizeof(int);
+    return read_ref(L, c, bp);
+  }
+  if (IR_DYN(ep)) return read_dir(L, c, bp, ep);
+  if (IR_SPARSE(ep)) return read_sparse(L, c, bp, ep);
+
+  if (tv != LUA_TTABLE) { // if top of stack is a scalar value, read it now.
+    if (tv == LUA_TSTRING) {
+      char *pchar = (char *)bp;
+      size_t vlen;
+      const char *vp=lua_tolstring(L,-1,&vlen);
+      if (ep->typ != T_str) return TYP_ERR(crumb_str(c), T_str, ep->typ);
+      if (vlen > ep->len - 1)
+        return Ir_error("String too long (max %d): %s (%s)",ep->len,crumb_str(c),vp);
+      (void)strcpy(pchar, vp);
+      Dbg_print("%s = %s", crumb_str(c), pchar);
+      ir_count.strings++;
+      ir_count.bytes += vlen + 1;
+
+    } else if (tv == LUA_TBOOLEAN) {
+      BOOLEAN *pbool = (BOOLEAN *)bp;
+      if (ep->typ != T_log) return TYP_ERR(crumb_str(c), T_log, ep->typ);
+      *pbool = (BOOLEAN)lua_toboolean(L,-1);
+      Dbg_print("%s = %c",crumb_str(c), ((*pbool) ? 'T' : 'F'));
+      ir_count.bytes += sizeof *pbool;
+
+    } else if (tv == LUA_TNUMBER) {
+      if (ep->typ!=T_dbl && ep->typ!=T_int) return TYP_ERR(crumb_str(c),T_dbl,ep->typ);
+      double d = lua_tonumber(L,-1);
+      int isint = ((d - (double)(int)d) == 0.0);
+      ir_count.bytes += (ep->typ == T_dbl) ? sizeof(double) : sizeof(int);
+      if (ep->typ == T_dbl) {
+        double *pdbl = (double *)bp;
+        *pdbl = d;
+        if (isint) Dbg_print("%s = %d", crumb_str(c), (int)(*pdbl));
+        else       Dbg_print("%s = %25.17e", crumb_str(c), *pdbl);
+      } else if (ep->typ == T_int) {
+        int *pint = (int *)bp;
+        if (isint) {
+          *pint = (int)d;
+          Dbg_print("%s = %d", crumb_str(c), *pint);
+        } else return Ir_error("Integer value expected: %s: %25.17e", crumb_str(c),d);
+      }
+
+    } else {
+      return Ir_error("Wrong type: %s (%s): Expected: %s",
+        crumb_str(c), lua_typename(L,tv), s_typ[ep->typ]);
+    }
+    return 0;
+  }
+
+  // If we get here, Lua TOS must be a table.  Verify that the corresponding
+  // IREP element is also a table, or an array.
+  if (ep->typ != T_tbl && ep->fub == 0) return TYP_ERR(crumb_str(c), T_tbl, ep->typ);
+  if (ep->n1 > 0) return read_arr(L, c, bp, ep);
+
+  // Numeric and logical vectors are read in bulk, unless we are listing
+  // every element for irep_debug.
+  if (ep->fub > 0 && irep_debug <= 0 && (i = read_vec(L, bp, ep)) >= 0) {
+    ir_count.elements += i;
+    ir_count.bytes += i * ep->sz;
+    return 0;
+  }
+
+  // Process the subtable recursively.
+  for (lua_pushnil(L); lua_next(L,-2); lua_pop(L,1)) {
+    ir_crumb nc = { c, 0, 0 };
+    void *nbp = bp;
+    ir_element *nep = ep;
+
+    if (lua_type(L,-2) == LUA_TSTRING) { // Table has string keys.
+      const char *s = lua_tostring(L,-2);
+      nc.name = s;
+      i = find_element(s, ep->ti);
+      if (i == -1) {
+        lua_pop(L, 2);
+        return Ir_error("No such IREP variable: %s (%s)", s, crumb_str(&nc));
+      }
+      nep = &ir_ta[ep->ti][i];
+      nbp += nep->off;
+
+    } else if (lua_type(L,-2) == LUA_TNUMBER) { // Table has numeric keys.
+      i = (int)lua_tonumber(L,-2);
+      nc.i = i;
+      if (i<ep->flb || i>ep->fub) {
+        lua_pop(L, 2);
+        return Ir_error("Array bounds exceeded: %s (%d:%d)",
+          crumb_str(&nc),ep->flb,ep->fub);
+      }
+      nbp += (i - ep->flb)*ep->sz;
+
+    } else {
+      lua_pop(L, 2);
+      return Ir_error("Expected string or integer key: %s", crumb_str(c));
+    }
+    errcnt += (irep_stats > 0 && nc.name && nep->typ == T_tbl) ?
+      stat_read(L, &nc, nbp, nep) : iir_read(L, &nc, nbp, nep);
+  }
+  return errcnt;
+}
+
+// Profiling.  With irep_stats on, each table that ir_read reads (the
+// path given to it, and each subtable below that) gets an entry, named by
+// its path without indexes, e.g., "table1.table2": the elements of an
+// array of structs count together, with the array.  An entry's counts
+// include everything below it.
+
+static ir_stat *ir_stat_tab = NULL;
+static int ir_stat_n = 0, ir_stat_cap = 0;
+static char *ir_stat_file = NULL; // From irep_stats=<file>.
+
+static double stat_now(void) {
+  struct timeval tv;
+  (void)gettimeofday(&tv, NULL);
+  return tv.tv_sec + 1.0e-6*tv.tv_usec;
+}
+
+// Index of the entry for crumb c, or -1 if it cannot be added.  (The
+// table may move, so callers hold indexes, not pointers.)
+static int stat_entry(const ir_crumb *c) {
+  const char *s = crumb_str(c);
+  char *name = malloc(strlen(s) + 1), *q = name;
+  int i;
+
+  if (!name) return -1;
+  for (; *s; s++) { // Copy the path, without indexes.
+    if (*s == '[') s += strcspn(s, "]");
+    else *q++ = *s;
+    if (!*s) break;
+  }
+  *q = '\0';
+  for (i=0; i < ir_stat_n; i++) {
+    if (strcmp(ir_stat_tab[i].name, name) == 0) {
+      free(name);
+      return i;
+    }
+  }
+  if (ir_stat_n == ir_stat_cap) {
+    int cap = ir_stat_cap ? 2*ir_stat_cap : 16;
+    ir_stat *nt = realloc(ir_stat_tab, cap * sizeof *nt);
+    if (!nt) {
+      free(name);
+      return -1;
+    }
+    ir_stat_tab = nt;
+    ir_stat_cap = cap;
+  }
+  memset(&ir_stat_tab[i], 0, sizeof *ir_stat_tab);
+  ir_stat_tab[i].name = name;
+  return ir_stat_n++;
+}
+
+// iir_read, profiled.
+static int stat_read(lua_State *L,const ir_crumb *c,void *bp,ir_element *ep) {
+  int k = stat_entry(c), errcnt;
+  ir_counts c0 = ir_count;
+  double t0 = stat_now();
+
+  errcnt = iir_read(L, c, bp, ep);
+  if (k >= 0) {
+    ir_stat *s = &ir_stat_tab[k];
+    s->reads++;
+    s->elements += ir_count.elements - c0.elements;
+    s->bytes += ir_count.bytes - c0.bytes;
+    s->strings += ir_count.strings - c0.strings;
+    s->callbacks += ir_count.callbacks - c0.callbacks;
+    s->refs += ir_count.refs - c0.refs;
+    s->seconds += stat_now() - t0;
+  }
+  return errcnt;
+}
+
+// Turn profiling on (on != 0) or off.  Returns the previous setting.
+int ir_stats_enable(int on) {
+  int was = irep_stats > 0;
+  irep_stats = (on != 0);
+  return was;
+}
+
+// Copy entry i (0 <= i < n) to s, if s is not NULL.  Returns n, the number
+// of entries.  The entry's name belongs to IREP, until ir_stats_reset.
+int ir_stats(int i, ir_stat *s) {
+  if (s && i >= 0 && i < ir_stat_n) *s = ir_stat_tab[i];
+  return ir_stat_n;
+}
+
+// Forget the entries.
+void ir_stats_reset(void) {
+  int i;
+  for (i=0; i < ir_stat_n; i++) free((char *)ir_stat_tab[i].name);
+  ir_stat_n = 0;
+}
+
+// Write the entries as JSON to file, or to stdout if file is NULL or "".
+// Returns the error count.
+int ir_stats_json(const char *file) {
+  int i, errcnt = 0;
+  FILE *f = (file && *file) ? fopen(file, "w") : stdout;
+  if (!f) return Ir_error("ir_stats_json: cannot open %s", file);
+  (void)fprintf(f, "{\"irep_stats\": [");
+  for (i=0; i < ir_stat_n; i++) {
+    ir_stat *s = &ir_stat_tab[i];
+    (void)fprintf(f, "%s\n  {\"name\": \"%s\", \"reads\": %ld, \"elements\": %ld, "
+      "\"bytes\": %ld, \"strings\": %ld, \"callbacks\": %ld, \"refs\": %ld, "
+      "\"seconds\": %.6e}", i ? "," : "", s->name, s->reads, s->elements,
+      s->bytes, s->strings, s->callbacks, s->refs, s->seconds);
+  }
+  (void)fprintf(f, "\n]}\n");
+  if (ferror(f)) errcnt = (Ir_error("ir_stats_json: cannot write %s", file));
+  if (f != stdout && fclose(f)) errcnt = (Ir_error("ir_stats_json: cannot write %s", file));
+  return errcnt;
+}
+
+static void stat_atexit(void) {
+  (void)ir_stats_json(ir_stat_file);
+}
+
+// Check the environment (see ir_getenv): irep_stats=1 turns profiling
+// on, and so does irep_stats=<file>, which also writes the entries to
+// file at exit.
+static void stat_getenv(void) {
+  const char *s = getenv("irep_stats");
+  if (!s) return;
+  if (isdigit((int)*s)) {
+    irep_stats = atoi(s);
+  } else if (*s && (ir_stat_file = strdup(s)) && atexit(stat_atexit) == 0) {
+    irep_stats = 1;
+  }
+}
+
+// Push the value of one element of a string, number, or logical array,
+// or of a scalar (i == 0).
+static void unread_pod(lua_State *L, const char *bp, ir_element *ep, int i) {
+  if (ep->typ == T_str)      lua_pushstring(L, bp + i*ep->sz);
+  else if (ep->typ == T_dbl) lua_pushnumber(L, ((double *)bp)[i]);
+  else if (ep->typ == T_int) lua_pushinteger(L, ((int *)bp)[i]);
+  else                       lua_pushboolean(L, ((BOOLEAN *)bp)[i]);
+}
+
+// Push dimensions 0 to d of Vir2_ or Vir3_ array ep, from element off,
+// as nested tables: t[i][j][k] is Fortran ID(i,j,k).
+static void unread_arr(lua_State *L, const char *bp, ir_element *ep,
+                       const int *ext, const size_t *stride, int d, size_t off) {
+  int i, rank = (ep->n2 > 0) ? 3 : 2, j = rank - 1 - d;
+  lua_createtable(L, ext[j], 0);
+  for (i=0; i < ext[j]; i++) {
+    if (d == 0) unread_pod(L, bp, ep, (int)(off + i*stride[j]));
+    else unread_arr(L, bp, ep, ext, stride, d-1, off + i*stride[j]);
+    lua_rawseti(L, -2, i+1);
+  }
+}
+
+// In a pool state (see ir_pool), the host's callbacks and references are
+// kept in this table in the registry, keyed by their registry index in
+// the host's lua_State.
+#define IR_REFS "ir_refs"
+
+// Push the Lua value of reference ref, a registry index in the host's
+// lua_State, or nil.  L is the host's state, or a pool state.
+static void push_ref(lua_State *L, int ref) {
+  if (ref < 0) {
+    lua_pushnil(L);
+    return;
+  }
+  lua_getfield(L, LUA_REGISTRYINDEX, IR_REFS);
+  if (lua_istable(L,-1)) {
+    lua_rawgeti(L, -1, ref);
+    lua_remove(L,-2);
+  } else {
+    lua_pop(L,1);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+  }
+}
+
+// Push an IREP element back to the lua_State, as a new Lua value (the
+// reverse of iir_read).  Tables are presized, and arrays filled with
+// lua_rawseti.  A callback is pushed as its function, or as the table of
+// its constant data; a reference as its value.  ir_ptr elements are
+// pushed as nil, i.e., they are left out of the enclosing table.  One
+// value is always pushed, even on error.  treat_as_scalar is set when bp
+// is one element of an array, given by its index.
+static int iir_unread(lua_State *L,const ir_crumb *c,void *bp,ir_element *ep, int treat_as_scalar) {
+  int i, n, errcnt = 0;
+
+  if (!lua_checkstack(L,4)) {
+    lua_pushnil(L); // The stack has room for 1 value (LUA_MINSTACK).
+    return Ir_error("stack overflow: %s", crumb_str(c));
+  }
+
+  if (ep->typ == T_cbk) {
+    lua_cb_data *cb = (lua_cb_data *)bp;
+    if (cb->fref == LUA_NOREF && cb->data) { // Constant data.
+      n = ir_nret(cb->npnr);
+      lua_createtable(L, n, 0);
+      for (i=0; i<n; i++) {
+        lua_pushnumber(L, ((double *)cb->data)[i]);
+        lua_rawseti(L, -2, i+1);
+      }
+    } else {
+      push_ref(L, cb->fref);
+    }
+
+  } else if (ep->typ == T_ref) {
+    push_ref(L, *((int *)bp));
+
+  } else if (ep->typ == T_ptr) {
+    lua_pushnil(L);
+
+  } else if (IR_SPARSE(ep)) { // Sparse vector of structs.
+    ir_sparse *s = (ir_sparse *)bp;
+    ir_element e = sparse_elem(ep);
+    lua_createtable(L, 0, s->n);
+    for (i=0; i < s->n; i++) {
+      ir_crumb nc = { c, 0, SPARSE_KEY(s,i) };
+      errcnt += iir_unread(L, &nc, SPARSE_ELEM(s,i), &e, 0);
+      lua_rawseti(L, -2, SPARSE_KEY(s,i));
+    }
+
+  } else if (IR_DYN(ep)) { // Runtime-sized vector.
+    ir_dir *d = (ir_dir *)bp;
+    lua_createtable(L, d->n, 0);
+    for (i=0; i < d->n; i++) {
+      unread_pod(L, d->p, ep, i);
+      lua_rawseti(L, -2, i+1);
+    }
+
+  } else if (ep->n1 > 0 && !treat_as_scalar) { // Vir2_ or Vir3_ array.
+    int ext[3];
+    size_t stride[3];
+    unread_arr(L, bp, ep, ext, stride, arr_shape(ep, ext, stride) - 1, 0);
+
+  } else if (ep->fub > 0 && !treat_as_scalar) { // Array of structs, or of POD.
+    lua_createtable(L, ep->fub, ep->flb < 1 ? 1 - ep->flb : 0);
+    for (i=ep->flb; i<=ep->fub; i++) {
+      if (ep->typ == T_tbl) {
+        ir_crumb nc = { c, 0, i };
+        errcnt += iir_unread(L, &nc, bp + (i - ep->flb)*ep->sz, ep, 1);
+      } else {
+        unread_pod(L, bp, ep, i - ep->flb);
+      }
+      lua_rawseti(L, -2, i);
+    }
+
+  } else if (ep->typ == T_tbl) { // Scalar struct, or 1 element of an array.
+    ir_element *nep;
+    for (n=0, nep = ir_ta[ep->ti]; nep->name; nep++) n += (nep->typ != T_ptr);
+    lua_createtable(L, 0, n);
+    for (nep = ir_ta[ep->ti]; nep->name; nep++) {
+      ir_crumb nc = { c, nep->name, 0 };
+      errcnt += iir_unread(L, &nc, bp + nep->off, nep, 0);
+      lua_setfield(L, -2, nep->name);
+    }
+
+  } else { // Scalar POD, or 1 element of an array.
+    unread_pod(L, bp, ep, 0);
+  }
+  return errcnt;
+}
+
+// Is s a simple name, such as "table1.table2[3].f2": a Lua name, then
+// any number of ".name" or "[integer]" keys?
+static int elem_simple(const char *s) {
+  if (!isalpha((int)*s) && *s != '_') return 0;
+  while (*s) {
+    if (isalnum((int)*s) || *s == '_') s++;
+    else if (*s == '.' && (isalpha((int)s[1]) || s[1] == '_')) s += 2;
+    else if (*s == '[') {
+      s += (s[1] == '-') ? 2 : 1;
+      if (!isdigit((int)*s)) return 0;
+      while (isdigit((int)*s)) s++;
+      if (*s++ != ']') return 0;
+      if (*s && *s != '.' && *s != '[') return 0;
+    }
+    else return 0;
+  }
+  return 1;
+}
+
+// Most Lua expressions kept by ir_elem.  When the cache is full, it is
+// emptied, so a program that makes up new expressions does not grow it
+// without bound.
+#define IR_ELEM_MAX 256
+
+// Empty the Lua stack; load an arbitrary element name onto TOS.  Simple
+// names are found by walking the Lua tables, as ir_read_path does, and a
+// missing or non-table value along the way gives nil.  Anything else is
+// a Lua expression: it is compiled once, and the chunk is kept in the
+// registry (table "ir_elem", with the count at [0]) for the next query.
+// Returns nonzero if evaluation fails.
+static int ir_elem(lua_State *L, const char *s) {
+  char buf[BSZ];
+  lua_settop(L,0);
+
+  if (elem_simple(s)) {
+    const char *k = s + strcspn(s, ".[");
+    lua_pushlstring(L, s, k - s);
+    lua_gettable(L, LUA_GLOBALSINDEX);
+    while (*k && lua_istable(L,-1)) {
+      if (*k == '.') {
+        s = k+1;
+        k = s + strcspn(s, ".[");
+        lua_pushlstring(L, s, k - s);
+      } else {
+        lua_pushinteger(L, atoi(k+1));
+        k += strcspn(k, "]") + 1;
+      }
+      lua_gettable(L,-2);
+      lua_remove(L,-2);
+    }
+    if (*k) { // Ran into a non-table.
+      lua_settop(L,0);
+      lua_pushnil(L);
+    }
+    return 0;
+  }
+
+  lua_getfield(L, LUA_REGISTRYINDEX, "ir_elem");
+  if (lua_isnil(L,-1)) {
+    lua_pop(L,1);
+    lua_newtable(L);
+    lua_pushvalue(L,-1);
+    lua_setfield(L, LUA_REGISTRYINDEX, "ir_elem");
+  }
+  lua_getfield(L,-1,s);
+  if (lua_isnil(L,-1)) {
+    int n;
+    lua_pop(L,1);
+    (void)snprintf(buf, sizeof buf, "return %s", s);
+    if (luaL_loadstring(L, buf)) return 1;
+    lua_rawgeti(L,-2,0);
+    n = (int)lua_tointeger(L,-1);
+    lua_pop(L,1);
+    if (n >= IR_ELEM_MAX) { // Start over with an empty cache.
+      lua_newtable(L);
+      lua_pushvalue(L,-1);
+      lua_setfield(L, LUA_REGISTRYINDEX, "ir_elem");
+      lua_replace(L,-3);
+      n = 0;
+    }
+    lua_pushinteger(L, n+1);
+    lua_rawseti(L,-3,0);
+    lua_pushvalue(L,-1);
+    lua_setfield(L,-3,s);
+  }
+  lua_remove(L,-2);
+  return lua_pcall(L,0,1,0);
+}
+
+// One key of a precompiled path: a string key s, or (if s is NULL) the
+// integer key i.  off is the key's offset from the address of the key
+// before it, unless the key is an index into a sparse vector, sp.
+typedef struct {
+  const char *s;
+  int i;
+  size_t off;
+  ir_element *sp;
+} ir_pkey;
+
+// A precompiled IREP path.  See ir_path_compile.
+struct ir_path {
+  char *name;       // The path as given, e.g., "table1.table2[3].f2".
+  char *toks;       // Tokenized copy of name; string keys point into it.
+  int nkey;         // Number of keys, including the well known table name.
+  ir_pkey *key;     // The keys, used to walk the Lua tables.
+  int nsparse;      // Number of keys that index a sparse vector.
+  void *bp;         // IREP base address for the element, or, if nsparse
+                    // is not 0, for the well known table (see path_bp).
+  ir_element *ep;   // Descriptor for the element.
+  ir_element elem;  // For an element of a sparse vector, *ep.
+};
+
+// Release a path returned by ir_path_compile.  A NULL path is ignored.
+void ir_path_free(ir_path *p) {
+  if (!p) return;
+  free(p->name);
+  free(p->toks);
+  free(p->key);
+  free(p);
+}
+
+static void cbp_getenv(void);
+
+// Read the environment, once, at the first ir_path_compile (so the first
+// ir_read), ir_unpack, or ir_load: irep_debug, irep_compile, irep_stats
+// (see stat_getenv), and irep_cbprof (see cbp_getenv).
+static void ir_getenv(void) {
+  static int done = 0;
+  if (done) return;
+  done = 1;
+  irep_debug = getenv("irep_debug") ? atoi(getenv("irep_debug")) : 0;
+  irep_compile = getenv("irep_compile") ? atoi(getenv("irep_compile")) : 1;
+  stat_getenv();
+  cbp_getenv();
+}
+
+// Resolve an IREP path such as "table1.table2[3].f2" once: find its
+// element descriptor and base address, and record the keys needed to
+// find the same element in the Lua tables.  Returns NULL on error.
+ir_path *ir_path_compile(const char *path) {
+  int n = strlen(path);
+
+  ir_getenv();
+
+  ir_path *p = calloc(1, sizeof *p);
+  if (!p) {
+    (void)Ir_error("%s: calloc failed", path);
+    return NULL;
+  }
+  p->name = strdup(path);
+  p->toks = strdup(path);
+  p->key = malloc((n/2+1) * sizeof *p->key); // Keys are separated by ".[]".
+  if (!p->name || !p->toks || !p->key) {
+    ir_path_free(p);
+    (void)Ir_error("%s: malloc failed", path);
+    return NULL;
+  }
+
+  // Find the well known table name first.
+  char *s = strtok(p->toks, ".[]");
+  int i = s ? find_wkt(s) : -1;
+  if (i == -1) {
+    (void)Ir_error("No such IREP table: %s (%s)", s ? s : "", path);
+    ir_path_free(p);
+    return NULL;
+  }
+
+  ir_wkt_desc *w = &ir_wktt[i];
+  char *bp = w->p;
+  ir_element *ep = &w->e;
+  p->key[p->nkey].s = s;
+  p->key[p->nkey].off = 0;
+  p->key[p->nkey].sp = NULL;
+  p->nkey++;
+
+  // Walk down any remaining elements after the wkt name.
+  while ((s = strtok(0, ".[]"))) {
+    if (isalpha((int)(*s)) || *s == '_') { // string key
+      int j = find_element(s, ep->ti);
+      if (j == -1) {
+        (void)Ir_error("IREP key not found: %s (%s)", s, path);
+        ir_path_free(p);
+        return NULL;
+      }
+      ep = &ir_ta[ep->ti][j];
+      bp += ep->off;
+      p->key[p->nkey].s = s;
+      p->key[p->nkey].off = ep->off;
+      p->key[p->nkey].sp = NULL;
+
+    } else if (isdigit((int)(*s))) { // numeric key
+      int j = atoi(s);
+      if (IR_DYN(ep)) {
+        (void)Ir_error("Runtime-sized vector cannot be indexed: %s", path);
+        ir_path_free(p);
+        return NULL;
+      }
+      if (ep->n1 > 0) {
+        (void)Ir_error("Multi-dimensional array cannot be indexed: %s", path);
+        ir_path_free(p);
+        return NULL;
+      }
+      if (j<ep->flb || j>ep->fub) {
+        (void)Ir_error("Array bounds exceeded: %s[%d] (%d:%d)",
+          path, j, ep->flb, ep->fub);
+        ir_path_free(p);
+        return NULL;
+      }
+      p->key[p->nkey].s = NULL;
+      p->key[p->nkey].i = j;
+      p->key[p->nkey].off = 0;
+      p->key[p->nkey].sp = NULL;
+      if (IR_SPARSE(ep)) { // The element is found when the path is used.
+        p->key[p->nkey].sp = ep;
+        p->nsparse++;
+        p->elem = sparse_elem(ep);
+        ep = &p->elem;
+      } else {
+        p->key[p->nkey].off = (j - ep->flb)*ep->sz;
+        bp += p->key[p->nkey].off;
+      }
+
+    } else {
+      (void)Ir_error("Bad table element: %s (%s)", s, path);
+      ir_path_free(p);
+      return NULL;
+    }
+    p->nkey++;
+  }
+  p->bp = p->nsparse ? w->p : bp;
+  p->ep = ep;
+  return p;
+}
+
+// The address of the element named by path p.  An element of a sparse
+// vector along the path is added if add is not 0 (then NULL means out of
+// memory); otherwise the result is NULL if the input has not given it.
+static char *path_bp(const ir_path *p, int add) {
+  char *bp = (char *)p->bp;
+  int k;
+
+  if (!p->nsparse) return bp;
+  for (k=1; k < p->nkey && bp; k++) {
+    const ir_pkey *q = &p->key[k];
+    if (!q->sp) bp += q->off;
+    else if (add) bp = (char *)sparse_add(bp, q->i, q->sp);
+    else bp = (char *)ir_sparse_get((const ir_sparse *)bp, q->i);
+  }
+  return bp;
+}
+
+// Push the value of key k of path p in the table at TOS.  As in Lua, this
+// honors __index, for integer keys as well as names.
+static void path_getkey(lua_State *L, const ir_path *p, int k) {
+  if (p->key[k].s) lua_getfield(L, -1, p->key[k].s);
+  else {
+    lua_pushinteger(L, p->key[k].i);
+    lua_gettable(L,-2);
+  }
+}
+
+// Empty the Lua stack, and push the Lua value named by path p, by walking
+// the Lua tables directly.  Pushes nil if the path runs through a missing
+// or non-table value.
+static void path_push(lua_State *L, const ir_path *p) {
+  int k;
+  lua_settop(L,0);
+  lua_getfield(L, LUA_GLOBALSINDEX, p->key[0].s);
+  for (k=1; k < p->nkey && !lua_isnil(L,-1); k++) {
+    if (lua_type(L,-1) != LUA_TTABLE) {
+      lua_pop(L,1);
+      lua_pushnil(L);
+      break;
+    }
+    path_getkey(L, p, k);
+    lua_remove(L,-2);
+  }
+}
+
+// Does path p end in an array index, e.g., "table1.table2[3]"?  Then its
+// element is one element of the array.
+static int path_scalar(const ir_path *p) {
+  return p->key[p->nkey - 1].s == NULL;
+}
+
+// Set key k of path p in the table at index -3 to the value at TOS, and
+// pop the value.  As in Lua, this honors __newindex.
+static void path_setkey(lua_State *L, const ir_path *p, int k) {
+  if (p->key[k].s) lua_setfield(L, -3, p->key[k].s);
+  else {
+    lua_pushinteger(L, p->key[k].i);
+    lua_insert(L,-2);
+    lua_settable(L,-4);
+  }
+}
+
+// Empty the Lua stack, and push the Lua table that holds the value named
+// by path p, creating any tables missing along the way.
+static int path_parent(lua_State *L, const ir_path *p) {
+  int k;
+  lua_settop(L,0);
+  lua_pushvalue(L, LUA_GLOBALSINDEX);
+  for (k=0; k < p->nkey - 1; k++) {
+    path_getkey(L, p, k);
+    if (!lua_istable(L,-1)) {
+      if (!lua_isnil(L,-1)) return Ir_error("Not a table: %s (key %d)", p->name, k+1);
+      lua_pop(L,1);
+      lua_newtable(L);
+      lua_pushvalue(L,-1);
+      path_setkey(L, p, k);
+    }
+    lua_remove(L,-2);
+  }
+  return 0;
+}
+
+// Read the element named by a precompiled path.  Same as ir_read, but
+// without re-parsing the path or compiling any Lua.
+int ir_read_path(lua_State *L, ir_path *p) {
+  if (!p) return Ir_error("%s", "ir_read_path: NULL path");
+  ir_crumb c = { 0, p->name, 0 };
+  path_push(L, p);
+  char *bp = path_bp(p, !lua_isnil(L,-1)); // Add only elements the input gives.
+  if (!bp) return lua_isnil(L,-1) ? 0 : Ir_error("%s: out of memory", p->name);
+  return (irep_stats > 0) ? stat_read(L, &c, bp, p->ep) : iir_read(L, &c, bp, p->ep);
+}
+
+// Precompiled path version of ir_exists.
+int ir_path_exists(lua_State *L, ir_path *p) {
+  if (!p) return 0;
+  path_push(L, p);
+  return !lua_isnil(L,-1);
+}
+
+// Precompiled path version of ir_rtlen.
+int ir_path_rtlen(lua_State *L, ir_path *p) {
+  if (!p) return -1;
+  path_push(L, p);
+  int n = lua_type(L,-1);
+  return (n==LUA_TNIL) ? -1 : ((n==LUA_TNUMBER) ? 0 : (int)lua_objlen(L,-1));
+}
+
+// External entry point: ir_read(L, "table[.subtable...]").
+int ir_read(lua_State *L, const char *table_name) {
+  ir_path *p = ir_path_compile(table_name);
+  if (!p) return 1;
+  int errcnt = ir_read_path(L, p);
+  ir_path_free(p);
+  return errcnt;
+}
+
+// Push the element named by a precompiled path back to the lua_State,
+// replacing its Lua value (the reverse of ir_read_path).  Tables along
+// the path are created if they are missing.  On return, the Lua stack
+// holds just the new value.
+int ir_unread_path(lua_State *L, ir_path *p) {
+  if (!p) return Ir_error("%s", "ir_unread_path: NULL path");
+  ir_crumb c = { 0, p->name, 0 };
+  if (path_parent(L, p)) return 1;
+  char *bp = path_bp(p, 0);
+  int errcnt = 0;
+  if (bp) errcnt = iir_unread(L, &c, bp, p->ep, path_scalar(p));
+  else lua_pushnil(L); // An element of a sparse vector the input has not given.
+  lua_pushvalue(L,-1);
+  path_setkey(L, p, p->nkey - 1);
+  lua_remove(L,-2);
+  return errcnt;
+}
+
+// External entry point: ir_unread(L, "table[.subtable...]").
+int ir_unread(lua_State *L, const char *ir_tbl) {
+  ir_path *p = ir_path_compile(ir_tbl);
+  if (!p) return 1;
+  int errcnt = ir_unread_path(L, p);
+  ir_path_free(p);
+  return errcnt;
+}
+
+// Check existence of an element.  If found, leave it on TOS.
+int ir_exists(lua_State *L, const char *s) {
+  if (ir_elem(L,s)) return 0;
+  return !lua_isnil(L,-1);
+}
+
+// Return the run time length of a vector.
+int ir_rtlen(lua_State *L, const char *s) {
+  if (ir_elem(L,s)) return -1;
+  int n = lua_type(L,-1);
+  return (n==LUA_TNIL) ? -1 : ((n==LUA_TNUMBER) ? 0 : (int)lua_objlen(L,-1));
+}
+
+// Report an error while evaluating callback cb, using its full name (see
+// ir_set_function_name), and restore the Lua stack to top.  Returns 1.
+static int cb_error(lua_State *L, int top, lua_cb_data *cb, const char *fmt, ...) {
+  va_list ap;
+  const char *name = NULL;
+  if (L) {
+    lua_pushlightuserdata(L,cb);
+    lua_gettable(L,LUA_REGISTRYINDEX);
+    name = lua_tostring(L,-1);
+  }
+  if (!name) name = frz_name(cb);
+  fprintf(stderr, "ERROR (Lua/IR): Callback %s: ", name ? name : "(unnamed)");
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fputc('\n', stderr);
+  if (L) lua_settop(L,top);
+  return 1;
+}
+
+// Checks common to the ir_cb_eval family; sets *nprm and *nret.  Returns
+// -1 if the callback was not defined in the Lua input, else an error count.
+static int cb_check(lua_State *L, int top, lua_cb_data *cb, int *nprm, int *nret) {
+  *nprm = ir_nprm(cb->npnr);
+  *nret = ir_nret(cb->npnr);
+  if (cb->fref == LUA_REFNIL) return -1;
+  if (cb->fref == LUA_NOREF) return 0; // *nret is the length of cb->data.
+  if (arena_code(cb)) return 0;
+  if (!L) return cb_error(L, top, cb, "not compiled, and no lua_State given");
+  if (*nprm < 0 || *nret < 0)
+    return cb_error(L, top, cb, "NPRM or NRET of -1 is not supported here");
+  if (!lua_checkstack(L, *nprm + *nret + 2))
+    return cb_error(L, top, cb, "Lua stack overflow");
+  return 0;
+}
+
+// Constant callback (fref == LUA_NOREF): copy its data to all n points.
+// The inner loop runs over points, so that a unit point stride (SoA
+// output) is a plain fill.
+static void cb_broadcast(lua_cb_data *cb, int nret, int n,
+                         double *v, int vs, int vc) {
+  const double *dp = (const double *)cb->data;
+  int i, k;
+  for (k=0; k < nret; k++) {
+    const double c = dp[k];
+    double *vk = v + (ptrdiff_t)k*vc;
+    if (vs == 1) for (i=0; i < n; i++) vk[i] = c;
+    else for (i=0; i < n; i++) vk[(ptrdiff_t)i*vs] = c;
+  }
+}
+
+// Evaluate callback cb at n points.  Parameter j of point i is
+// x[i*xs + j*xc], and return value k of point i goes to v[i*vs + k*vc].
+// The Lua function is called once per point, from one reused stack frame.
+static int cb_eval_batch(lua_State *L, lua_cb_data *cb, int n,
+                         const double *x, int xs, int xc,
+                         double *v, int vs, int vc) {
+  const ir_cprog *p;
+  if (!L) L = frz_state(cb);
+  int i, j, nprm, nret, top = L ? lua_gettop(L) : 0;
+  int errcnt = cb_check(L, top, cb, &nprm, &nret);
+  if (errcnt) return errcnt;
+  if (cb->fref == LUA_NOREF) {
+    cb_broadcast(cb, nret, n, v, vs, vc);
+    return 0;
+  }
+  if ((p = (const ir_cprog *)arena_code(cb))) {
+    for (i=0; i < n; i++)
+      cprog_run(p, x + (ptrdiff_t)i*xs, xc, v + (ptrdiff_t)i*vs, vc);
+    return 0;
+  }
+
+  push_ref(L, cb->fref); // At top+1, for all points.
+  for (i=0; i < n; i++) {
+    const double *xi = x + (ptrdiff_t)i*xs;
+    double *vi = v + (ptrdiff_t)i*vs;
+    lua_pushvalue(L, top+1);
+    for (j=0; j < nprm; j++) lua_pushnumber(L, xi[(ptrdiff_t)j*xc]);
+    if (lua_pcall(L, nprm, nret, 0) != 0)
+      return cb_error(L, top, cb, "%s", lua_tostring(L,-1));
+    for (j=0; j < nret; j++) {
+      if (lua_type(L, top+2+j) != LUA_TNUMBER)
+        return cb_error(L, top, cb, "point %d: expected number for "
+          "return value %d", i, j+1);
+      vi[(ptrdiff_t)j*vc] = lua_tonumber(L, top+2+j);
+    }
+    lua_settop(L, top+1);
+  }
+  lua_settop(L, top);
+  return 0;
+}
+
+// Same as ir_cb_eval_batch, but the Lua function is called once for the
+// whole batch: parameter j is passed as a Lua array of n numbers, and
+// each return value must be an array of n numbers.  (A compiled callback
+// is evaluated point by point, as in ir_cb_eval_batch.)
+static int cb_eval_array(lua_State *L, lua_cb_data *cb, int n,
+                         const double *x, int xs, int xc,
+                         double *v, int vs, int vc) {
+  const ir_cprog *p;
+  if (!L) L = frz_state(cb);
+  int i, j, nprm, nret, top = L ? lua_gettop(L) : 0;
+  int errcnt = cb_check(L, top, cb, &nprm, &nret);
+  if (errcnt) return errcnt;
+  if (cb->fref == LUA_NOREF) {
+    cb_broadcast(cb, nret, n, v, vs, vc);
+    return 0;
+  }
+  if ((p = (const ir_cprog *)arena_code(cb))) {
+    for (i=0; i < n; i++)
+      cprog_run(p, x + (ptrdiff_t)i*xs, xc, v + (ptrdiff_t)i*vs, vc);
+    return 0;
+  }
+
+  push_ref(L, cb->fref);
+  for (j=0; j < nprm; j++) {
+    const double *xj = x + (ptrdiff_t)j*xc;
+    lua_createtable(L, n, 0);
+    for (i=0; i < n; i++) {
+      lua_pushnumber(L, xj[(ptrdiff_t)i*xs]);
+      lua_rawseti(L, -2, i+1);
+    }
+  }
+  if (lua_pcall(L, nprm, nret, 0) != 0)
+    return cb_error(L, top, cb, "%s", lua_tostring(L,-1));
+
+  for (j=0; j < nret; j++) {
+    int t = top+1+j;
+    double *vj = v + (ptrdiff_t)j*vc;
+    if (lua_type(L,t) != LUA_TTABLE || (int)lua_objlen(L,t) != n)
+      return cb_error(L, top, cb, "expected array of %d numbers for "
+        "return value %d", n, j+1);
+    for (i=0; i < n; i++) {
+      lua_rawgeti(L, t, i+1);
+      if (lua_type(L,-1) != LUA_TNUMBER)
+        return cb_error(L, top, cb, "expected number for return value "
+          "%d[%d]", j+1, i+1);
+      vj[(ptrdiff_t)i*vs] = lua_tonumber(L,-1);
+      lua_pop(L,1);
+    }
+  }
+  lua_settop(L, top);
+  return 0;
+}
+
+// Is callback cb compiled (or constant)?  If so, the ir_cb_eval family
+// does not use Lua to evaluate it: the lua_State argument may be NULL,
+// and calls may be made concurrently from several threads.
+int ir_cb_compiled(lua_cb_data *cb) {
+  return cb->fref == LUA_NOREF || (cb->fref != LUA_REFNIL && arena_code(cb) != NULL);
+}
+
+// Evaluate callback cb at one point, for any NPRM and NRET.  The nx
+// parameters x[0..nx-1] are passed; nx must equal NPRM unless NPRM is -1.
+// On entry *nv is the room in v, and on return it is the number of values
+// stored.  If NRET is -1, the function returns an array of numbers.
+static int cb_eval_n(lua_State *L, lua_cb_data *cb, int nx, const double *x,
+                     int *nv, double *v) {
+  int i, n, nprm = ir_nprm(cb->npnr), nret = ir_nret(cb->npnr), top;
+  const ir_cprog *p = NULL;
+  if (!L) L = frz_state(cb);
+  top = L ? lua_gettop(L) : 0;
+
+  if (cb->fref == LUA_REFNIL) return -1;
+  if (nprm >= 0 && nx != nprm)
+    return cb_error(L, top, cb, "%d parameters given, %d expected", nx, nprm);
+  if (cb->fref == LUA_NOREF || (p = (const ir_cprog *)arena_code(cb))) { // nret is known.
+    if (nret > *nv)
+      return cb_error(L, top, cb, "room for %d values, %d returned", *nv, nret);
+    if (cb->fref == LUA_NOREF) memcpy(v, cb->data, nret * sizeof *v);
+    else cprog_run(p, x, 1, v, 1);
+    *nv = nret;
+    return 0;
+  }
+  if (!L) return cb_error(L, top, cb, "not compiled, and no lua_State given");
+  if (!lua_checkstack(L, nx + (nret > 0 ? nret : 1) + 2))
+    return cb_error(L, top, cb, "Lua stack overflow");
+
+  push_ref(L, cb->fref);
+  for (i=0; i < nx; i++) lua_pushnumber(L, x[i]);
+  if (lua_pcall(L, nx, nret < 0 ? 1 : nret, 0) != 0)
+    return cb_error(L, top, cb, "%s", lua_tostring(L,-1));
+  if (nret < 0) { // One return value, an array.
+    if (lua_type(L,top+1) != LUA_TTABLE)
+      return cb_error(L, top, cb, "expected an array of numbers");
+    n = (int)lua_objlen(L,top+1);
+    if (n > *nv)
+      return cb_error(L, top, cb, "room for %d values, %d returned", *nv, n);
+    for (i=0; i < n; i++) {
+      lua_rawgeti(L, top+1, i+1);
+      if (lua_type(L,-1) != LUA_TNUMBER)
+        return cb_error(L, top, cb, "expected number for return value "
+          "1[%d]", i+1);
+      v[i] = lua_tonumber(L,-1);
+      lua_pop(L,1);
+    }
+  } else {
+    n = nret;
+    if (n > *nv)
+      return cb_error(L, top, cb, "room for %d values, %d returned", *nv, n);
+    for (i=0; i < n; i++) {
+      if (lua_type(L, top+1+i) != LUA_TNUMBER)
+        return cb_error(L, top, cb, "expected number for return value %d", i+1);
+      v[i] = lua_tonumber(L, top+1+i);
+    }
+  }
+  lua_settop(L, top);
+  *nv = n;
+  return 0;
+}
+
+// Callback profiling.  With it on (see ir_cb_prof_enable), each call to
+// the ir_cb_eval family is timed and counted against its callback, found
+// by the address of its lua_cb_data in an open-addressing hash table.
+// When it is off, the cost is one test per call.  It is not thread safe:
+// turn it off while several threads evaluate callbacks.
+
+typedef struct {
+  const lua_cb_data *cb;  // Key, or NULL for an empty slot.
+  char *name;             // See ir_set_function_name.
+  long calls, points;     // A batch is one call of n points.
+  double sec, max;        // Total and longest call, in seconds.
+  double gc;              // Growth in Lua memory during calls, in bytes.
+} ir_cbprof;
+
+static int irep_cbprof = 0;
+static ir_cbprof *cbp_tab = NULL;
+static size_t cbp_cap = 0, cbp_n = 0;
+static int cbp_top = 0; // From irep_cbprof=N: report the top N at exit.
+
+static double cbp_now(void) {
+  struct timespec ts;
+  (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1.0e-9*ts.tv_nsec;
+}
+
+// Bytes in use by Lua, if cb runs in Lua; else -1.
+static double cbp_mem(lua_State *L, lua_cb_data *cb) {
+  if (!L || ir_cb_compiled(cb)) return -1.0;
+  return 1024.0*lua_gc(L, LUA_GCCOUNT, 0) + lua_gc(L, LUA_GCCOUNTB, 0);
+}
+
+static size_t cbp_slot(const ir_cbprof *tab, size_t cap, const lua_cb_data *cb) {
+  size_t i = (size_t)(((uintptr_t)cb >> 3) * 11400714819323198485ULL) & (cap-1);
+  while (tab[i].cb && tab[i].cb != cb) i = (i+1) & (cap-1);
+  return i;
+}
+
+// Look up the name of e's callback in L (or, with L NULL, among the
+// frozen names), if it is not known yet.
+static void cbp_name(lua_State *L, ir_cbprof *e) {
+  if (e->name) return;
+  if (!L) {
+    const char *name = frz_name(e->cb);
+    if (name) e->name = strdup(name);
+    return;
+  }
+  lua_pushlightuserdata(L, (void *)e->cb);
+  lua_gettable(L, LUA_REGISTRYINDEX);
+  if (lua_isstring(L,-1)) e->name = strdup(lua_tostring(L,-1));
+  lua_pop(L,1);
+}
+
+// The entry for cb, or NULL if it cannot be added.
+static ir_cbprof *cbp_entry(lua_State *L, const lua_cb_data *cb) {
+  size_t i;
+  if (2*(cbp_n + 1) > cbp_cap) { // Keep the table at most half full.
+    size_t cap = cbp_cap ? 2*cbp_cap : 64;
+    ir_cbprof *nt = calloc(cap, sizeof *nt);
+    if (!nt) return NULL;
+    for (i=0; i < cbp_cap; i++)
+      if (cbp_tab[i].cb) nt[cbp_slot(nt, cap, cbp_tab[i].cb)] = cbp_tab[i];
+    free(cbp_tab);
+    cbp_tab = nt;
+    cbp_cap = cap;
+  }
+  ir_cbprof *e = &cbp_tab[cbp_slot(cbp_tab, cbp_cap, cb)];
+  if (!e->cb) {
+    e->cb = cb;
+    cbp_n++;
+  }
+  cbp_name(L, e);
+  return e;
+}
+
+// Count a call to cb of n points, which started at time t0 with m0 bytes
+// in use by Lua (see cbp_mem).
+static void cbp_record(lua_State *L, lua_cb_data *cb, int n, double t0, double m0) {
+  double dt = cbp_now() - t0, dm = (m0 < 0) ? 0.0 : cbp_mem(L, cb) - m0;
+  ir_cbprof *e = cbp_entry(L, cb);
+  if (!e) return;
+  e->calls++;
+  e->points += n;
+  e->sec += dt;
+  if (dt > e->max) e->max = dt;
+  if (dm > 0) e->gc += dm; // Negative if a collection ran.
+}
+
+// Turn callback profiling on (on != 0) or off.  Returns the previous
+// setting.
+int ir_cb_prof_enable(int on) {
+  int was = irep_cbprof > 0;
+  irep_cbprof = (on != 0);
+  return was;
+}
+
+// Forget the counts.
+void ir_cb_prof_reset(void) {
+  size_t i;
+  for (i=0; i < cbp_cap; i++) free(cbp_tab[i].name);
+  free(cbp_tab);
+  cbp_tab = NULL;
+  cbp_cap = cbp_n = 0;
+}
+
+// Forget the arena name and the profile counts of callback cb, whose
+// memory is about to be freed.
+static void cb_forget(const lua_cb_data *cb) {
+  size_t i, m = cbp_cap - 1;
+  ir_cbprof e;
+
+  arena_forget(cb);
+  if (!cbp_cap) return;
+  i = cbp_slot(cbp_tab, cbp_cap, cb);
+  if (!cbp_tab[i].cb) return;
+  free(cbp_tab[i].name);
+  memset(&cbp_tab[i], 0, sizeof cbp_tab[i]);
+  cbp_n--;
+  for (i = (i+1) & m; cbp_tab[i].cb; i = (i+1) & m) { // Rehash the rest of the run.
+    e = cbp_tab[i];
+    memset(&cbp_tab[i], 0, sizeof cbp_tab[i]);
+    cbp_tab[cbp_slot(cbp_tab, cbp_cap, e.cb)] = e;
+  }
+}
+
+static int cbp_cmp(const void *a, const void *b) {
+  double sa = (*(const ir_cbprof **)a)->sec, sb = (*(const ir_cbprof **)b)->sec;
+  return (sa < sb) - (sa > sb);
+}
+
+// Print the n callbacks (all, if n <= 0) with the most time to stdout.
+// L, if not NULL, supplies names not yet known.  Returns the number of
+// callbacks printed.
+int ir_cb_prof_report(lua_State *L, int n) {
+  size_t i, k = 0;
+  ir_cbprof **e = malloc((cbp_n + 1) * sizeof *e);
+  if (!e) {
+    (void)Ir_error("%s", "ir_cb_prof_report: malloc failed");
+    return 0;
+  }
+  for (i=0; i < cbp_cap; i++)
+    if (cbp_tab[i].cb) cbp_name(L, e[k++] = &cbp_tab[i]);
+  qsort(e, k, sizeof *e, cbp_cmp);
+  if (n <= 0 || (size_t)n > k) n = (int)k;
+  (void)printf("IREP callback profile: top %d of %d callbacks, by time\n", n, (int)k);
+  (void)printf("%10s %12s %12s %12s %12s  %s\n", "calls", "points",
+    "total (s)", "max (s)", "Lua bytes", "callback");
+  for (i=0; i < (size_t)n; i++)
+    (void)printf("%10ld %12ld %12.4e %12.4e %12.0f  %s\n", e[i]->calls,
+      e[i]->points, e[i]->sec, e[i]->max, e[i]->gc,
+      e[i]->name ? e[i]->name : "(unnamed)");
+  free(e);
+  return n;
+}
+
+static void cbp_atexit(void) {
+  (void)ir_cb_prof_report(NULL, cbp_top);
+}
+
+// Check the environment (see ir_getenv): irep_cbprof=N turns callback
+// profiling on, and reports the top N callbacks at exit.
+static void cbp_getenv(void) {
+  const char *s = getenv("irep_cbprof");
+  if (!s) return;
+  cbp_top = atoi(s);
+  if (cbp_top > 0 && atexit(cbp_atexit) == 0) irep_cbprof = 1;
+}
+
+// The ir_cb_eval entry points, profiled if irep_cbprof is on.
+int ir_cb_eval_batch(lua_State *L, lua_cb_data *cb, int n,
+                     const double *x, int xs, int xc,
+                     double *v, int vs, int vc) {
+  if (irep_cbprof <= 0) return cb_eval_batch(L, cb, n, x, xs, xc, v, vs, vc);
+  double m0 = cbp_mem(L, cb), t0 = cbp_now();
+  int errcnt = cb_eval_batch(L, cb, n, x, xs, xc, v, vs, vc);
+  if (errcnt >= 0) cbp_record(L, cb, n, t0, m0);
+  return errcnt;
+}
+
+int ir_cb_eval_array(lua_State *L, lua_cb_data *cb, int n,
+                     const double *x, int xs, int xc,
+                     double *v, int vs, int vc) {
+  if (irep_cbprof <= 0) return cb_eval_array(L, cb, n, x, xs, xc, v, vs, vc);
+  double m0 = cbp_mem(L, cb), t0 = cbp_now();
+  int errcnt = cb_eval_array(L, cb, n, x, xs, xc, v, vs, vc);
+  if (errcnt >= 0) cbp_record(L, cb, n, t0, m0);
+  return errcnt;
+}
+
+int ir_cb_eval_n(lua_State *L, lua_cb_data *cb, int nx, const double *x,
+                 int *nv, double *v) {
+  if (irep_cbprof <= 0) return cb_eval_n(L, cb, nx, x, nv, v);
+  double m0 = cbp_mem(L, cb), t0 = cbp_now();
+  int errcnt = cb_eval_n(L, cb, nx, x, nv, v);
+  if (errcnt >= 0) cbp_record(L, cb, 1, t0, m0);
+  return errcnt;
+}
+
+// Evaluate callback cb at one point: x[NPRM] in, v[NRET] out.
+int ir_cb_eval(lua_State *L, lua_cb_data *cb, const double *x, double *v) {
+  return ir_cb_eval_batch(L, cb, 1, x, 0, 1, v, 0, 1);
+}
+
+// Walk the callbacks and references under element ep.  With release set,
+// make them undefined, and free their Lua values in L (if L is not NULL);
+// else, copy their arena data to the arena's current blocks.  bp, ep, and
+// treat_as_scalar are as in iir_unread.  Returns the error count.
+static int arena_walk(lua_State *L, char *bp, ir_element *ep, int treat_as_scalar,
+                      int release) {
+  int i, errcnt = 0;
+
+  if (ep->typ == T_cbk) {
+    lua_cb_data *cb = (lua_cb_data *)bp;
+    if (release) {
+      if (L) ref_drop(L, cb->fref);
+      cb->fref = LUA_REFNIL;
+      cb->npnr = cb->base_npnr;
+      cb->data = NULL;
+      (void)arena_set_code(cb, NULL);
+      return 0;
+    }
+    if (cb->fref == LUA_NOREF && cb->data) {
+      cb->data = arena_dup(cb->data, ir_nret(cb->npnr) * sizeof(double));
+      errcnt += !cb->data;
+    } else cb->data = NULL;
+    const ir_cprog *p = (const ir_cprog *)arena_code(cb);
+    if (p) {
+      p = arena_cprog(p);
+      errcnt += !p;
+      (void)arena_set_code(cb, p);
+    }
+
+  } else if (ep->typ == T_ref) {
+    if (release) {
+      if (L) ref_drop(L, *(int *)bp);
+      *(int *)bp = LUA_REFNIL;
+    }
+
+  } else if (IR_SPARSE(ep)) {
+    ir_sparse *s = (ir_sparse *)bp;
+    ir_element e = sparse_elem(ep);
+    for (i=0; i < s->n; i++)
+      errcnt += arena_walk(L, SPARSE_ELEM(s,i), &e, 0, release);
+
+  } else if (ep->typ == T_tbl && ep->fub > 0 && !treat_as_scalar) {
+    for (i=ep->flb; i<=ep->fub; i++) // Array of structs.
+      errcnt += arena_walk(L, bp + (i - ep->flb)*ep->sz, ep, 1, release);
+
+  } else if (ep->typ == T_tbl) { // Scalar struct, or 1 element of an array.
+    ir_element *nep;
+    for (nep = ir_ta[ep->ti]; nep->name; nep++)
+      if (nep->typ == T_tbl || nep->typ == T_cbk || nep->typ == T_ref)
+        errcnt += arena_walk(L, bp + nep->off, nep, 0, release);
+  }
+  return errcnt;
+}
+
+// Make the callbacks and references under the element named by path t
+// undefined, as if they were not in the input, and free their Lua values
+// in L, which read them (or NULL, to leave L alone).  Their arena data is
+// freed by the next ir_reset_arena.  Returns the error count.
+int ir_release(lua_State *L, const char *t) {
+  ir_path *p = ir_path_compile(t);
+  if (!p) return 1;
+  char *bp = path_bp(p, 0);
+  if (bp) (void)arena_walk(L, bp, p->ep, path_scalar(p), 1);
+  ir_path_free(p);
+  return 0;
+}
+
+// Copy the data of every callback, and the names from
+// ir_get_function_name, to new arena blocks, in index order, and free the
+// old blocks.  Returns the error count; on error, the old blocks are kept.
+int ir_reset_arena(void) {
+  ir_block *old = arena.head, *b;
+  ir_aname *names;
+  size_t i, used = arena.used, namecap;
+  int errcnt = 0;
+
+  arena.head = NULL;
+  arena.used = 0;
+  for (i=0; i < ir_wktt_size; i++) // Updates the compiled code in place.
+    errcnt += arena_walk(NULL, (char *)ir_wktt[i].p, &ir_wktt[i].e, 0, 0);
+  names = arena.name;
+  namecap = arena.namecap;
+  arena.name = NULL;
+  arena.nname = arena.namecap = 0;
+  for (i=0; i < namecap; i++) {
+    const lua_cb_data *cb = (const lua_cb_data *)names[i].cb;
+    if (!cb || cb->fref == LUA_REFNIL) continue;
+    if (names[i].name) errcnt += !arena_name(cb, names[i].name);
+    if (names[i].code) errcnt += arena_set_code(cb, names[i].code);
+  }
+  free(names);
+
+  if (errcnt) { // Keep the old blocks, after the new ones.
+    for (b = arena.head; b && b->next; b = b->next) ;
+    if (b) b->next = old;
+    else arena.head = old;
+    arena.used += used;
+    return Ir_error("%s", "ir_reset_arena: out of memory");
+  }
+  while (old) {
+    b = old->next;
+    free(old);
+    old = b;
+  }
+  Dbg_print("ir_reset_arena: %lu bytes, was %lu", (unsigned long)arena.used,
+    (unsigned long)used);
+  return 0;
+}
+
+// Bytes of arena in use (including data left behind by new reads), and
+// (if high is not NULL) the most ever in use.
+size_t ir_arena_bytes(size_t *high) {
+  if (high) *high = arena.high;
+  return arena.used;
+}
+
+// A pool of lua_States, one per thread, for callback evaluation.  Each
+// state runs the same input deck; then the callbacks read from the host's
+// lua_State are mapped into it.  The function for callback cb is stored
+// in the state's IR_REFS table, at key cb->fref, so the ir_cb_eval
+// functions work unchanged with any state in the pool, and the state's
+// own registry (and luaL_ref) is left alone.  ir_reference values are
+// mapped the same way.
+struct ir_pool {
+  int n;            // Number of states.
+  lua_State **L;    // The states.
+};
+
+// Map the callbacks under one IREP element into the pool state L.  The
+// Lua value for the element (possibly nil) is at TOS, and the new IR_REFS
+// table at index 1.  bp, ep, and treat_as_scalar are as in iir_unread.
+static int pool_map(lua_State *L,const ir_crumb *c,void *bp,ir_element *ep, int treat_as_scalar) {
+  int i, errcnt = 0;
+
+  if (ep->typ == T_cbk) {
+    lua_cb_data *cb = (lua_cb_data *)bp;
+    if (cb->fref < 0) return 0; // Not read, or not a function.
+    if (lua_type(L,-1) != LUA_TFUNCTION)
+      return Ir_error("ir_pool: %s is not a function in the pool's input",
+        crumb_str(c));
+    lua_pushvalue(L,-1);
+    lua_rawseti(L, 1, cb->fref);
+    ir_set_function_name(L, crumb_str(c), bp);
+
+  } else if (ep->typ == T_ref) {
+    int ref = *((int *)bp);
+    if (ref < 0) return 0; // Not read, or nil.
+    if (lua_isnil(L,-1))
+      return Ir_error("ir_pool: %s is nil in the pool's input", crumb_str(c));
+    lua_pushvalue(L,-1);
+    lua_rawseti(L, 1, ref);
+
+  } else if (IR_SPARSE(ep)) {
+    ir_sparse *s = (ir_sparse *)bp;
+    ir_element e = sparse_elem(ep);
+    for (i=0; i < s->n; i++) {
+      ir_crumb nc = { c, 0, SPARSE_KEY(s,i) };
+      if (lua_istable(L,-1)) lua_rawgeti(L,-1,SPARSE_KEY(s,i));
+      else lua_pushnil(L);
+      errcnt += pool_map(L, &nc, SPARSE_ELEM(s,i), &e, 0);
+      lua_pop(L,1);
+    }
+
+  } else if (ep->typ == T_tbl && ep->fub > 0 && !treat_as_scalar) {
+    for (i=ep->flb; i<=ep->fub; i++) { // Array of structs.
+      ir_crumb nc = { c, 0, i };
+      if (lua_istable(L,-1)) lua_rawgeti(L,-1,i);
+      else lua_pushnil(L);
+      errcnt += pool_map(L, &nc, bp + (i - ep->flb)*ep->sz, ep, 1);
+      lua_pop(L,1);
+    }
+
+  } else if (ep->typ == T_tbl) { // Scalar struct, or 1 element of an array.
+    ir_element *nep;
+    for (nep = ir_ta[ep->ti]; nep->name; nep++) {
+      if (nep->typ != T_tbl && nep->typ != T_cbk && nep->typ != T_ref) continue;
+      ir_crumb nc = { c, nep->name, 0 };
+      if (lua_istable(L,-1)) lua_getfield(L,-1,nep->name);
+      else lua_pushnil(L);
+      errcnt += pool_map(L, &nc, bp + nep->off, nep, 0);
+      lua_pop(L,1);
+    }
+  }
+  return errcnt;
+}
+
+// (Re-)map every callback read so far into each state of the pool.  Call
+// this again after reading callbacks again: the mapping is replaced.
+// Returns the error count.
+int ir_pool_sync(ir_pool *p) {
+  int k, errcnt = 0;
+  size_t i;
+  if (!p) return Ir_error("%s", "ir_pool_sync: NULL pool");
+  for (k=0; k < p->n; k++) {
+    lua_State *L = p->L[k];
+    lua_settop(L,0);
+    lua_newtable(L);
+    lua_pushvalue(L,1);
+    lua_setfield(L, LUA_REGISTRYINDEX, IR_REFS);
+    for (i=0; i < ir_wktt_size; i++) {
+      ir_wkt_desc *w = &ir_wktt[i];
+      ir_crumb c = { 0, w->e.name, 0 };
+      lua_getglobal(L, w->e.name);
+      errcnt += pool_map(L, &c, w->p, &w->e, 0);
+      lua_settop(L,1);
+    }
+    lua_settop(L,0);
+  }
+  return errcnt;
+}
+
+// Release a pool from ir_pool_create.  A NULL pool is ignored.
+void ir_pool_free(ir_pool *p) {
+  int k;
+  if (!p) return;
+  for (k=0; k < p->n; k++) if (p->L[k]) lua_close(p->L[k]);
+  free(p->L);
+  free(p);
+}
+
+// Create a pool of n lua_States, run the input deck file in each one, and
+// map the callbacks read from the host's lua_State into them.  If file is
+// NULL or "", the states only have the standard libraries, and nothing is
+// mapped: the host can set them up with ir_pool_state, then call
+// ir_pool_sync.  Returns NULL on error.
+ir_pool *ir_pool_create(int n, const char *file) {
+  int k;
+  ir_pool *p = (ir_pool *)calloc(1, sizeof *p);
+  if (!p || n < 1 || !(p->L = (lua_State **)calloc(n, sizeof *p->L))) {
+    free(p);
+    (void)Ir_error("ir_pool_create: cannot allocate %d states", n);
+    return NULL;
+  }
+  p->n = n;
+  for (k=0; k < n; k++) {
+    lua_State *L = p->L[k] = luaL_newstate();
+    if (!L) {
+      ir_pool_free(p);
+      (void)Ir_error("ir_pool_create: cannot allocate %d states", n);
+      return NULL;
+    }
+    luaL_openlibs(L);
+    lua_newtable(L); // Nothing mapped yet.
+    lua_setfield(L, LUA_REGISTRYINDEX, IR_REFS);
+    if (file && *file && (luaL_loadfile(L, file) || lua_pcall(L, 0, 0, 0))) {
+      (void)Ir_error("ir_pool_create: %s", lua_tostring(L,-1));
+      ir_pool_free(p);
+      return NULL;
+    }
+  }
+  if (file && *file && ir_pool_sync(p)) {
+    ir_pool_free(p);
+    return NULL;
+  }
+  return p;
+}
+
+// Return state i (0 <= i < n) of the pool, typically for thread i.
+lua_State *ir_pool_state(ir_pool *p, int i) {
+  return (p && i >= 0 && i < p->n) ? p->L[i] : NULL;
+}
+
+// Tabulated callbacks.  ir_cb_tabulate samples a 1-D or 2-D callback on
+// a tensor-product grid that starts uniform.  Each pass checks the
+// interpolated values against samples at the midpoints of the intervals
+// (and, in 2-D, at cell centers), and halves only the intervals where the
+// error exceeds the tolerance, so the breakpoints end up non-uniform,
+// closer together where the callback is harder to interpolate.  The
+// table is interpolated with cubic Hermite polynomials (bicubic in 2-D)
+// whose slopes are those of the quartic through each breakpoint and two
+// neighbors on each side.  The slopes are accurate enough that the
+// interpolation error is largest near the midpoints, where it is checked.
+// Evaluation finds the interval by binary search.
+
+#define IR_TAB_MINPTS 17        // Initial points per dimension.
+#define IR_TAB_MAXPTS (1<<22)   // Limit on the number of grid points.
+
+struct ir_cb_table {
+  int ndim;           // 1 or 2.
+  int n[2];           // Breakpoints in x and y (n[1] is 1 in 1-D).
+  double lo[2];       // Domain.
+  double hi[2];
+  int policy;         // For points outside the domain: IR_TAB_*.
+  double maxerr;      // Largest error found at the final check points.
+  lua_cb_data *cb;    // The callback, for policy IR_TAB_LUA.
+  double *x[2];       // Breakpoints in x and y (x[1] is NULL in 1-D).
+  double *f;          // n[0] x n[1] values, x fastest, followed by their
+                      // d/dx and, in 2-D, d/dy and d2/dxdy.  x[0], x[1]
+                      // and f share one allocation.
+};
+
+// A table with n0 x n1 breakpoints, with nothing filled in.
+static ir_cb_table *tab_new(int ndim, int n0, int n1) {
+  size_t n = (size_t)n0*n1, nx = n0 + (ndim == 2 ? n1 : 0);
+  ir_cb_table *t = (ir_cb_table *)calloc(1, sizeof *t);
+  if (!t) return NULL;
+  t->x[0] = (double *)malloc((nx + n*(ndim == 2 ? 4 : 2)) * sizeof *t->x[0]);
+  if (!t->x[0]) {
+    free(t);
+    return NULL;
+  }
+  t->x[1] = (ndim == 2) ? t->x[0] + n0 : NULL;
+  t->f = t->x[0] + nx;
+  t->ndim = ndim;
+  t->n[0] = n0;
+  t->n[1] = n1;
+  return t;
+}
+
+// Derivative at x[k] of the quartic through points k-2..k+2 of the n
+// points (x[i], g[i*d]), or through the five points nearest the end
+// within two points of it.
+static double tab_slope(const double *x, const double *g, int n, int d, int k) {
+  int a = k-2, l, m;
+  double e = x[k], sum = 0.0, dk = 0.0;
+  a = (a > 0) ? a : 0;
+  a = (a < n-5) ? a : n-5;
+  for (m=a; m < a+5; m++) {
+    if (m == k) continue;
+    double w = 1.0 / (x[m] - e);
+    for (l=a; l < a+5; l++)
+      if (l != m && l != k) w *= (e - x[l]) / (x[m] - x[l]);
+    sum += w * g[(size_t)m*d];
+    dk -= 1.0 / (x[m] - e);
+  }
+  return sum + dk * g[(size_t)k*d];
+}
+
+// Fill in the slopes of table t from its values.
+static void tab_slopes(ir_cb_table *t) {
+  int i, j, n0 = t->n[0], n1 = t->n[1];
+  size_t n = (size_t)n0*n1;
+  double *f = t->f, *fx = f + n;
+
+  for (j=0; j < n1; j++)
+    for (i=0; i < n0; i++)
+      fx[(size_t)j*n0+i] = tab_slope(t->x[0], f + (size_t)j*n0, n0, 1, i);
+  if (t->ndim == 1) return;
+  for (j=0; j < n1; j++) {
+    for (i=0; i < n0; i++) {
+      f[2*n + (size_t)j*n0+i] = tab_slope(t->x[1], f + i, n1, n0, j);
+      f[3*n + (size_t)j*n0+i] = tab_slope(t->x[1], fx + i, n1, n0, j);
+    }
+  }
+}
+
+// Cubic Hermite interpolation between values p1 and p2, with slopes m1
+// and m2, over an interval of length h, at s in [0,1].
+static double tab_herm(double p1, double m1, double p2, double m2,
+                       double h, double s) {
+  double r = 1.0 - s;
+  return r*r*((1.0 + 2.0*s)*p1 + s*h*m1) + s*s*((3.0 - 2.0*s)*p2 - r*h*m2);
+}
+
+// Interpolate table t in cell (i,j), at fractions s and sy of the way
+// across it in x and y (j and sy are ignored in 1-D).
+static double tab_cell(const ir_cb_table *t, int i, int j, double s, double sy) {
+  size_t n = (size_t)t->n[0]*t->n[1], k = (size_t)j*t->n[0] + i, k1;
+  const double *f = t->f, *fx = f + n, *fy = f + 2*n, *fxy = f + 3*n;
+  double h = t->x[0][i+1] - t->x[0][i];
+  double v = tab_herm(f[k], fx[k], f[k+1], fx[k+1], h, s);
+
+  if (t->ndim == 1) return v;
+  k1 = k + t->n[0];
+  return tab_herm(v, tab_herm(fy[k], fxy[k], fy[k+1], fxy[k+1], h, s),
+                  tab_herm(f[k1], fx[k1], f[k1+1], fx[k1+1], h, s),
+                  tab_herm(fy[k1], fxy[k1], fy[k1+1], fxy[k1+1], h, s),
+                  t->x[1][j+1] - t->x[1][j], sy);
+}
+
+// The interval of the n breakpoints x that contains u, after clamping u
+// to x[0]..x[n-1] (NaN is clamped to x[0]), and in *s the fraction of the
+// way across the interval.
+static int tab_find(const double *x, int n, double u, double *s) {
+  int a = 0, b = n-1;
+  u = (u > x[0]) ? u : x[0];
+  u = (u < x[n-1]) ? u : x[n-1];
+  while (b - a > 1) {
+    int m = (a + b) / 2;
+    if (u < x[m]) b = m;
+    else a = m;
+  }
+  *s = (u - x[a]) / (x[a+1] - x[a]);
+  return a;
+}
+
+// Error of interpolated value p against sampled value f: absolute for
+// |f| < 1, relative otherwise.
+static double tab_err(double p, double f) {
+  double e = fabs(p - f) / (fabs(f) > 1.0 ? fabs(f) : 1.0);
+  return (e == e) ? e : HUGE_VAL;
+}
+
+// Sample callback cb over the domain lo..hi (ndim values each), refining
+// until the interpolation error is at most tol.  Returns NULL on error.
+//
+// The samples are kept on the "doubled" grid of the breakpoints and the
+// midpoints between them: X[d] has the 2*n[d]-1 coordinates in dimension
+// d (just 0 in y in 1-D), and g the samples at the NX x NY points.  A
+// split interval adds its quarter points to X[d], so each pass samples
+// only the new points.
+ir_cb_table *ir_cb_tabulate(lua_State *L, lua_cb_data *cb, int ndim,
+                            const double *lo, const double *hi,
+                            double tol, int policy) {
+  int i, j, d, N[2], n[2], nsplit[2];
+  double *X[2] = {NULL, NULL}, *g = NULL, *pts = NULL;
+  char *split[2] = {NULL, NULL};
+  int *map[2] = {NULL, NULL};
+  double err = 0.0;
+  ir_cb_table *t = NULL;
+
+  if (ndim != 1 && ndim != 2) {
+    (void)Ir_error("ir_cb_tabulate: ndim must be 1 or 2, not %d", ndim);
+    return NULL;
+  }
+  if (cb->fref == LUA_REFNIL) {
+    (void)Ir_error("%s", "ir_cb_tabulate: callback is not defined");
+    return NULL;
+  }
+  if (ir_nprm(cb->npnr) != ndim || ir_nret(cb->npnr) != 1) {
+    (void)Ir_error("ir_cb_tabulate: callback must have NPRM=%d, NRET=1", ndim);
+    return NULL;
+  }
+  for (i=0; i < ndim; i++)
+    if (!(hi[i] > lo[i])) {
+      (void)Ir_error("%s", "ir_cb_tabulate: empty domain");
+      return NULL;
+    }
+  if (!(tol > 0.0)) {
+    (void)Ir_error("%s", "ir_cb_tabulate: tol must be > 0");
+    return NULL;
+  }
+  if (policy < IR_TAB_CLAMP || policy > IR_TAB_LUA) {
+    (void)Ir_error("ir_cb_tabulate: bad policy %d", policy);
+    return NULL;
+  }
+
+  // Start with a uniform grid.
+  for (d=0; d < 2; d++) {
+    N[d] = (d < ndim) ? 2*IR_TAB_MINPTS-1 : 1;
+    if (!(X[d] = (double *)malloc(N[d] * sizeof *X[d]))) goto nomem;
+    for (i=0; i < N[d]; i++)
+      X[d][i] = (d < ndim) ? lo[d] + (hi[d]-lo[d])*i/(N[d]-1) : 0.0;
+  }
+  g = (double *)malloc((size_t)N[0]*N[1] * sizeof *g);
+  pts = (double *)malloc((size_t)N[0]*N[1]*2 * sizeof *pts);
+  if (!g || !pts) goto nomem;
+  for (j=0; j < N[1]; j++) {
+    for (i=0; i < N[0]; i++) {
+      pts[2*((size_t)j*N[0]+i)]   = X[0][i];
+      pts[2*((size_t)j*N[0]+i)+1] = X[1][j];
+    }
+  }
+  if (ir_cb_eval_batch(L, cb, N[0]*N[1], pts, 2, 1, g, 1, 1)) goto fail;
+
+  for (;;) {
+    int NN[2], np = 0;
+    double *ng;
+
+    // Interpolate from the breakpoints.
+    n[0] = (N[0]+1)/2;
+    n[1] = (N[1]+1)/2;
+    ir_cb_table_free(t);
+    if (!(t = tab_new(ndim, n[0], n[1]))) goto nomem;
+    for (d=0; d < ndim; d++)
+      for (i=0; i < n[d]; i++) t->x[d][i] = X[d][2*i];
+    for (j=0; j < n[1]; j++)
+      for (i=0; i < n[0]; i++)
+        t->f[(size_t)j*n[0]+i] = g[(size_t)2*j*N[0] + 2*i];
+    tab_slopes(t);
+
+    // Compare with the samples at the other points of the doubled grid.
+    // An x (y) interval is split if the error at one of its midpoints is
+    // too large, and both intervals of a cell if the error at its center
+    // is too large and neither is split already.
+    for (d=0; d < 2; d++) {
+      free(split[d]);
+      if (!(split[d] = (char *)calloc(n[d], 1))) goto nomem;
+    }
+    err = 0.0;
+    for (int pass=0; pass < 2; pass++) {
+      for (j=0; j < N[1]; j++) {
+        for (i=0; i < N[0]; i++) {
+          int ci = i/2, cj = j/2;
+          double s = 0.5*(i%2), sy = 0.5*(j%2), e;
+          if ((i%2 && j%2) != pass || (i%2 == 0 && j%2 == 0)) continue;
+          if (ci == n[0]-1) { ci--; s = 1.0; }
+          if (ndim == 2 && cj == n[1]-1) { cj--; sy = 1.0; }
+          e = tab_err(tab_cell(t, ci, cj, s, sy), g[(size_t)j*N[0]+i]);
+          err = fmax(err, e);
+          if (!(e > tol)) continue;
+          if (!pass) {
+            split[0][ci] |= i%2;
+            split[1][cj] |= j%2;
+          } else if (!split[0][ci] && !split[1][cj]) {
+            split[0][ci] = split[1][cj] = 1;
+          }
+        }
+      }
+    }
+    for (d=0; d < 2; d++)
+      for (nsplit[d]=i=0; i < n[d]-1; i++) nsplit[d] += split[d][i];
+    Dbg_print("ir_cb_tabulate: %d x %d points: error %g, split %d x %d",
+              n[0], n[1], err, nsplit[0], nsplit[1]);
+    if (!nsplit[0] && !nsplit[1]) break;
+    if ((double)(n[0]+nsplit[0])*(n[1]+nsplit[1]) > IR_TAB_MAXPTS) {
+      (void)Ir_error("ir_cb_tabulate: tolerance %g not met with %d points "
+        "(error %g)", tol, n[0]*n[1], err);
+      goto fail;
+    }
+
+    // Add the quarter points of the split intervals.  map[d][i] is the
+    // old index of new coordinate i, or -1 for a quarter point.
+    for (d=0; d < 2; d++) {
+      double *nx;
+      NN[d] = N[d] + 2*nsplit[d];
+      nx = (double *)malloc(NN[d] * sizeof *nx);
+      free(map[d]);
+      map[d] = (int *)malloc(NN[d] * sizeof *map[d]);
+      if (!nx || !map[d]) {
+        free(nx);
+        goto nomem;
+      }
+      int k = 0;
+      for (i=0; i < N[d]; i++) {
+        if (i%2 && split[d][i/2]) {
+          double q1 = 0.5*(X[d][i-1] + X[d][i]), q3 = 0.5*(X[d][i] + X[d][i+1]);
+          if (!(q1 > X[d][i-1] && q1 < X[d][i] && q3 > X[d][i] && q3 < X[d][i+1])) {
+            (void)Ir_error("ir_cb_tabulate: tolerance %g not met: interval at "
+              "%g is too small (error %g)", tol, X[d][i], err);
+            free(nx);
+            goto fail;
+          }
+          map[d][k] = -1;
+          nx[k++] = q1;
+          map[d][k] = i;
+          nx[k++] = X[d][i];
+          map[d][k] = -1;
+          nx[k++] = q3;
+        } else {
+          map[d][k] = i;
+          nx[k++] = X[d][i];
+        }
+      }
+      free(X[d]);
+      X[d] = nx;
+    }
+
+    // Copy the old samples, and sample the new points.
+    free(pts);
+    ng = (double *)malloc((size_t)NN[0]*NN[1] * sizeof *ng);
+    pts = (double *)malloc(((size_t)NN[0]*NN[1] - (size_t)N[0]*N[1])*2 * sizeof *pts);
+    if (!ng || !pts) {
+      free(ng);
+      pts = NULL;
+      goto nomem;
+    }
+    for (j=0; j < NN[1]; j++) {
+      for (i=0; i < NN[0]; i++) {
+        if (map[0][i] >= 0 && map[1][j] >= 0) {
+          ng[(size_t)j*NN[0]+i] = g[(size_t)map[1][j]*N[0] + map[0][i]];
+        } else {
+          pts[2*(size_t)np]   = X[0][i];
+          pts[2*(size_t)np+1] = X[1][j];
+          np++;
+        }
+      }
+    }
+    free(g);
+    g = ng;
+    ng = (double *)malloc((size_t)np * sizeof *ng);
+    if (!ng) goto nomem;
+    if (ir_cb_eval_batch(L, cb, np, pts, 2, 1, ng, 1, 1)) {
+      free(ng);
+      goto fail;
+    }
+    np = 0;
+    for (j=0; j < NN[1]; j++)
+      for (i=0; i < NN[0]; i++)
+        if (map[0][i] < 0 || map[1][j] < 0) g[(size_t)j*NN[0]+i] = ng[np++];
+    free(ng);
+    N[0] = NN[0];
+    N[1] = NN[1];
+  }
+
+  for (i=0; i < 2; i++) {
+    t->lo[i] = (i < ndim) ? lo[i] : 0.0;
+    t->hi[i] = (i < ndim) ? hi[i] : 0.0;
+  }
+  t->policy = policy;
+  t->maxerr = err;
+  t->cb = cb;
+  for (d=0; d < 2; d++) {
+    free(X[d]); free(split[d]); free(map[d]);
+  }
+  free(g); free(pts);
+  return t;
+
+nomem:
+  (void)Ir_error("%s", "ir_cb_tabulate: malloc failed");
+fail:
+  ir_cb_table_free(t);
+  for (d=0; d < 2; d++) {
+    free(X[d]); free(split[d]); free(map[d]);
+  }
+  free(g); free(pts);
+  return NULL;
+}
+
+// Release a table from ir_cb_tabulate.  A NULL table is ignored.
+void ir_cb_table_free(ir_cb_table *t) {
+  if (!t) return;
+  free(t->x[0]);
+  free(t);
+}
+
+// The largest interpolation error found by ir_cb_tabulate.
+double ir_cb_table_error(const ir_cb_table *t) { return t->maxerr; }
+
+// Memory used by a table, in bytes.
+size_t ir_cb_table_bytes(const ir_cb_table *t) {
+  size_t n = (size_t)t->n[0]*t->n[1];
+  return sizeof *t + (t->n[0] + (t->ndim == 2 ? t->n[1] + 4*n : 2*n)) * sizeof *t->f;
+}
+
+// Evaluate table t at n points, with strides as in ir_cb_eval_batch (the
+// table has one return value, so there is no vc).  Points outside the
+// domain are handled according to t's policy; L is only used for
+// IR_TAB_LUA, and may be NULL otherwise.  Returns the error count.
+int ir_cb_table_eval(lua_State *L, const ir_cb_table *t, int n,
+                     const double *x, int xs, int xc, double *v, int vs) {
+  int i, nout = 0, errcnt = 0;
+
+  // Points outside the domain get the value at the nearest boundary
+  // point, since tab_find clamps.
+  for (i=0; i < n; i++) {
+    const double *xi = x + (ptrdiff_t)i*xs;
+    double s, sy = 0.0;
+    int k = tab_find(t->x[0], t->n[0], xi[0], &s);
+    int ky = (t->ndim == 2) ? tab_find(t->x[1], t->n[1], xi[xc], &sy) : 0;
+    v[(ptrdiff_t)i*vs] = tab_cell(t, k, ky, s, sy);
+  }
+  if (t->policy == IR_TAB_CLAMP) return 0;
+
+  // Find and handle points outside the domain.
+  for (i=0; i < n; i++) {
+    const double *xi = x + (ptrdiff_t)i*xs;
+    int in = (xi[0] >= t->lo[0] && xi[0] <= t->hi[0]);
+    if (t->ndim == 2) in = in && (xi[xc] >= t->lo[1] && xi[xc] <= t->hi[1]);
+    if (in) continue;
+    nout++;
+    if (t->policy == IR_TAB_LUA)
+      errcnt += ir_cb_eval_batch(L, t->cb, 1, xi, 0, xc, v + (ptrdiff_t)i*vs, 0, 1);
+    else
+      v[(ptrdiff_t)i*vs] = NAN;
+  }
+  if (nout && t->policy == IR_TAB_ERROR) {
+    (void)Ir_error("ir_cb_table_eval: %d of %d points outside the table", nout, n);
+    errcnt = nout;
+  }
+  return errcnt;
+}
+
+// Snapshots.  ir_pack packs well-known tables into a buffer, and
+// ir_unpack copies them back into the tables, e.g., after the buffer was
+// broadcast to other processes; ir_save and ir_load do the same with a
+// file.  Each table is packed as a section: a header, the table's schema
+// (one line per element, from the ir_ta index), an image of the table's
+// memory, and then one record per callback or reference, in index order.
+// Callbacks with constant data are stored in their records.  Lua values
+// (functions, as bytecode, and the values of references) are stored too
+// if a lua_State is given to ir_pack.  ir_save given a lua_State writes
+// them to a sidecar file instead, one record each, in the same order;
+// without one (or without the sidecar) they are bound again from the Lua
+// value at the same path when the table is loaded: that needs the input
+// to have been run, but not ir_read.  ir_ptr elements are neither saved
+// nor changed.
+
+#define IR_SNAP_VERSION 1
+
+typedef struct {
+  char magic[8];        // "IREPSNAP"
+  uint32_t version;     // IR_SNAP_VERSION
+  uint32_t endian;      // 0x01020304, as written.
+  uint64_t hash;        // Hash of the schema.
+  uint64_t schema_len;  // Bytes of schema text that follow this header.
+  uint64_t image_len;   // Bytes of table image that follow the schema.
+  uint64_t rec_len;     // Bytes of records that follow the image.
+} ir_snap_header;
+
+// Record kinds, other than LUA_REFNIL and LUA_NOREF.
+#define SNAP_BIND  0    // Bind the Lua value at the same path (or the sidecar's) again.
+#define SNAP_VALUE 1    // A Lua value follows.
+
+// One record per callback or reference.  For LUA_NOREF, n doubles of
+// data follow; for SNAP_VALUE, n bytes of Lua value, and then ncode
+// instructions of compiled code (with its nprm and nret) if the callback
+// was compiled.  (The record for a runtime-sized vector is just its
+// length, an int, and then its elements; see snap_get_sparse for a sparse
+// vector.)
+typedef struct {
+  int kind;
+  int npnr;
+  int base_npnr;
+  int n;
+  int ncode;
+} ir_snap_rec;
+
+// A growing buffer, for packing.  err is set if realloc fails.
+typedef struct {
+  char *p;
+  size_t n, cap;
+  int err;
+} ir_sbuf;
+
+static void sbuf_put(ir_sbuf *b, const void *d, size_t n) {
+  if (b->err) return;
+  if (b->n + n > b->cap) {
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < b->n + n) cap *= 2;
+    char *p = (char *)realloc(b->p, cap);
+    if (!p) {
+      b->err = 1;
+      return;
+    }
+    b->p = p;
+    b->cap = cap;
+  }
+  memcpy(b->p + b->n, d, n);
+  b->n += n;
+}
+
+// A cursor, for unpacking.  Returns the next n bytes, or NULL.
+typedef struct {
+  const char *p;
+  size_t n, pos;
+} ir_scur;
+
+static const char *scur_get(ir_scur *c, size_t n) {
+  const char *d = c->p + c->pos;
+  if (n > c->n - c->pos) return NULL;
+  c->pos += n;
+  return d;
+}
+
+static int scur_read(ir_scur *c, void *d, size_t n) {
+  const char *s = scur_get(c, n);
+  if (s) memcpy(d, s, n);
+  return s == NULL;
+}
+
+// State for a walk over a table, to pack or unpack it.
+typedef struct {
+  const char *who;    // The IREP function, for messages.
+  int unpack;
+  lua_State *L;       // Or NULL.
+  ir_sbuf *b;         // Packing: the buffer.
+  ir_scur *cur;       // Unpacking: the records,
+  const char *base;   // the table,
+  const char *img;    // and its image.
+  int freeze;         // For ir_freeze: see snap_put_value.
+  ir_sbuf *vb;        // ir_save: the sidecar, for Lua values (or NULL).
+  ir_scur *vcur;      // ir_load: its records (or NULL).
+} ir_snap;
+
+static int snap_writer(lua_State *L, const void *p, size_t sz, void *ud) {
+  (void)L;
+  sbuf_put((ir_sbuf *)ud, p, sz);
+  return ((ir_sbuf *)ud)->err;
+}
+
+// The standard libraries, whose C functions ir_freeze packs by name.
+static const char *snap_libs[] = { "_G", "string", "table", "math", "os",
+  "io", "coroutine", "package", "debug", 0 };
+
+// If the value at (absolute) index idx is a C function from the standard
+// libraries, store its name, such as "math.sin", in name, and return 1.
+static int snap_cfunc(lua_State *L, int idx, char *name, size_t n) {
+  int i, found = 0;
+  for (i=0; snap_libs[i] && !found; i++) {
+    lua_getglobal(L, snap_libs[i]);
+    if (lua_istable(L,-1)) {
+      for (lua_pushnil(L); !found && lua_next(L,-2); lua_pop(L,1)) {
+        if (lua_type(L,-2) == LUA_TSTRING && lua_rawequal(L,-1,idx)) {
+          (void)snprintf(name, n, "%s.%s", snap_libs[i], lua_tostring(L,-2));
+          found = 1;
+          lua_pop(L,1);
+        }
+      }
+    }
+    lua_pop(L,1);
+  }
+  return found;
+}
+
+// Pack the Lua value at index idx: nil, a boolean, number, or string, a
+// Lua function without upvalues (as bytecode), or a table of these.  If
+// s->freeze is set, a function with upvalues is packed too, followed by
+// a copy of each upvalue, and so is a C function from the standard
+// libraries, by its name.
+static int snap_put_value(ir_snap *s, const ir_crumb *c, int idx, int depth) {
+  lua_State *L = s->L;
+  int tv = lua_type(L, idx), errcnt = 0;
+  char tag = 'n';
+  uint32_t len;
+  size_t at;
+
+  if (depth > 64)
+    return Ir_error("%s: %s: value is nested too deeply", s->who, crumb_str(c));
+  switch (tv) {
+  case LUA_TNIL:
+    sbuf_put(s->b, &tag, 1);
+    break;
+  case LUA_TBOOLEAN: {
+    char v = (char)lua_toboolean(L, idx);
+    tag = 'b';
+    sbuf_put(s->b, &tag, 1);
+    sbuf_put(s->b, &v, 1);
+    break;
+  }
+  case LUA_TNUMBER: {
+    double v = lua_tonumber(L, idx);
+    tag = 'd';
+    sbuf_put(s->b, &tag, 1);
+    sbuf_put(s->b, &v, sizeof v);
+    break;
+  }
+  case LUA_TSTRING: {
+    size_t n;
+    const char *v = lua_tolstring(L, idx, &n);
+    tag = 's';
+    len = (uint32_t)n;
+    sbuf_put(s->b, &tag, 1);
+    sbuf_put(s->b, &len, sizeof len);
+    sbuf_put(s->b, v, n);
+    break;
+  }
+  case LUA_TFUNCTION: {
+    lua_Debug ar;
+    lua_pushvalue(L, idx);
+    lua_getinfo(L, ">Su", &ar);
+    if (ar.what[0] == 'C' && s->freeze) {
+      char name[256];
+      if (!snap_cfunc(L, idx, name, sizeof name))
+        return Ir_error("%s: %s: cannot pack a C function that is not in the "
+          "standard libraries", s->who, crumb_str(c));
+      tag = 'c';
+      len = (uint32_t)strlen(name);
+      sbuf_put(s->b, &tag, 1);
+      sbuf_put(s->b, &len, sizeof len);
+      sbuf_put(s->b, name, len);
+      break;
+    }
+    if (ar.what[0] == 'C' || (ar.nups > 0 && !s->freeze))
+      return Ir_error("%s: %s: cannot pack a C function, or a function with "
+        "upvalues", s->who, crumb_str(c));
+    tag = (ar.nups > 0) ? 'u' : 'f';
+    len = 0;
+    sbuf_put(s->b, &tag, 1);
+    at = s->b->n;
+    sbuf_put(s->b, &len, sizeof len);
+    lua_pushvalue(L, idx);
+    (void)lua_dump(L, snap_writer, s->b);
+    lua_pop(L, 1);
+    if (!s->b->err) {
+      len = (uint32_t)(s->b->n - at - sizeof len);
+      memcpy(s->b->p + at, &len, sizeof len);
+    }
+    if (tag == 'u') {
+      int i;
+      len = (uint32_t)ar.nups;
+      sbuf_put(s->b, &len, sizeof len);
+      for (i=1; i <= ar.nups; i++) {
+        (void)lua_getupvalue(L, idx, i);
+        errcnt = snap_put_value(s, c, lua_gettop(L), depth+1);
+        lua_pop(L, 1);
+        if (errcnt) return errcnt;
+      }
+    }
+    break;
+  }
+  case LUA_TTABLE:
+    tag = 't';
+    sbuf_put(s->b, &tag, 1);
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+      int top = lua_gettop(L);
+      errcnt += snap_put_value(s, c, top-1, depth+1);
+      errcnt += snap_put_value(s, c, top, depth+1);
+      lua_pop(L, 1);
+      if (errcnt) {
+        lua_pop(L, 1);
+        return errcnt;
+      }
+    }
+    tag = 'e';
+    sbuf_put(s->b, &tag, 1);
+    break;
+  default:
+    return Ir_error("%s: %s: cannot pack a Lua %s", s->who, crumb_str(c),
+      lua_typename(L, tv));
+  }
+  return 0;
+}
+
+// Unpack a Lua value packed by snap_put_value, and push it.  On error,
+// nothing is pushed.
+static int snap_get_value(ir_snap *s, const ir_crumb *c, int depth) {
+  lua_State *L = s->L;
+  const char *d = scur_get(s->cur, 1);
+  uint32_t len;
+
+  if (!d || depth > 64) goto bad;
+  switch (*d) {
+  case 'n':
+    lua_pushnil(L);
+    break;
+  case 'b':
+    if (!(d = scur_get(s->cur, 1))) goto bad;
+    lua_pushboolean(L, *d);
+    break;
+  case 'd': {
+    double v;
+    if (scur_read(s->cur, &v, sizeof v)) goto bad;
+    lua_pushnumber(L, v);
+    break;
+  }
+  case 's':
+    if (scur_read(s->cur, &len, sizeof len) || !(d = scur_get(s->cur, len))) goto bad;
+    lua_pushlstring(L, d, len);
+    break;
+  case 'c': { // A C function, by name: "lib.name".
+    char name[256];
+    const char *dot;
+    if (scur_read(s->cur, &len, sizeof len) || len >= sizeof name ||
+        !(d = scur_get(s->cur, len))) goto bad;
+    memcpy(name, d, len);
+    name[len] = '\0';
+    if (!(dot = strchr(name, '.'))) goto bad;
+    name[dot - name] = '\0';
+    lua_getglobal(L, name);
+    if (!lua_istable(L,-1)) {
+      lua_pop(L,1);
+      goto bad;
+    }
+    lua_getfield(L, -1, dot+1);
+    lua_remove(L, -2);
+    if (!lua_iscfunction(L,-1)) {
+      lua_pop(L,1);
+      goto bad;
+    }
+    break;
+  }
+  case 'f':
+  case 'u': {
+    char tag = *d;
+    uint32_t i, nups = 0;
+    if (scur_read(s->cur, &len, sizeof len) || !(d = scur_get(s->cur, len))) goto bad;
+    if (luaL_loadbuffer(L, d, len, crumb_str(c)) != 0) {
+      int errcnt = (Ir_error("%s: %s: %s", s->who, crumb_str(c), lua_tostring(L,-1)));
+      lua_pop(L, 1);
+      return errcnt;
+    }
+    if (tag == 'u' && scur_read(s->cur, &nups, sizeof nups)) {
+      lua_pop(L, 1);
+      goto bad;
+    }
+    for (i=1; i <= nups; i++) {
+      if (snap_get_value(s, c, depth+1)) {
+        lua_pop(L, 1);
+        return 1;
+      }
+      if (!lua_setupvalue(L, -2, (int)i)) lua_pop(L, 1);
+    }
+    break;
+  }
+  case 't':
+    lua_newtable(L);
+    while (s->cur->pos < s->cur->n && s->cur->p[s->cur->pos] != 'e') {
+      if (snap_get_value(s, c, depth+1)) {
+        lua_pop(L, 1);
+        return 1;
+      }
+      if (snap_get_value(s, c, depth+1)) {
+        lua_pop(L, 2);
+        return 1;
+      }
+      if (lua_isnil(L, -2)) goto bad_key;
+      lua_rawset(L, -3);
+    }
+    if (!scur_get(s->cur, 1)) {
+      lua_pop(L, 1);
+      goto bad;
+    }
+    break;
+  default:
+    goto bad;
+  }
+  return 0;
+
+bad_key:
+  lua_pop(L, 3);
+bad:
+  return Ir_error("%s: %s: bad Lua value in snapshot", s->who, crumb_str(c));
+}
+
+// Format the schema line for element ep at the given path into buf, as
+// snprintf does.  Returns the length of the whole line.
+static int schema_line(char *buf, size_t size, const char *path, const ir_element *ep) {
+  char dims[32] = "";
+  if (ep->n1 > 0) // Only for Vir2_ and Vir3_, so other schemas are unchanged.
+    (void)snprintf(dims, sizeof dims, " %d %d", ep->n1, ep->n2);
+  return snprintf(buf, size, "%s %d %lu %lu %d %d %d%s\n", path, ep->typ,
+    (unsigned long)ep->sz, (unsigned long)ep->off, ep->len, ep->flb, ep->fub, dims);
+}
+
+// Append a line to the schema text *s (of length *n), for element ep at
+// the given path, and for its elements.  Returns 0, or 1 if out of memory.
+static int snap_schema(char **s, size_t *n, const char *path, ir_element *ep) {
+  int len = schema_line(NULL, 0, path, ep);
+  char *ns = (len < 0) ? NULL : (char *)realloc(*s, *n + len + 1);
+  if (!ns) return 1;
+  (void)schema_line(ns + *n, (size_t)len + 1, path, ep);
+  *s = ns;
+  *n += len;
+  if (ep->typ == T_tbl) {
+    ir_element *nep;
+    size_t plen = strlen(path);
+    for (nep = ir_ta[ep->ti]; nep->name; nep++) {
+      char *npath = (char *)malloc(plen + strlen(nep->name) + 2);
+      int errcnt;
+      if (!npath) return 1;
+      (void)sprintf(npath, "%s.%s", path, nep->name);
+      errcnt = snap_schema(s, n, npath, nep);
+      free(npath);
+      if (errcnt) return 1;
+    }
+  }
+  return 0;
+}
+
+// Schema text for well-known table w, or NULL.  Sets *n to its length.
+static char *snap_schema_text(ir_wkt_desc *w, size_t *n) {
+  char *s = NULL;
+  *n = 0;
+  if (snap_schema(&s, n, w->e.name, &w->e)) {
+    free(s);
+    return NULL;
+  }
+  return s;
+}
+
+// 64-bit FNV-1a hash of the schema text.
+static uint64_t snap_hash(const char *s, size_t n) {
+  uint64_t h = 14695981039346656037ULL;
+  size_t i;
+  for (i=0; i < n; i++) h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+  return h;
+}
+
+// The line after line s of a schema text.
+static const char *snap_next(const char *s) {
+  s += strcspn(s, "\n");
+  return *s ? s+1 : s;
+}
+
+// Find the line for path in schema text s, or NULL.
+static const char *snap_line(const char *s, const char *path, size_t plen) {
+  for (; *s; s = snap_next(s)) {
+    if (strncmp(s, path, plen) == 0 && s[plen] == ' ') return s;
+  }
+  return NULL;
+}
+
+// Report each element whose schema differs between the program (s) and
+// the snapshot (fs).  Returns the error count.
+static int snap_compare(const char *who, const char *s, const char *fs) {
+  int errcnt = 0;
+  const char *p, *q;
+  for (p = s; *p; p = snap_next(p)) {
+    size_t plen = strcspn(p, " "), llen = strcspn(p, "\n");
+    q = snap_line(fs, p, plen);
+    if (!q)
+      errcnt += (Ir_error("%s: %.*s is not in the snapshot", who, (int)plen, p));
+    else if (strcspn(q, "\n") != llen || strncmp(p, q, llen) != 0)
+      errcnt += (Ir_error("%s: %.*s differs (typ sz off len flb fub): "
+        "program has%.*s, snapshot has%.*s", who, (int)plen, p,
+        (int)(llen-plen), p+plen, (int)(strcspn(q, "\n")-plen), q+plen));
+  }
+  for (q = fs; *q; q = snap_next(q)) {
+    size_t plen = strcspn(q, " ");
+    if (!snap_line(s, q, plen))
+      errcnt += (Ir_error("%s: %.*s is in the snapshot, but not in the "
+        "program", who, (int)plen, q));
+  }
+  return errcnt;
+}
+
+// Pack the record for a callback or reference.
+static int snap_put_rec(ir_snap *s, const ir_crumb *c, char *bp, ir_element *ep) {
+  lua_State *L = s->L;
+  lua_cb_data *cb = (lua_cb_data *)bp;
+  ir_snap_rec rec = { 0, 0, 0, 0, 0 };
+  int ref = (ep->typ == T_cbk) ? cb->fref : *(int *)bp;
+  size_t at = s->b->n;
+  const ir_cprog *p = (ep->typ == T_cbk) ? (const ir_cprog *)arena_code(cb) : NULL;
+
+  rec.kind = (ref < 0) ? ref : (L && !s->vb) ? SNAP_VALUE : SNAP_BIND;
+  if (ep->typ == T_cbk) {
+    rec.npnr = cb->npnr;
+    rec.base_npnr = cb->base_npnr;
+    if (ref == LUA_NOREF) rec.n = ir_nret(cb->npnr);
+  }
+  if (rec.kind == SNAP_VALUE && p) rec.ncode = p->ninsn;
+  sbuf_put(s->b, &rec, sizeof rec);
+  if (ref == LUA_NOREF) sbuf_put(s->b, cb->data, rec.n * sizeof(double));
+
+  if (rec.kind == SNAP_BIND && L) { // ir_save: the value goes to the sidecar.
+    ir_snap vs = *s;
+    vs.b = s->vb;
+    vs.vb = NULL;
+    return snap_put_rec(&vs, c, bp, ep);
+  }
+
+  if (rec.kind == SNAP_VALUE) {
+    int errcnt;
+    push_ref(L, ref);
+    errcnt = snap_put_value(s, c, lua_gettop(L), 0);
+    lua_pop(L, 1);
+    if (errcnt) return errcnt;
+    rec.n = (int)(s->b->n - at - sizeof rec);
+    if (!s->b->err) memcpy(s->b->p + at, &rec, sizeof rec);
+    if (p) {
+      sbuf_put(s->b, &p->nprm, sizeof p->nprm);
+      sbuf_put(s->b, &p->nret, sizeof p->nret);
+      sbuf_put(s->b, p->insn, p->ninsn * sizeof *p->insn);
+    }
+  }
+  return s->b->err ? Ir_error("%s: out of memory", s->who) : 0;
+}
+
+static int snap_get_rec(ir_snap *s, const ir_crumb *c, char *bp, ir_element *ep);
+
+// Unpack record rec for a callback or reference; its data is next in
+// s->cur (or, for SNAP_BIND, in s->vcur, if it is set).  If unpacking
+// with a lua_State, the Lua value at the element's path is on top of the
+// stack.
+static int snap_get_rec1(ir_snap *s, const ir_crumb *c, char *bp, ir_element *ep,
+                         ir_snap_rec rec) {
+  lua_State *L = s->L;
+  lua_cb_data *cb = (lua_cb_data *)bp;
+  int errcnt = 0, ref;
+
+  if (ep->typ == T_cbk) { // Left in the arena.
+    cb->data = NULL;
+    (void)arena_set_code(cb, NULL);
+  }
+
+  if (rec.kind >= 0 && !L)
+    return Ir_error("%s: %s: a lua_State is needed to bind this %s", s->who,
+      crumb_str(c), ep->typ == T_cbk ? "callback" : "reference");
+
+  if (rec.kind == SNAP_BIND && s->vcur) { // ir_load: the value is in the sidecar.
+    ir_snap vs = *s;
+    vs.cur = s->vcur;
+    vs.vcur = NULL;
+    return snap_get_rec(&vs, c, bp, ep);
+
+  } else if (rec.kind == SNAP_BIND) { // Bind the Lua value at the path again.
+    if (ep->typ == T_cbk && !lua_isfunction(L,-1))
+      return Ir_error("%s: %s is not a function in the input", s->who, crumb_str(c));
+    lua_pushvalue(L,-1); // Replaced by nil.
+    errcnt = (ep->typ == T_cbk) ? read_cbk(L, c, bp, ep) : read_ref(L, c, bp);
+    lua_pop(L,1);
+
+  } else if (rec.kind == SNAP_VALUE) { // Unpack the value, and bind it.
+    if (snap_get_value(s, c, 0)) return 1;
+    if (ep->typ == T_ref) {
+      ref = luaL_ref(L, LUA_REGISTRYINDEX);
+      ref_drop(L, *(int *)bp);
+      *(int *)bp = ref;
+      return 0;
+    }
+    if (!lua_isfunction(L,-1)) {
+      lua_pop(L,1);
+      return Ir_error("%s: %s: bad callback in snapshot", s->who, crumb_str(c));
+    }
+    ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    ref_drop(L, cb->fref);
+    cb->fref = ref;
+    cb->npnr = rec.npnr;
+    cb->base_npnr = rec.base_npnr;
+    ir_set_function_name(L, crumb_str(c), bp);
+    if (rec.ncode > 0) {
+      ir_cprog *p = (ir_cprog *)arena_alloc(sizeof *p + rec.ncode * sizeof *p->insn);
+      if (!p) return Ir_error("%s: arena_alloc failed", s->who);
+      p->ninsn = rec.ncode;
+      p->insn = (ir_insn *)(p+1);
+      if (scur_read(s->cur, &p->nprm, sizeof p->nprm) ||
+          scur_read(s->cur, &p->nret, sizeof p->nret) ||
+          scur_read(s->cur, p->insn, rec.ncode * sizeof *p->insn))
+        return Ir_error("%s: %s: snapshot is truncated", s->who, crumb_str(c));
+      if (irep_compile > 0 && arena_set_code(cb, p))
+        return Ir_error("%s: %s: out of memory", s->who, crumb_str(c));
+    }
+
+  } else if (ep->typ == T_ref) {
+    *(int *)bp = rec.kind;
+
+  } else {
+    if (rec.n > 0) {
+      cb->data = arena_alloc(rec.n * sizeof(double));
+      if (!cb->data || scur_read(s->cur, cb->data, rec.n * sizeof(double)))
+        return Ir_error("%s: %s: snapshot is truncated", s->who, crumb_str(c));
+    }
+    cb->fref = rec.kind;
+    cb->npnr = rec.npnr;
+    cb->base_npnr = rec.base_npnr;
+    if (L) ir_set_function_name(L, crumb_str(c), bp);
+  }
+  return errcnt;
+}
+
+// Unpack the next record, and move past its data, even after an error.
+static int snap_get_rec(ir_snap *s, const ir_crumb *c, char *bp, ir_element *ep) {
+  ir_snap_rec rec;
+  size_t n = 0;
+  int errcnt, bad;
+
+  bad = scur_read(s->cur, &rec, sizeof rec) || rec.n < 0 || rec.ncode < 0;
+  if (!bad) {
+    if (rec.kind == LUA_NOREF) n = rec.n * sizeof(double);
+    if (rec.kind == SNAP_VALUE) n = rec.n + (rec.ncode ? 2*sizeof(int) +
+                                    rec.ncode * sizeof(ir_insn) : 0);
+  }
+  if (bad || n > s->cur->n - s->cur->pos) {
+    s->cur->pos = s->cur->n;
+    return Ir_error("%s: %s: snapshot is truncated", s->who, crumb_str(c));
+  }
+  n += s->cur->pos;
+  errcnt = snap_get_rec1(s, c, bp, ep, rec);
+  s->cur->pos = n;
+  return errcnt;
+}
+
+// Pack the record for runtime-sized vector d.
+static int snap_put_dir(ir_snap *s, const ir_dir *d, ir_element *ep) {
+  sbuf_put(s->b, &d->n, sizeof d->n);
+  if (d->n > 0) sbuf_put(s->b, d->p, d->n * ep->sz);
+  return s->b->err ? Ir_error("%s: out of memory", s->who) : 0;
+}
+
+// Unpack the record for runtime-sized vector d, reallocating it.
+static int snap_get_dir(ir_snap *s, const ir_crumb *c, ir_dir *d, ir_element *ep) {
+  const char *q = NULL;
+  int n;
+
+  if (scur_read(s->cur, &n, sizeof n) || n < 0 || !(q = scur_get(s->cur, n * ep->sz))) {
+    s->cur->pos = s->cur->n;
+    return Ir_error("%s: %s: snapshot is truncated", s->who, crumb_str(c));
+  }
+  if (dir_resize(d, n, ep->sz)) return Ir_error("%s: %s: out of memory", s->who, crumb_str(c));
+  if (n > 0) memcpy(d->p, q, n * ep->sz);
+  return 0;
+}
+
+static int snap_walk(ir_snap *s, const ir_crumb *c, char *bp, ir_element *ep,
+                     int treat_as_scalar);
+
+// Unpack sparse vector ep (at bp), replacing its elements.  Each element
+// is its index, its bytes, and then its records; it is unpacked as if it
+// were a table of its own, with its bytes as the image.
+static int snap_get_sparse(ir_snap *s, const ir_crumb *c, char *bp, ir_element *ep) {
+  ir_element e = sparse_elem(ep);
+  ir_snap es = *s;
+  lua_State *L = s->L;
+  int i, k, n, errcnt = 0;
+
+  if (scur_read(s->cur, &n, sizeof n) || n < 0) goto bad;
+  dyn_free(bp, ep, 0);
+  for (i=0; i < n; i++) {
+    ir_crumb nc = { c, 0, 0 };
+    char *p;
+    if (scur_read(s->cur, &k, sizeof k) || k < ep->flb || k > ep->fub ||
+        !(es.img = scur_get(s->cur, ep->sz))) goto bad;
+    if (!(p = sparse_add(bp, k, ep)))
+      return Ir_error("%s: %s: out of memory", s->who, crumb_str(c));
+    nc.i = k;
+    es.base = p;
+    if (L) {
+      if (lua_istable(L,-1)) lua_rawgeti(L,-1,k);
+      else lua_pushnil(L);
+    }
+    errcnt += snap_walk(&es, &nc, p, &e, 0);
+    if (L) lua_pop(L,1);
+  }
+  return errcnt;
+bad:
+  s->cur->pos = s->cur->n;
+  return Ir_error("%s: %s: snapshot is truncated", s->who, crumb_str(c));
+}
+
+// Pack or unpack the records for the callbacks and references in element
+// ep (at bp), and, when unpacking, copy its other data from the image.
+// When unpacking with a lua_State, the Lua value for the element is on
+// top of the stack.
+static int snap_walk(ir_snap *s, const ir_crumb *c, char *bp, ir_element *ep,
+                     int treat_as_scalar) {
+  int i, errcnt = 0, lua = s->unpack && s->L;
+  lua_State *L = s->L;
+
+  if (IR_SPARSE(ep) && s->unpack) {
+    errcnt = snap_get_sparse(s, c, bp, ep);
+
+  } else if (IR_SPARSE(ep)) { // Each element: its index, bytes, and records.
+    ir_sparse *sp = (ir_sparse *)bp;
+    ir_element e = sparse_elem(ep);
+    sbuf_put(s->b, &sp->n, sizeof sp->n);
+    for (i=0; i < sp->n; i++) {
+      ir_crumb nc = { c, 0, SPARSE_KEY(sp,i) };
+      sbuf_put(s->b, &SPARSE_KEY(sp,i), sizeof(int));
+      sbuf_put(s->b, SPARSE_ELEM(sp,i), ep->sz);
+      errcnt += snap_walk(s, &nc, SPARSE_ELEM(sp,i), &e, 0);
+    }
+
+  } else if (ep->typ == T_tbl && ep->fub > 0 && !treat_as_scalar) {
+    for (i=ep->flb; i<=ep->fub; i++) { // Array of structs.
+      ir_crumb nc = { c, 0, i };
+      if (lua) {
+        if (lua_istable(L,-1)) lua_rawgeti(L,-1,i);
+        else lua_pushnil(L);
+      }
+      errcnt += snap_walk(s, &nc, bp + (i - ep->flb)*ep->sz, ep, 1);
+      if (lua) lua_pop(L,1);
+    }
+
+  } else if (ep->typ == T_tbl) { // Scalar struct, or 1 element of an array.
+    ir_element *nep;
+    for (nep = ir_ta[ep->ti]; nep->name; nep++) {
+      ir_crumb nc = { c, nep->name, 0 };
+      if (lua) {
+        if (lua_istable(L,-1)) lua_getfield(L,-1,nep->name);
+        else lua_pushnil(L);
+      }
+      errcnt += snap_walk(s, &nc, bp + nep->off, nep, 0);
+      if (lua) lua_pop(L,1);
+    }
+
+  } else if (ep->typ == T_cbk || ep->typ == T_ref) {
+    errcnt = s->unpack ? snap_get_rec(s, c, bp, ep) : snap_put_rec(s, c, bp, ep);
+
+  } else if (IR_DYN(ep)) {
+    errcnt = s->unpack ? snap_get_dir(s, c, (ir_dir *)bp, ep) :
+                         snap_put_dir(s, (ir_dir *)bp, ep);
+
+  } else if (ep->typ != T_ptr && s->unpack) { // Scalar or array of POD.
+    // The size of a scalar string is its len; an array's sz is its stride.
+    size_t n = (ep->fub > 0) ? (size_t)(ep->fub - ep->flb + 1) : 1;
+    size_t sz = (ep->typ == T_str && ep->fub == 0) ? (size_t)ep->len : ep->sz;
+    memcpy(bp, s->img + (bp - s->base), n * sz);
+  }
+  return errcnt;
+}
+
+// Bytes of memory used by well-known table w.
+static size_t snap_image_len(ir_wkt_desc *w) {
+  return w->e.sz * ((w->e.fub > 0) ? (size_t)(w->e.fub - w->e.flb + 1) : 1);
+}
+
+// Pack well-known table w into buffer b, as one section.  Lua values are
+// packed if L is not NULL: into b, or, if vb is not NULL, into vb.
+static int snap_pack(const char *who, lua_State *L, ir_wkt_desc *w, ir_sbuf *b,
+                     ir_sbuf *vb) {
+  int errcnt, top = L ? lua_gettop(L) : 0;
+  size_t n, at = b->n;
+  char *s = snap_schema_text(w, &n);
+  ir_snap_header h;
+  ir_snap sn = { who, 0, L, b, NULL, NULL, NULL, 0, vb, NULL };
+  ir_crumb c = { 0, w->e.name, 0 };
+
+  if (!s) return Ir_error("%s: malloc failed", who);
+  memset(&h, 0, sizeof h);
+  memcpy(h.magic, "IREPSNAP", 8);
+  h.version = IR_SNAP_VERSION;
+  h.endian = 0x01020304;
+  h.hash = snap_hash(s, n);
+  h.schema_len = n;
+  h.image_len = snap_image_len(w);
+  sbuf_put(b, &h, sizeof h);
+  sbuf_put(b, s, n);
+  sbuf_put(b, w->p, h.image_len);
+  free(s);
+  errcnt = snap_walk(&sn, &c, (char *)w->p, &w->e, 0);
+  if (L) lua_settop(L, top);
+  if (b->err || (vb && vb->err)) return Ir_error("%s: out of memory", who);
+  h.rec_len = b->n - at - sizeof h - h.schema_len - h.image_len;
+  memcpy(b->p + at, &h, sizeof h);
+  return errcnt;
+}
+
+// Unpack one section from cursor cur into its well-known table.  If t is
+// not NULL, the section must be for table t.  If the schema differs, the
+// differences are reported, and the section is skipped.  Sets *bad if
+// the rest of the buffer cannot be read.  vcur, if not NULL, has the
+// records of the sidecar from ir_save.
+static int snap_unpack(const char *who, lua_State *L, ir_scur *cur,
+                       const char *t, int *bad, ir_scur *vcur) {
+  int i, errcnt = 0, top = L ? lua_gettop(L) : 0;
+  size_t n, start;
+  char *s = NULL, name[256];
+  const char *fs, *img;
+  ir_snap_header h;
+  ir_snap sn = { who, 1, L, NULL, cur, NULL, NULL, 0, NULL, vcur };
+
+  *bad = 1;
+  if (scur_read(cur, &h, sizeof h) || memcmp(h.magic, "IREPSNAP", 8) != 0)
+    return Ir_error("%s: not an IREP snapshot", who);
+  if (h.version != IR_SNAP_VERSION || h.endian != 0x01020304)
+    return Ir_error("%s: snapshot version %u (byte order %x) not supported",
+      who, (unsigned)h.version, (unsigned)h.endian);
+  if (!(fs = scur_get(cur, h.schema_len)) || !(img = scur_get(cur, h.image_len)))
+    return Ir_error("%s: snapshot is truncated", who);
+  start = cur->pos;
+  if (!scur_get(cur, h.rec_len)) return Ir_error("%s: snapshot is truncated", who);
+  *bad = 0;
+
+  // The table's name is the first word of the schema.
+  n = strcspn(fs, " ");
+  snprintf(name, sizeof name, "%.*s", (int)(n < h.schema_len ? n : 0), fs);
+  if (t && strcmp(name, t) != 0)
+    return Ir_error("%s: snapshot is of table %s, not %s", who, name, t);
+  if ((i = find_wkt(name)) < 0)
+    return Ir_error("%s: no well-known table named %s", who, name);
+  ir_wkt_desc *w = &ir_wktt[i];
+  if (!(s = snap_schema_text(w, &n))) return Ir_error("%s: malloc failed", who);
+
+  if (h.hash != snap_hash(s, n) || h.schema_len != n || memcmp(s, fs, n) != 0) {
+    char *fsz = (char *)malloc(h.schema_len + 1); // fs is not terminated.
+    if (fsz) {
+      memcpy(fsz, fs, h.schema_len);
+      fsz[h.schema_len] = '\0';
+      errcnt = snap_compare(who, s, fsz);
+    }
+    if (!errcnt) errcnt = (Ir_error("%s: schema of %s differs", who, name));
+    free(fsz);
+  } else if (h.image_len != snap_image_len(w)) {
+    errcnt = (Ir_error("%s: %s: bad table image", who, name));
+  } else {
+    ir_crumb c = { 0, w->e.name, 0 };
+    ir_scur rc = { cur->p, start + h.rec_len, start };
+    sn.cur = &rc;
+    sn.base = (const char *)w->p;
+    sn.img = img;
+    if (L) lua_getglobal(L, w->e.name);
+    errcnt = snap_walk(&sn, &c, (char *)w->p, &w->e, 0);
+    if (L) lua_settop(L, top);
+  }
+  free(s);
+  return errcnt;
+}
+
+// Pack the well-known tables named in t (separated by commas or spaces),
+// or all of them if t is NULL or "", into a buffer for ir_unpack.  If L
+// is not NULL, Lua functions (as bytecode) and the values of references
+// are packed too.  Sets *len, and returns the buffer, to be released
+// with ir_pack_free; or returns NULL (and sets *len to 0) on error.
+void *ir_pack(lua_State *L, const char *t, size_t *len) {
+  int i, errcnt = 0;
+  ir_sbuf b = { NULL, 0, 0, 0 };
+
+  if (!t || !*t) {
+    for (i=0; i < (int)ir_wktt_size; i++)
+      errcnt += snap_pack("ir_pack", L, &ir_wktt[i], &b, NULL);
+  } else {
+    const char *p = t;
+    while (*(p += strspn(p, ", "))) {
+      char name[256];
+      size_t n = strcspn(p, ", ");
+      snprintf(name, sizeof name, "%.*s", (int)n, p);
+      p += n;
+      if ((i = find_wkt(name)) < 0)
+        errcnt += (Ir_error("ir_pack: no well-known table named %s", name));
+      else
+        errcnt += snap_pack("ir_pack", L, &ir_wktt[i], &b, NULL);
+    }
+  }
+  if (errcnt) {
+    free(b.p);
+    *len = 0;
+    return NULL;
+  }
+  *len = b.n;
+  return b.p;
+}
+
+// Release a buffer from ir_pack.
+void ir_pack_free(void *buf) { free(buf); }
+
+// Unpack the tables in a buffer from ir_pack.  L is needed if the buffer
+// has Lua values; otherwise it may be NULL.  Returns the error count.
+int ir_unpack(lua_State *L, const void *buf, size_t len) {
+  int errcnt = 0, bad = 0;
+  ir_scur cur = { (const char *)buf, len, 0 };
+  ir_getenv();
+  while (cur.pos < len && !bad)
+    errcnt += snap_unpack("ir_unpack", L, &cur, NULL, &bad, NULL);
+  return errcnt;
+}
+
+// Write the n bytes at d to file, under a temporary name, renamed when
+// complete.  Returns the error count.
+static int snap_write(const char *who, const char *file, const void *d, size_t n) {
+  int errcnt = 0;
+  char *tmp = (char *)malloc(strlen(file) + 5);
+  FILE *f;
+
+  if (!tmp) return Ir_error("%s: malloc failed", who);
+  sprintf(tmp, "%s.tmp", file);
+  if (!(f = fopen(tmp, "wb"))) {
+    errcnt = (Ir_error("%s: cannot open %s", who, tmp));
+  } else {
+    if (fwrite(d, 1, n, f) != n) errcnt = 1;
+    if (fclose(f) != 0) errcnt = 1;
+    if (errcnt) {
+      (void)Ir_error("%s: %s: write failed", who, tmp);
+      remove(tmp);
+    } else if (rename(tmp, file) != 0) {
+      errcnt = (Ir_error("%s: cannot rename %s", who, tmp));
+    }
+  }
+  free(tmp);
+  return errcnt;
+}
+
+// Read all of file into *buf, to be freed, and set *n.  Returns -1 if
+// the file cannot be opened, else the error count.
+static int snap_read(const char *who, const char *file, char **buf, size_t *n) {
+  long len;
+  int errcnt = 0;
+  FILE *f = fopen(file, "rb");
+
+  *buf = NULL;
+  if (!f) return -1;
+  if (fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) < 0 ||
+      fseek(f, 0, SEEK_SET) != 0 || !(*buf = (char *)malloc(len ? len : 1)) ||
+      fread(*buf, 1, len, f) != (size_t)len) {
+    errcnt = (Ir_error("%s: cannot read %s", who, file));
+    free(*buf);
+    *buf = NULL;
+  }
+  fclose(f);
+  *n = errcnt ? 0 : (size_t)len;
+  return errcnt;
+}
+
+// The name of the sidecar of snapshot file, for its Lua values; to be
+// freed.
+static char *snap_sidecar(const char *file) {
+  char *side = (char *)malloc(strlen(file) + 4);
+  if (side) sprintf(side, "%s.lv", file);
+  return side;
+}
+
+// Save well-known table t to file.  If L is not NULL, the Lua values
+// (functions, as bytecode, and the values of references) are saved too,
+// in a sidecar, file.lv, whose header has the hash of file.  Each file is
+// written under a temporary name, and renamed when complete.  Returns the
+// error count.
+int ir_save(lua_State *L, const char *t, const char *file) {
+  int i = find_wkt(t), errcnt;
+  char *side;
+  ir_snap_header h;
+  ir_sbuf b = { NULL, 0, 0, 0 }, vb = { NULL, 0, 0, 0 };
+
+  if (i < 0) return Ir_error("ir_save: no well-known table named %s", t);
+  if (!(side = snap_sidecar(file))) return Ir_error("%s", "ir_save: malloc failed");
+  memset(&h, 0, sizeof h);
+  memcpy(h.magic, "IREPSNAP", 8);
+  h.version = IR_SNAP_VERSION;
+  h.endian = 0x01020304;
+  sbuf_put(&vb, &h, sizeof h); // Filled in below.
+  errcnt = snap_pack("ir_save", L, &ir_wktt[i], &b, L ? &vb : NULL);
+
+  // The sidecar is written first: if the snapshot is not, the old one
+  // will not match it.
+  if (!errcnt && vb.n > sizeof h) {
+    h.hash = snap_hash(b.p, b.n);
+    h.rec_len = vb.n - sizeof h;
+    memcpy(vb.p, &h, sizeof h);
+    errcnt = snap_write("ir_save", side, vb.p, vb.n);
+  } else if (!errcnt) {
+    (void)remove(side); // From an earlier save.
+  }
+  if (!errcnt) errcnt = snap_write("ir_save", file, b.p, b.n);
+  free(side);
+  free(vb.p);
+  free(b.p);
+  return errcnt;
+}
+
+// Load well-known table t from a file written by ir_save.  The schema of
+// the table must be the same as when it was saved; if it is not, each
+// difference is reported, and nothing is loaded.  L is only used for Lua
+// functions and references, and may be NULL if there are none: they are
+// restored from the sidecar, if there is one, else bound again from the
+// Lua values at their paths.  Returns the error count.
+int ir_load(lua_State *L, const char *t, const char *file) {
+  int errcnt, bad;
+  size_t n, vn = 0;
+  char *buf, *vbuf = NULL, *side, who[1024];
+  ir_snap_header h;
+  ir_scur vcur = { NULL, 0, 0 };
+
+  snprintf(who, sizeof who, "ir_load: %s", file);
+  if ((errcnt = snap_read("ir_load", file, &buf, &n)) < 0)
+    return Ir_error("ir_load: cannot open %s", file);
+  if (errcnt) return errcnt;
+  ir_getenv();
+
+  if (!(side = snap_sidecar(file))) {
+    errcnt = (Ir_error("%s", "ir_load: malloc failed"));
+  } else if (L && (errcnt = snap_read("ir_load", side, &vbuf, &vn)) < 0) {
+    errcnt = 0; // No sidecar: bind the Lua values at the paths.
+  } else if (vbuf) {
+    if (vn >= sizeof h) memcpy(&h, vbuf, sizeof h);
+    if (vn < sizeof h || memcmp(h.magic, "IREPSNAP", 8) != 0 ||
+        h.version != IR_SNAP_VERSION || h.endian != 0x01020304 ||
+        h.rec_len != vn - sizeof h || h.hash != snap_hash(buf, n))
+      errcnt = (Ir_error("ir_load: %s is not the sidecar of %s", side, file));
+    vcur.p = vbuf + sizeof h;
+    vcur.n = vn - sizeof h;
+  }
+
+  if (!errcnt) {
+    ir_scur cur = { buf, n, 0 };
+    if (find_wkt(t) < 0) errcnt = (Ir_error("ir_load: no well-known table named %s", t));
+    else errcnt = snap_unpack(who, L, &cur, t, &bad, vbuf ? &vcur : NULL);
+  }
+  free(side);
+  free(vbuf);
+  free(buf);
+  return errcnt;
+}
+
+// Change tracking, for steering loops that re-read tables.  A tracker
+// keeps a checksum for each leaf under a path: a scalar, a whole array of
+// POD (so an unchanged vector is one comparison), a callback, or a
+// reference.  It also keeps a checksum of each leaf's Lua value, so
+// ir_track_read reads again only the leaves whose Lua values changed (an
+// unchanged vector is summed, but not rewritten), and lists the leaves
+// whose checksums changed, in index order.  Lua functions are compared by
+// their bytecode, and the values of references by their contents.
+
+typedef struct {
+  char *path;       // Full name of the leaf, e.g., "table1.table2[3].f2".
+  uint64_t sum;     // Its checksum after the last read.
+  uint64_t lsum;    // The checksum of its Lua value then.
+} ir_leaf;
+
+typedef struct {
+  char *path;       // The hook's path, a leaf or any table above leaves.
+  ir_track_fn *f;
+  void *arg;
+} ir_hook;
+
+struct ir_track {
+  ir_path *p;       // The path tracked.
+  int n, cap;       // Leaves.
+  ir_leaf *leaf;
+  int nchanged;     // Leaves changed by the last ir_track_read,
+  int *changed;     // as indexes into leaf.
+  int nhook;        // Hooks.
+  ir_hook *hook;
+};
+
+#define TRACK_SEED 14695981039346656037ULL
+#define TRACK_MAXDEPTH 16   // For Lua tables nested in a reference.
+
+// Add n bytes at p to the 64-bit FNV-1a checksum h, a word at a time.
+static uint64_t track_mix(uint64_t h, const void *p, size_t n) {
+  const unsigned char *s = (const unsigned char *)p;
+  uint64_t w;
+  for (; n >= sizeof w; n -= sizeof w, s += sizeof w) {
+    memcpy(&w, s, sizeof w);
+    h = (h ^ w) * 1099511628211ULL;
+  }
+  for (; n > 0; n--) h = (h ^ *s++) * 1099511628211ULL;
+  return h;
+}
+
+static int track_writer(lua_State *L, const void *p, size_t sz, void *ud) {
+  (void)L;
+  *(uint64_t *)ud = track_mix(*(uint64_t *)ud, p, sz);
+  return 0;
+}
+
+// Checksum of the Lua value at (absolute) index idx.  Table entries are
+// combined by addition, so the order lua_next visits them in does not
+// matter.  C functions, userdata, and tables nested too deeply are
+// compared by identity.
+static uint64_t track_value(lua_State *L, int idx, int depth) {
+  int tv = lua_type(L, idx);
+  uint64_t h = track_mix(TRACK_SEED, &tv, sizeof tv);
+
+  if (tv == LUA_TBOOLEAN) {
+    int b = lua_toboolean(L, idx);
+    h = track_mix(h, &b, sizeof b);
+  } else if (tv == LUA_TNUMBER) {
+    double d = lua_tonumber(L, idx);
+    h = track_mix(h, &d, sizeof d);
+  } else if (tv == LUA_TSTRING) {
+    size_t n;
+    const char *s = lua_tolstring(L, idx, &n);
+    h = track_mix(h, s, n);
+  } else if (tv == LUA_TFUNCTION && !lua_iscfunction(L, idx)) {
+    lua_pushvalue(L, idx);
+    (void)lua_dump(L, track_writer, &h);
+    lua_pop(L, 1);
+  } else if (tv == LUA_TTABLE && depth < TRACK_MAXDEPTH && lua_checkstack(L, 4)) {
+    uint64_t sum = 0;
+    for (lua_pushnil(L); lua_next(L, idx); lua_pop(L, 1)) {
+      int top = lua_gettop(L);
+      uint64_t kv = track_value(L, top-1, depth+1);
+      uint64_t v = track_value(L, top, depth+1);
+      sum += track_mix(kv, &v, sizeof v);
+    }
+    h = track_mix(h, &sum, sizeof sum);
+  } else if (tv != LUA_TNIL) {
+    const void *p = lua_topointer(L, idx);
+    h = track_mix(h, &p, sizeof p);
+  }
+  return h;
+}
+
+// Checksum of the Lua value in the registry at ref, mixed into h.
+static uint64_t track_ref(lua_State *L, uint64_t h, int ref) {
+  uint64_t v;
+  if (ref < 0) return track_mix(h, &ref, sizeof ref); // LUA_REFNIL or LUA_NOREF.
+  push_ref(L, ref);
+  v = track_value(L, lua_gettop(L), 0);
+  lua_pop(L, 1);
+  return track_mix(h, &v, sizeof v);
+}
+
+static uint64_t track_tree(lua_State *L, char *bp, ir_element *ep, int treat_as_scalar);
+
+// Checksum of leaf ep, at bp; treat_as_scalar is as in iir_unread.  A
+// sparse vector is one leaf, since its elements come and go.
+static uint64_t track_sum(lua_State *L, char *bp, ir_element *ep, int treat_as_scalar) {
+  uint64_t h = TRACK_SEED;
+  size_t j, n = (ep->fub > 0 && !treat_as_scalar) ? (size_t)(ep->fub - ep->flb + 1) : 1;
+
+  if (ep->typ == T_cbk) {
+    lua_cb_data *cb = (lua_cb_data *)bp;
+    int nret = ir_nret(cb->npnr);
+    h = track_mix(h, &cb->npnr, sizeof cb->npnr);
+    if (cb->fref == LUA_NOREF && cb->data && nret > 0)
+      h = track_mix(h, cb->data, nret * sizeof(double));
+    h = track_ref(L, h, cb->fref);
+
+  } else if (ep->typ == T_ref) {
+    h = track_ref(L, h, *(int *)bp);
+
+  } else if (IR_SPARSE(ep)) { // The index, and the checksum, of each element.
+    const ir_sparse *s = (const ir_sparse *)bp;
+    ir_element e = sparse_elem(ep);
+    for (j=0; j < (size_t)s->n; j++) {
+      uint64_t v = track_tree(L, SPARSE_ELEM(s,j), &e, 0);
+      h = track_mix(h, &SPARSE_KEY(s,j), sizeof(int));
+      h = track_mix(h, &v, sizeof v);
+    }
+
+  } else if (IR_DYN(ep)) { // Runtime-sized vector: its length and elements.
+    const ir_dir *d = (const ir_dir *)bp;
+    h = track_mix(h, &d->n, sizeof d->n);
+    if (d->n > 0) h = track_mix(h, d->p, d->n * ep->sz);
+
+  } else if (ep->typ == T_str) { // Only the characters up to the NUL count.
+    for (j=0; j < n; j++) {
+      const char *s = bp + j*ep->len;
+      size_t m = strnlen(s, ep->len);
+      h = track_mix(h, &m, sizeof m);
+      h = track_mix(h, s, m);
+    }
+
+  } else {
+    h = track_mix(h, bp, n * ep->sz);
+  }
+  return h;
+}
+
+// Checksum of all of the leaves under element ep, at bp.
+static uint64_t track_tree(lua_State *L, char *bp, ir_element *ep, int treat_as_scalar) {
+  uint64_t h = TRACK_SEED, v;
+  int i;
+
+  if (ep->typ == T_tbl && !IR_SPARSE(ep) && ep->fub > 0 && !treat_as_scalar) {
+    for (i=ep->flb; i<=ep->fub; i++) { // Array of structs.
+      v = track_tree(L, bp + (i - ep->flb)*ep->sz, ep, 1);
+      h = track_mix(h, &v, sizeof v);
+    }
+  } else if (ep->typ == T_tbl && !IR_SPARSE(ep)) { // Scalar struct, or 1 element.
+    ir_element *nep;
+    for (nep = ir_ta[ep->ti]; nep->name; nep++) {
+      v = track_tree(L, bp + nep->off, nep, 0);
+      h = track_mix(h, &v, sizeof v);
+    }
+  } else if (ep->typ != T_ptr) {
+    h = track_sum(L, bp, ep, treat_as_scalar);
+  }
+  return h;
+}
+
+// Push the Lua value of member nep of the Lua table at TOS (or, if nep
+// is NULL, of index i), or nil if TOS is not a table.
+static void track_push(lua_State *L, const ir_element *nep, int i) {
+  if (!lua_istable(L,-1)) lua_pushnil(L);
+  else if (nep) {
+    lua_pushstring(L, nep->name);
+    lua_rawget(L,-2);
+  } else lua_rawgeti(L,-1,i);
+}
+
+// Check the keys of the Lua table at TOS, as iir_read does, since
+// track_walk visits only the keys that element ep declares.
+static int track_keys(lua_State *L, const ir_crumb *c, ir_element *ep, int treat_as_scalar) {
+  int fub = treat_as_scalar ? 0 : ep->fub;
+  for (lua_pushnil(L); lua_next(L,-2); lua_pop(L,1)) {
+    ir_crumb nc = { c, 0, 0 };
+    if (lua_type(L,-2) == LUA_TSTRING) {
+      nc.name = lua_tostring(L,-2);
+      if (fub == 0 && find_element(nc.name, ep->ti) != -1) continue;
+      lua_pop(L, 2);
+      return Ir_error("No such IREP variable: %s (%s)", nc.name, crumb_str(&nc));
+    } else if (lua_type(L,-2) == LUA_TNUMBER) {
+      nc.i = (int)lua_tonumber(L,-2);
+      if (fub > 0 && nc.i >= ep->flb && nc.i <= fub) continue;
+      lua_pop(L, 2);
+      return Ir_error("Array bounds exceeded: %s (%d:%d)", crumb_str(&nc), ep->flb, fub);
+    }
+    lua_pop(L, 2);
+    return Ir_error("Expected string or integer key: %s", crumb_str(c));
+  }
+  return 0;
+}
+
+// Visit the leaves under element ep, in index order, with the Lua value
+// of ep at TOS.  On the first visit (init), record them.  Afterwards,
+// read each leaf whose Lua value changed, and note the leaves whose
+// checksums changed.  bp, ep, and treat_as_scalar are as in iir_unread.
+static int track_walk(ir_track *k, lua_State *L, const ir_crumb *c, char *bp,
+                      ir_element *ep, int treat_as_scalar, int init) {
+  int i, errcnt = 0;
+  int tbl = ep->typ == T_tbl && !IR_SPARSE(ep);
+
+  if (tbl && !init && !lua_isnil(L,-1)) // Errors that ir_read would report.
+    errcnt = lua_istable(L,-1) ? track_keys(L, c, ep, treat_as_scalar) : iir_read(L, c, bp, ep);
+
+  if (tbl && ep->fub > 0 && !treat_as_scalar) {
+    for (i=ep->flb; i<=ep->fub; i++) { // Array of structs.
+      ir_crumb nc = { c, 0, i };
+      track_push(L, NULL, i);
+      errcnt += track_walk(k, L, &nc, bp + (i - ep->flb)*ep->sz, ep, 1, init);
+      lua_pop(L,1);
+    }
+
+  } else if (tbl) { // Scalar struct, or 1 element.
+    ir_element *nep;
+    for (nep = ir_ta[ep->ti]; nep->name; nep++) {
+      ir_crumb nc = { c, nep->name, 0 };
+      track_push(L, nep, 0);
+      errcnt += track_walk(k, L, &nc, bp + nep->off, nep, 0, init);
+      lua_pop(L,1);
+    }
+
+  } else if (ep->typ != T_ptr) { // A leaf.
+    uint64_t sum, lsum = track_value(L, lua_gettop(L), 0);
+    if (ep->typ == T_cbk || ep->typ == T_ref) { // libIR holds this very value.
+      const void *lp = lua_topointer(L,-1);
+      lsum = track_mix(lsum, &lp, sizeof lp);
+    }
+    if (init) {
+      if (k->n == k->cap) {
+        int cap = k->cap ? 2*k->cap : 64;
+        ir_leaf *nl = realloc(k->leaf, cap * sizeof *nl);
+        if (!nl) return Ir_error("ir_track: %s: realloc failed", crumb_str(c));
+        k->leaf = nl;
+        k->cap = cap;
+      }
+      k->leaf[k->n].path = strdup(crumb_str(c));
+      if (!k->leaf[k->n].path)
+        return Ir_error("ir_track: %s: strdup failed", crumb_str(c));
+      k->leaf[k->n].lsum = lsum;
+      k->leaf[k->n++].sum = track_sum(L, bp, ep, treat_as_scalar);
+    } else {
+      ir_leaf *lp = &k->leaf[k->n++]; // Leaves are visited in recorded order.
+      if (lp->lsum == lsum) return 0; // Not read again.
+      lp->lsum = lsum;
+      if (lua_isnil(L,-1)) return 0; // As ir_read: the value is left alone.
+      errcnt = iir_read(L, c, bp, ep);
+      sum = track_sum(L, bp, ep, treat_as_scalar);
+      if (lp->sum != sum) {
+        lp->sum = sum;
+        k->changed[k->nchanged++] = lp - k->leaf;
+        Dbg_print("%s changed", lp->path);
+      }
+    }
+  }
+  return errcnt;
+}
+
+// Is path p the same as path q, or below it?
+static int track_under(const char *p, const char *q) {
+  size_t n = strlen(q);
+  return strncmp(p, q, n) == 0 && (p[n] == '\0' || p[n] == '.' || p[n] == '[');
+}
+
+// Release a tracker.  A NULL tracker is ignored.
+void ir_track_free(ir_track *k) {
+  int i;
+  if (!k) return;
+  for (i=0; i < k->n; i++) free(k->leaf[i].path);
+  for (i=0; i < k->nhook; i++) free(k->hook[i].path);
+  free(k->leaf);
+  free(k->changed);
+  free(k->hook);
+  ir_path_free(k->p);
+  free(k);
+}
+
+// Start tracking changes to the element named by path t, e.g., "table1"
+// or "table1.table2[3]", from its current values.  Call this after the
+// first ir_read.  L holds the Lua values of callbacks and references.
+// Returns NULL on error.
+ir_track *ir_track_create(lua_State *L, const char *t) {
+  ir_track *k = calloc(1, sizeof *k);
+  if (!k) {
+    (void)Ir_error("ir_track_create: %s: calloc failed", t);
+    return NULL;
+  }
+  k->p = ir_path_compile(t);
+  if (!k->p) {
+    free(k);
+    return NULL;
+  }
+  ir_crumb c = { 0, k->p->name, 0 };
+  char *bp = path_bp(k->p, 0);
+  if (!bp) {
+    (void)Ir_error("ir_track_create: %s: not given by the input", t);
+    ir_track_free(k);
+    return NULL;
+  }
+  path_push(L, k->p);
+  if (track_walk(k, L, &c, bp, k->p->ep, path_scalar(k->p), 1) ||
+      !(k->changed = malloc((k->n + 1) * sizeof *k->changed))) {
+    (void)Ir_error("ir_track_create: %s: out of memory", t);
+    ir_track_free(k);
+    return NULL;
+  }
+  lua_pop(L,1);
+  return k;
+}
+
+// Call f(path, arg) after each ir_track_read that changes the element
+// named by path, or anything below it.  Returns the error count.
+int ir_track_hook(ir_track *k, const char *path, ir_track_fn *f, void *arg) {
+  if (!k || !path || !f) return Ir_error("%s", "ir_track_hook: NULL argument");
+  if (!track_under(path, k->p->name) && !track_under(k->p->name, path))
+    return Ir_error("ir_track_hook: %s is not under %s", path, k->p->name);
+  ir_hook *nh = realloc(k->hook, (k->nhook + 1) * sizeof *nh);
+  if (!nh) return Ir_error("ir_track_hook: %s: realloc failed", path);
+  k->hook = nh;
+  nh[k->nhook].path = strdup(path);
+  if (!nh[k->nhook].path) return Ir_error("ir_track_hook: %s: strdup failed", path);
+  nh[k->nhook].f = f;
+  nh[k->nhook].arg = arg;
+  k->nhook++;
+  return 0;
+}
+
+// Did the last ir_track_read change the element named by path, or
+// anything below it?  A path inside an array of POD, such as "t.v[3]",
+// reports a change to the whole array.
+int ir_track_test(const ir_track *k, const char *path) {
+  int i;
+  if (!k || !path) return 0;
+  for (i=0; i < k->nchanged; i++) {
+    const char *lp = k->leaf[k->changed[i]].path;
+    if (track_under(lp, path) || track_under(path, lp)) return 1;
+  }
+  return 0;
+}
+
+// Read the tracked element again, as ir_read, but only the leaves whose
+// Lua values changed, and find the leaves that changed.  Then call the
+// hooks for them, in the order they were added.  Returns the error count
+// from reading.
+int ir_track_read(lua_State *L, ir_track *k) {
+  int i, n, errcnt = 0;
+  if (!k) return Ir_error("%s", "ir_track_read: NULL tracker");
+  ir_crumb c = { 0, k->p->name, 0 };
+  n = k->n;
+  k->n = 0;
+  k->nchanged = 0;
+  path_push(L, k->p);
+  char *bp = path_bp(k->p, 0);
+  if (bp) errcnt = track_walk(k, L, &c, bp, k->p->ep, path_scalar(k->p), 0);
+  k->n = n;
+  for (i=0; i < k->nhook; i++)
+    if (ir_track_test(k, k->hook[i].path)) k->hook[i].f(k->hook[i].path, k->hook[i].arg);
+  return errcnt;
+}
+
+// The number of leaves changed by the last ir_track_read, and the name of
+// the i-th one (0 <= i < n), or NULL.
+int ir_track_nchanged(const ir_track *k) {
+  return k ? k->nchanged : 0;
+}
+
+const char *ir_track_changed(const ir_track *k, int i) {
+  return (k && i >= 0 && i < k->nchanged) ? k->leaf[k->changed[i]].path : NULL;
+}
+
+// Frozen callbacks and references.  ir_freeze copies the Lua value of
+// each callback and ir_reference out of the host's lua_State, so that the
+// host can close it.  A string is kept as its characters (with a trailing
+// NUL); any other value is kept packed, as by ir_pack, but with the
+// upvalues of functions, and with standard library functions by name.
+// The values are kept by their registry index in the host's state, which
+// is left as it is in the lua_cb_data or ir_reference: until the host
+// closes its state, it still works with it.  Packed values are unpacked
+// into the IR_REFS table of frz.L, a fresh lua_State, the first time they
+// are needed; if no callback needs Lua, frz.L is never made.
+typedef struct {
+  int ref;            // Registry index in the host's state.
+  char kind;          // 's' for a string, else 'v'.
+  char loaded;        // Unpacked into frz.L yet?
+  size_t off, len;    // Where it is in frz.b.
+} ir_frozen;
+
+typedef struct {
+  const void *cb;     // The callback's lua_cb_data.
+  size_t off;         // Its full name, in frz.b.
+} ir_frozen_name;
+
+static struct {
+  int on;               // Has ir_freeze succeeded?
+  int n, cap;           // Values, sorted by ref once frozen, and room.
+  ir_frozen *v;
+  int nname, namecap;   // Callback names, sorted by cb once frozen.
+  ir_frozen_name *name;
+  ir_sbuf b;            // Values and names.
+  size_t globals;       // The host's other globals, packed as one table
+  size_t nglobals;      // at frz.b + globals, or 0 bytes.
+  lua_State *L;         // Or NULL, until a value is needed.
+} frz;
+
+static int frz_cmp(const void *a, const void *b) {
+  const void *p = ((const ir_frozen_name *)a)->cb;
+  const void *q = ((const ir_frozen_name *)b)->cb;
+  return (p > q) - (p < q);
+}
+
+static int frz_ref_cmp(const void *a, const void *b) {
+  int p = ((const ir_frozen *)a)->ref, q = ((const ir_frozen *)b)->ref;
+  return (p > q) - (p < q);
+}
+
+// The frozen value of the host's reference ref, or NULL.
+static ir_frozen *frz_find(int ref) {
+  ir_frozen key;
+  if (!frz.on || ref < 0) return NULL;
+  key.ref = ref;
+  return (ir_frozen *)bsearch(&key, frz.v, frz.n, sizeof key, frz_ref_cmp);
+}
+
+// The frozen name of callback p, or NULL.
+static const char *frz_name(const void *p) {
+  ir_frozen_name key, *e;
+  if (!frz.on) return NULL;
+  key.cb = p;
+  e = (ir_frozen_name *)bsearch(&key, frz.name, frz.nname, sizeof key, frz_cmp);
+  return e ? frz.b.p + e->off : NULL;
+}
+
+// The frozen state, with value v unpacked into it.  Returns NULL if there
+// is no such value, or it cannot be unpacked.
+static lua_State *frz_load(ir_frozen *v) {
+  ir_crumb c = { 0, "(frozen value)", 0 };
+
+  if (!v) return NULL;
+  if (!frz.L) {
+    lua_State *L = luaL_newstate();
+    if (!L) {
+      (void)Ir_error("%s", "ir_freeze: cannot make a lua_State");
+      return NULL;
+    }
+    luaL_openlibs(L);
+    lua_newtable(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, IR_REFS);
+    if (frz.nglobals > 0) {
+      ir_scur cur = { frz.b.p + frz.globals, frz.nglobals, 0 };
+      ir_snap sn = { "ir_freeze", 1, L, NULL, &cur, NULL, NULL, 1, NULL, NULL };
+      c.name = "(frozen globals)";
+      if (snap_get_value(&sn, &c, 0)) {
+        lua_close(L);
+        return NULL;
+      }
+      for (lua_pushnil(L); lua_next(L, -2); ) {
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, LUA_GLOBALSINDEX);
+      }
+      lua_pop(L, 1);
+    }
+    frz.L = L;
+  }
+  if (!v->loaded) {
+    lua_getfield(frz.L, LUA_REGISTRYINDEX, IR_REFS);
+    if (v->kind == 's') lua_pushlstring(frz.L, frz.b.p + v->off, v->len);
+    else {
+      ir_scur cur = { frz.b.p + v->off, v->len, 0 };
+      ir_snap sn = { "ir_freeze", 1, frz.L, NULL, &cur, NULL, NULL, 1, NULL, NULL };
+      if (snap_get_value(&sn, &c, 0)) {
+        lua_pop(frz.L, 1);
+        return NULL;
+      }
+    }
+    lua_rawseti(frz.L, -2, v->ref);
+    lua_pop(frz.L, 1);
+    v->loaded = 1;
+  }
+  return frz.L;
+}
+
+// The frozen state for evaluating callback cb in Lua, or NULL.
+static lua_State *frz_state(lua_cb_data *cb) {
+  if (!frz.on || cb->fref < 0 || arena_code(cb)) return NULL;
+  return frz_load(frz_find(cb->fref));
+}
+
+// Forget everything frozen.
+static void frz_free(void) {
+  if (frz.L) lua_close(frz.L);
+  free(frz.v);
+  free(frz.name);
+  free(frz.b.p);
+  memset(&frz, 0, sizeof frz);
+}
+
+// Freeze the value at registry index ref in the host's state, s->L.
+static int frz_put(ir_snap *s, const ir_crumb *c, int ref) {
+  lua_State *L = s->L;
+  ir_frozen *v;
+  int errcnt = 0;
+
+  if (frz.n == frz.cap) {
+    int cap = frz.cap ? 2*frz.cap : 64;
+    ir_frozen *nv = (ir_frozen *)realloc(frz.v, cap * sizeof *nv);
+    if (!nv) return Ir_error("ir_freeze: %s: realloc failed", crumb_str(c));
+    frz.v = nv;
+    frz.cap = cap;
+  }
+  v = &frz.v[frz.n++];
+  v->ref = ref;
+  v->loaded = 0;
+  v->off = s->b->n;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+  if (lua_type(L,-1) == LUA_TSTRING) {
+    v->kind = 's';
+    const char *p = lua_tolstring(L, -1, &v->len);
+    sbuf_put(s->b, p, v->len + 1);
+  } else {
+    v->kind = 'v';
+    errcnt = snap_put_value(s, c, lua_gettop(L), 0);
+    v->len = s->b->n - v->off;
+  }
+  lua_pop(L,1);
+  return errcnt;
+}
+
+// Keep the full name of callback cb.
+static int frz_put_name(const ir_crumb *c, const lua_cb_data *cb) {
+  const char *name = crumb_str(c);
+  if (frz.nname == frz.namecap) {
+    int cap = frz.namecap ? 2*frz.namecap : 64;
+    ir_frozen_name *nn = (ir_frozen_name *)realloc(frz.name, cap * sizeof *nn);
+    if (!nn) return Ir_error("ir_freeze: %s: realloc failed", name);
+    frz.name = nn;
+    frz.namecap = cap;
+  }
+  frz.name[frz.nname].cb = cb;
+  frz.name[frz.nname++].off = frz.b.n;
+  sbuf_put(&frz.b, name, strlen(name) + 1);
+  return 0;
+}
+
+// Freeze the callbacks and references under element ep.  bp, ep, and
+// treat_as_scalar are as in iir_unread.
+static int frz_walk(ir_snap *s, const ir_crumb *c, char *bp, ir_element *ep,
+                    int treat_as_scalar) {
+  int i, errcnt = 0;
+
+  if (ep->typ == T_cbk) {
+    lua_cb_data *cb = (lua_cb_data *)bp;
+    if (cb->fref == LUA_REFNIL) return 0; // Not read.
+    errcnt += frz_put_name(c, cb);
+    if (cb->fref >= 0) errcnt += frz_put(s, c, cb->fref);
+
+  } else if (ep->typ == T_ref) {
+    if (*(int *)bp >= 0) errcnt += frz_put(s, c, *(int *)bp);
+
+  } else if (IR_SPARSE(ep)) {
+    ir_sparse *sp = (ir_sparse *)bp;
+    ir_element e = sparse_elem(ep);
+    for (i=0; i < sp->n; i++) {
+      ir_crumb nc = { c, 0, SPARSE_KEY(sp,i) };
+      errcnt += frz_walk(s, &nc, SPARSE_ELEM(sp,i), &e, 0);
+    }
+
+  } else if (ep->typ == T_tbl && ep->fub > 0 && !treat_as_scalar) {
+    for (i=ep->flb; i<=ep->fub; i++) { // Array of structs.
+      ir_crumb nc = { c, 0, i };
+      errcnt += frz_walk(s, &nc, bp + (i - ep->flb)*ep->sz, ep, 1);
+    }
+
+  } else if (ep->typ == T_tbl) { // Scalar struct, or 1 element of an array.
+    ir_element *nep;
+    for (nep = ir_ta[ep->ti]; nep->name; nep++) {
+      if (nep->typ != T_tbl && nep->typ != T_cbk && nep->typ != T_ref) continue;
+      ir_crumb nc = { c, nep->name, 0 };
+      errcnt += frz_walk(s, &nc, bp + nep->off, nep, 0);
+    }
+  }
+  return errcnt;
+}
+
+// Can the Lua value at (absolute) index idx be packed for ir_freeze?  As
+// snap_put_value, but quietly.  The table at index seen holds the tables
+// being checked, to find cycles.
+static int frz_packable(lua_State *L, int idx, int seen, int depth) {
+  int i, ok = 1, tv = lua_type(L, idx);
+  lua_Debug ar;
+
+  if (depth > 64 || !lua_checkstack(L, 4)) return 0;
+  switch (tv) {
+  case LUA_TNIL: case LUA_TBOOLEAN: case LUA_TNUMBER: case LUA_TSTRING:
+    return 1;
+  case LUA_TFUNCTION:
+    lua_pushvalue(L, idx);
+    lua_getinfo(L, ">Su", &ar);
+    if (ar.what[0] == 'C') {
+      char name[256];
+      return snap_cfunc(L, idx, name, sizeof name);
+    }
+    for (i=1; ok && i <= ar.nups; i++) {
+      (void)lua_getupvalue(L, idx, i);
+      ok = frz_packable(L, lua_gettop(L), seen, depth+1);
+      lua_pop(L, 1);
+    }
+    return ok;
+  case LUA_TTABLE:
+    lua_pushvalue(L, idx);
+    lua_rawget(L, seen);
+    ok = lua_isnil(L, -1);
+    lua_pop(L, 1);
+    if (!ok) return 0;
+    lua_pushvalue(L, idx);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, seen);
+    for (lua_pushnil(L); lua_next(L, idx); lua_pop(L, 1)) {
+      int top = lua_gettop(L);
+      if (!frz_packable(L, top-1, seen, depth+1) || !frz_packable(L, top, seen, depth+1)) {
+        lua_pop(L, 2);
+        ok = 0;
+        break;
+      }
+    }
+    lua_pushvalue(L, idx);
+    lua_pushnil(L);
+    lua_rawset(L, seen);
+    return ok;
+  }
+  return 0;
+}
+
+// Is global name one of the standard libraries?
+static int frz_lib(const char *name) {
+  int i;
+  for (i=0; snap_libs[i]; i++)
+    if (strcmp(name, snap_libs[i]) == 0) return 1;
+  return 0;
+}
+
+// Pack the host's globals that callbacks may use: all but the well-known
+// tables, the standard libraries, and values that cannot be packed.
+static int frz_put_globals(ir_snap *s) {
+  lua_State *L = s->L;
+  ir_crumb c = { 0, "(globals)", 0 };
+  int n = 0, t, seen, errcnt;
+
+  lua_newtable(L);
+  t = lua_gettop(L);
+  lua_newtable(L);
+  seen = lua_gettop(L);
+  for (lua_pushnil(L); lua_next(L, LUA_GLOBALSINDEX); lua_pop(L, 1)) {
+    int top = lua_gettop(L);
+    if (lua_type(L, top-1) != LUA_TSTRING || lua_iscfunction(L, top)) continue;
+    if (find_wkt(lua_tostring(L, top-1)) >= 0 || frz_lib(lua_tostring(L, top-1)))
+      continue;
+    if (!frz_packable(L, top, seen, 0)) continue;
+    lua_pushvalue(L, top-1);
+    lua_pushvalue(L, top);
+    lua_rawset(L, t);
+    n++;
+  }
+  lua_pop(L, 1);
+  if (n == 0) {
+    lua_pop(L, 1);
+    return 0;
+  }
+  frz.globals = s->b->n;
+  errcnt = snap_put_value(s, &c, t, 0);
+  frz.nglobals = s->b->n - frz.globals;
+  lua_pop(L, 1);
+  return errcnt;
+}
+
+// Detach the well-known tables from L, after the input has been read, so
+// that the host can close L.  Returns the error count; after an error,
+// nothing is frozen, and L is still in use.
+int ir_freeze(lua_State *L) {
+  size_t i;
+  int errcnt = 0;
+  ir_snap sn = { "ir_freeze", 0, L, &frz.b, NULL, NULL, NULL, 1, NULL, NULL };
+
+  if (!L) return Ir_error("%s", "ir_freeze: NULL lua_State");
+  if (frz.on) return Ir_error("%s", "ir_freeze: already frozen");
+  for (i=0; i < ir_wktt_size && !errcnt; i++) {
+    ir_wkt_desc *w = &ir_wktt[i];
+    ir_crumb c = { 0, w->e.name, 0 };
+    errcnt += frz_walk(&sn, &c, w->p, &w->e, 0);
+  }
+  if (!errcnt) errcnt += frz_put_globals(&sn);
+  if (!errcnt && frz.b.err) errcnt = Ir_error("%s", "ir_freeze: out of memory");
+  if (errcnt) {
+    frz_free();
+    return errcnt;
+  }
+
+  qsort(frz.v, frz.n, sizeof *frz.v, frz_ref_cmp);
+  qsort(frz.name, frz.nname, sizeof *frz.name, frz_cmp);
+  frz.on = 1;
+  Dbg_print("ir_freeze: %d values, %d callbacks, %lu bytes", frz.n, frz.nname,
+    (unsigned long)frz.b.n);
+  return 0;
+}
+
+// The lua_State that holds the frozen Lua values, with all of them
+// unpacked into it, or NULL if there are none.
+lua_State *ir_frozen_state(void) {
+  int k;
+  for (k=0; k < frz.n; k++)
+    if (!frz_load(&frz.v[k])) return NULL;
+  return frz.L;
+}
+
+// Read an (arbitrarily large) string, stored earlier as an ir_reference.
+// The third argument can be NULL if you're not interested in the length.
+// The returned string must be copied into the caller's scope, and you
+// should call lua_pop(L,-1) after that is done, to allow Lua to garbage
+// collect the item.  Typical calling sequence:
 //   if (ir_exists(L, "physics.foo")) {
 //     int nn;
 //     std::string foo = ir_get_stringref(L,irep::physics.foo,&nn);
 //     lua_pop(L,-1);
 //   }
+// After ir_freeze, pass L NULL: the string is returned from the frozen
+// store, and there is nothing to pop.
 const char *ir_get_stringref(lua_State *L, int n, int *len) {
+  if (!L) { // Frozen: the string itself, with nothing to pop.
+    ir_frozen *v = frz_find(n);
+    if (v && v->kind == 's') {
+      if (len) *len = (int)v->len;
+      return frz.b.p + v->off;
+    }
+    if (n != LUA_REFNIL) (void)fprintf(stderr,"ERROR (Lua/IR): "
+      "IR_GET_STRINGREF: no lua_State, and no frozen string\n");
+    return 0;
+  }
   if (n != LUA_REFNIL) {
-    lua_rawgeti(L, LUA_REGISTRYINDEX, n);
+    push_ref(L, n);
     int ii = lua_type(L,-1);
     if (ii == LUA_TSTRING) return lua_tolstring(L,-1,(size_t *)len);
     (void)fprintf(stderr,"ERROR (Lua/IR): IR_GET_STRINGREF: Bad value(%s): "
@@ -153,3 +153,44 @@ function(add_wkt_index_library name)
     ${CMAKE_CURRENT_SOURCE_DIR}
   )
 endfunction()
+
+
+# add_wkt_reflect_header()
+#
+# Generate a C++ header that describes the structs in WKT headers at
+# compile time (see ir_reflect.h).  Add the output to the sources of the
+# targets that include it.
+#
+# Usage:
+#
+#     add_wkt_reflect_header(
+#         foo_reflect.h                # name of header, in the binary dir
+#         wkt_foo.h wkt_bar.h ...      # non-generated wkt headers
+#         [GENERATED wkt_gen1.h ...]   # generated wkt headers (optional)
+#     )
+#
+function(add_wkt_reflect_header name)
+  cmake_parse_arguments(WKT_CXX "" "" "GENERATED" ${ARGN})
+  set(WKT_HEADERS ${WKT_CXX_UNPARSED_ARGUMENTS})
+
+  list(APPEND WKT_HEADERS "${WKT_CXX_GENERATED}")
+  set(list_WKT_HEADERS "")
+  foreach(WKT_H ${WKT_HEADERS})
+    if(NOT WKT_H MATCHES ".h$")
+      message(FATAL_ERROR "Invalid WKT header name: '${WKT_H}'")
+    endif()
+
+    get_filename_component(WKT_H ${WKT_H} ABSOLUTE)
+    list(APPEND list_WKT_HEADERS ${WKT_H})
+  endforeach()
+
+  add_custom_command(
+    OUTPUT ${CMAKE_CURRENT_BINARY_DIR}/${name}
+    DEPENDS ${list_WKT_HEADERS}
+    COMMAND
+      ${CMAKE_COMMAND} -E env CPPFLAGS="-I${IREP_INCLUDE_DIR}"
+      ${IREP_GENERATE} --mode cxx ${list_WKT_HEADERS}
+      > ${CMAKE_CURRENT_BINARY_DIR}/${name}
+    WORKING_DIRECTORY ${CMAKE_CURRENT_SOURCE_DIR}
+  )
+endfunction()